@@ -0,0 +1,34 @@
+// Loaded together with func.c by objopen_many.
+
+int func(int x);
+int func_is_ready(void);
+void batch_fini_called(void);
+
+static int batch_bias = 1000;
+
+// func.c's constructor runs first even when it is loaded after us.
+__attribute__((constructor))
+static void batch_init(void) {
+  if (func_is_ready()) batch_bias = 0;
+}
+
+__attribute__((destructor))
+static void batch_fini(void) {
+  batch_fini_called();
+}
+
+int batch_func(int x) {
+  return func(x) * 2 + batch_bias;
+}
+
+// Thread-local counters of the object's own, and one of the host's.
+__attribute__((tls_model("global-dynamic"))) __thread int batch_tls = 5;
+__attribute__((tls_model("local-dynamic")))
+static __thread int batch_tls_local;
+extern __thread int host_tls;
+
+int batch_tls_func(int x) {
+  batch_tls += x;
+  batch_tls_local += x;
+  return batch_tls * 100 + batch_tls_local + host_tls;
+}
@@ -0,0 +1,203 @@
+// Times objopen and objsym on the objects written by gen_bench, and
+// dlopen and dlsym on the shared ones.
+//
+//   bench <iterations> <object>...
+
+#include "objfcn.h"
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define NUM_LOOKUPS 100000
+#define MAX_NAMES 4096
+
+typedef int (*func_t)(int);
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Relocations in the file, static and dynamic.
+static long count_relocs(const char* filename) {
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) return 0;
+  Elf64_Ehdr ehdr;
+  long n = 0;
+  if (fread(&ehdr, sizeof(ehdr), 1, fp) == 1) {
+    for (int i = 0; i < ehdr.e_shnum; i++) {
+      Elf64_Shdr shdr;
+      fseek(fp, ehdr.e_shoff + i * ehdr.e_shentsize, SEEK_SET);
+      if (fread(&shdr, sizeof(shdr), 1, fp) != 1) break;
+      if ((shdr.sh_type == SHT_RELA || shdr.sh_type == SHT_REL) &&
+          shdr.sh_entsize) {
+        n += shdr.sh_size / shdr.sh_entsize;
+      }
+    }
+  }
+  fclose(fp);
+  return n;
+}
+
+static int is_dyn(const char* filename) {
+  FILE* fp = fopen(filename, "rb");
+  Elf64_Ehdr ehdr;
+  int r = fp && fread(&ehdr, sizeof(ehdr), 1, fp) == 1 &&
+          ehdr.e_type == ET_DYN;
+  if (fp) fclose(fp);
+  return r;
+}
+
+static char* hit_names[MAX_NAMES];
+static char* miss_names[MAX_NAMES];
+static int num_names;
+
+static void make_names(void* handle) {
+  for (num_names = 0; num_names < MAX_NAMES; num_names++) {
+    char name[64];
+    snprintf(name, sizeof(name), "bench_func_%d", num_names);
+    if (!objsym(handle, name)) break;
+    hit_names[num_names] = strdup(name);
+    snprintf(name, sizeof(name), "bench_miss_%d", num_names);
+    miss_names[num_names] = strdup(name);
+  }
+}
+
+static void print_latency(const char* what, double* t, int n, long relocs) {
+  qsort(t, n, sizeof(double), compare_double);
+  printf("  %-7s p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  max %8.1f us",
+         what, t[n / 2] * 1e6, t[n * 9 / 10] * 1e6, t[n * 99 / 100] * 1e6,
+         t[n - 1] * 1e6);
+  if (relocs) {
+    printf("  %6.2f Mrelocs/s", relocs / t[n / 2] * 1e-6);
+  }
+  printf("\n");
+}
+
+static void print_lookups(const char* what, double hit, double miss) {
+  printf("  %-7s %6.2f M hits/s  %6.2f M misses/s\n", what,
+         NUM_LOOKUPS / hit * 1e-6, NUM_LOOKUPS / miss * 1e-6);
+}
+
+static double time_lookups(void* handle, char** names,
+                           void* (*lookup)(void*, const char*)) {
+  volatile uintptr_t sink = 0;
+  double start = now();
+  for (int i = 0; i < NUM_LOOKUPS; i++) {
+    sink += (uintptr_t)lookup(handle, names[i % num_names]);
+  }
+  return now() - start;
+}
+
+static void bench_object(const char* filename, int iterations) {
+  double* t = (double*)malloc(sizeof(double) * iterations);
+  long relocs = count_relocs(filename);
+  printf("%s: %ld relocations\n", filename, relocs);
+
+  void* handle = NULL;
+  for (int i = 0; i < iterations; i++) {
+    double start = now();
+    handle = objopen(filename, 0);
+    t[i] = now() - start;
+    if (!handle) {
+      fprintf(stderr, "objopen failed: %s\n", objerror());
+      exit(1);
+    }
+    if (i + 1 < iterations) objclose(handle);
+  }
+  print_latency("objopen", t, iterations, relocs);
+
+  obj_stats st;
+  void* sh = objopen(filename, OBJFCN_STATS);
+  if (sh && objstat(sh, &st) == 0) {
+    printf("  phases  read %.1f us  load %.1f us  relocate %.1f us"
+           " (lookups %.1f us)  init %.1f us\n",
+           st.read_ns * 1e-3, st.load_ns * 1e-3, st.relocate_ns * 1e-3,
+           st.resolve_ns * 1e-3, st.init_ns * 1e-3);
+    printf("  lookups %llu, %llu cache hits, %llu dlsym;"
+           " %llu PLT stubs, %llu GOT slots\n",
+           (unsigned long long)st.lookups,
+           (unsigned long long)st.lookup_cache_hits,
+           (unsigned long long)st.host_lookups,
+           (unsigned long long)st.plt_stubs,
+           (unsigned long long)st.got_slots);
+  }
+  if (sh) objclose(sh);
+
+  obj_arena_stats stats;
+  objarena_stats(&stats);
+  printf("  arena   %zu bytes used\n", stats.used);
+
+  make_names(handle);
+  if (num_names) {
+    char expected[16];
+    func_t fp = (func_t)objsym(handle, hit_names[0]);
+    snprintf(expected, sizeof(expected), "%d", fp(1));
+    print_lookups("objsym", time_lookups(handle, hit_names, objsym),
+                  time_lookups(handle, miss_names, objsym));
+
+    if (is_dyn(filename)) {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s%s", strchr(filename, '/') ? "" : "./",
+               filename);
+      for (int i = 0; i < iterations; i++) {
+        double start = now();
+        void* dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        t[i] = now() - start;
+        if (!dl) {
+          fprintf(stderr, "dlopen failed: %s\n", dlerror());
+          exit(1);
+        }
+        dlclose(dl);
+      }
+      print_latency("dlopen", t, iterations, relocs);
+
+      void* dl = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+      char actual[16];
+      snprintf(actual, sizeof(actual), "%d",
+               ((func_t)dlsym(dl, hit_names[0]))(1));
+      if (strcmp(expected, actual)) {
+        fprintf(stderr, "%s: objfcn gives %s but dlopen %s\n",
+                hit_names[0], expected, actual);
+        exit(1);
+      }
+      print_lookups("dlsym", time_lookups(dl, hit_names, dlsym),
+                    time_lookups(dl, miss_names, dlsym));
+      dlclose(dl);
+    }
+  }
+  objclose(handle);
+  for (int i = 0; i < num_names; i++) {
+    free(hit_names[i]);
+    free(miss_names[i]);
+  }
+  free(t);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <iterations> <object>...\n", argv[0]);
+    return 1;
+  }
+  int iterations = atoi(argv[1]);
+  if (iterations < 1) iterations = 1;
+  for (int i = 2; i < argc; i++) {
+    bench_object(argv[i], iterations);
+  }
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("peak RSS %ld KiB\n", ru.ru_maxrss);
+  return 0;
+}
@@ -2,7 +2,17 @@
 
 #include <stdio.h>
 
+extern "C" void note_dtor(int which);
+
 namespace {
+struct Noted {
+  int which;
+  int uses;
+  ~Noted() { note_dtor(which); }
+};
+
+Noted g_noted = {1, 0};
+thread_local Noted g_tls_noted = {2, 0};
 thread_local int g_tls_var = 19;
 thread_local int g_tls_var2 = 120;
 thread_local int g_tls_bss;
@@ -17,6 +27,8 @@ static void init() {
 extern "C" {
   int func(int x) {
     g_tls_var++;
+    g_noted.uses++;
+    g_tls_noted.uses++;
     g_tls_bss -= 3;
     g_tls_bss2 += 3;
     return x + g_tls_var + g_tls_var2 + g_tls_bss + g_tls_bss2;
@@ -0,0 +1,9 @@
+// Loaded by test_objfcn on x86-64. -fPIE code refers to external data
+// with PC32, expecting a copy relocation, and libc's environ is usually
+// too far from the arena for that.
+
+extern char** environ;
+
+char** far_environ(void) {
+  return environ;
+}
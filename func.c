@@ -15,3 +15,15 @@ int func(int x) {
   g_value = x;
   return x + g_counter + g_value + g_const + func_in_main();
 }
+
+// Set by the constructor, for objects which call func from their own.
+static int func_ready;
+
+__attribute__((constructor))
+static void func_init(void) {
+  func_ready = 1;
+}
+
+int func_is_ready(void) {
+  return func_ready;
+}
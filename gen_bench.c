@@ -0,0 +1,84 @@
+// Writes the sources of the objects bench loads.
+//
+//   gen_bench obj <funcs> <externs> <bss_kb>
+//     C with <funcs> functions. Each calls the previous one, reads
+//     globals, calls one of <externs> distinct external functions and
+//     strlen, which every function shares, and sits in a table of
+//     pointers. <bss_kb> KiB of .bss.
+//   gen_bench ext <externs>
+//     The external functions, for the bench binary.
+//   gen_bench cpp <funcs>
+//     C++ with thread_local variables, one with a destructor, and a
+//     constructor per function.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void gen_obj(int funcs, int externs, int bss_kb) {
+  printf("#include <string.h>\n\n");
+  printf("char bench_bss[%d];\n", bss_kb * 1024);
+  printf("int bench_data[%d];\n", funcs);
+  printf("const char bench_str[] = \"objfcn\";\n\n");
+  for (int i = 0; i < externs; i++) {
+    printf("int bench_ext_%d(int);\n", i);
+  }
+  printf("\n");
+  for (int i = 0; i < funcs; i++) {
+    printf("int bench_func_%d(int x) {\n", i);
+    if (i) {
+      printf("  x += bench_func_%d(x - 1);\n", i - 1);
+    }
+    if (externs) {
+      printf("  x += bench_ext_%d(x);\n", i % externs);
+    }
+    printf("  bench_bss[%d] = x;\n", (int)((i * 4093L) % (bss_kb * 1024L)));
+    printf("  return x + bench_data[%d] + (int)strlen(bench_str);\n}\n\n",
+           i);
+  }
+  printf("int (*const bench_table[])(int) = {\n");
+  for (int i = 0; i < funcs; i++) {
+    printf("  bench_func_%d,\n", i);
+  }
+  printf("};\n");
+}
+
+static void gen_ext(int externs) {
+  for (int i = 0; i < externs; i++) {
+    printf("int bench_ext_%d(int x) { return x + %d; }\n", i, i);
+  }
+}
+
+static void gen_cpp(int funcs) {
+  printf("#include <string>\n\n");
+  printf("namespace {\n");
+  printf("thread_local int tls_counter;\n");
+  printf("thread_local std::string tls_name;\n");
+  printf("}\n\n");
+  for (int i = 0; i < funcs; i++) {
+    printf("struct BenchInit%d {\n", i);
+    printf("  BenchInit%d() { tls_counter += %d; }\n", i, i);
+    printf("  int value = %d;\n", i);
+    printf("};\n");
+    printf("static BenchInit%d bench_init_%d;\n", i, i);
+    printf("extern \"C\" int bench_func_%d(int x) {\n", i);
+    printf("  tls_name = \"bench\";\n");
+    printf("  return x + tls_counter + bench_init_%d.value + "
+           "(int)tls_name.size();\n}\n\n", i);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc >= 5 && !strcmp(argv[1], "obj")) {
+    gen_obj(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+  } else if (argc >= 3 && !strcmp(argv[1], "ext")) {
+    gen_ext(atoi(argv[2]));
+  } else if (argc >= 3 && !strcmp(argv[1], "cpp")) {
+    gen_cpp(atoi(argv[2]));
+  } else {
+    fprintf(stderr, "usage: %s obj <funcs> <externs> <bss_kb> |"
+            " ext <externs> | cpp <funcs>\n", argv[0]);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,8 @@
+// Linked against func_64.so, which OBJFCN_LOAD_NEEDED finds through
+// DT_RUNPATH.
+
+int func(int x);
+
+int needed_func(int x) {
+  return func(x) + 1;
+}
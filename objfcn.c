@@ -7,45 +7,77 @@
 #include <dlfcn.h>
 #include <elf.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-#define OBJFCN_LOG 1
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
-#define OBJFCN_TLS_SIZE 8192
+// Build with -DOBJFCN_ZLIB=1 (and -lz) or -DOBJFCN_ZSTD=1 (and -lzstd)
+// to let OBJFCN_STREAM inflate SHF_COMPRESSED sections of those kinds.
+#if OBJFCN_ZLIB
+#include <zlib.h>
+#endif
+#if OBJFCN_ZSTD
+#include <zstd.h>
+#endif
 
-#if OBJFCN_LOG
-# define LOGF(...) if (1) fprintf(stderr, __VA_ARGS__)
-#else
-# define LOGF(...) if (0) fprintf(stderr, __VA_ARGS__)
+// Build with -DOBJFCN_LOG=0 to compile logging out entirely. Otherwise
+// the level is chosen at runtime by OBJFCN_LOG_LEVEL or objlog_set_level
+// and messages below it cost a single compare.
+#ifndef OBJFCN_LOG
+# define OBJFCN_LOG 1
 #endif
 
+static int obj_log_level = OBJFCN_LOG_ERROR;
+static obj_map_callback obj_map_cb;
+static void* obj_map_cb_arg;
+
+#define LOGF(level, ...) \
+  if (OBJFCN_LOG && obj_log_level >= (level)) fprintf(stderr, __VA_ARGS__)
+
 #define OBJFCN_SPLIT_ALLOC 0
 
 #if defined(__x86_64__)
 # define R_64 R_X86_64_64
 # define R_PC32 R_X86_64_PC32
-# define R_PLT32 R_X86_64_PLT32
 # define R_RELATIVE R_X86_64_RELATIVE
 # define R_GLOB_DAT R_X86_64_GLOB_DAT
 # define R_JUMP_SLOT R_X86_64_JUMP_SLOT
 # define DYN_SUPPORTED 1
+# define OBJFCN_LAZY_SUPPORTED 1
+# define OBJFCN_CACHE_SUPPORTED 1
+# define RELOC_TABLE_SIZE R_X86_64_NUM
 #elif defined(__i386__)
 # define R_32 R_386_32
 # define R_PC32 R_386_PC32
+# define R_RELATIVE R_386_RELATIVE
+# define R_GLOB_DAT R_386_GLOB_DAT
+# define R_JUMP_SLOT R_386_JMP_SLOT
+# define DYN_SUPPORTED 1
+# define RELOC_TABLE_SIZE R_386_NUM
 #elif defined(__arm__)
+# define RELOC_TABLE_SIZE R_ARM_NUM
 #elif defined(__aarch64__)
 # define R_64 R_AARCH64_ABS64
 # define R_RELATIVE R_AARCH64_RELATIVE
 # define R_GLOB_DAT R_AARCH64_GLOB_DAT
 # define R_JUMP_SLOT R_AARCH64_JUMP_SLOT
 # define DYN_SUPPORTED 1
+# define RELOC_TABLE_SIZE 1024
 #else
 # error "Unsupported architecture"
 #endif
@@ -62,8 +94,12 @@
 # define Elf_Versym Elf64_Versym
 # define Elf_Verneed Elf64_Verneed
 # define Elf_Vernaux Elf64_Vernaux
+# define Elf_Chdr Elf64_Chdr
+# define DT_RELOC DT_RELA
+# define DT_RELOCSZ DT_RELASZ
 # define ELFW_ST_BIND(v) ELF64_ST_BIND(v)
 # define ELFW_ST_TYPE(v) ELF64_ST_TYPE(v)
+# define ELFW_ST_INFO(b, t) ELF64_ST_INFO(b, t)
 # define ELFW_R_SYM(v) ELF64_R_SYM(v)
 # define ELFW_R_TYPE(v) ELF64_R_TYPE(v)
 #else
@@ -78,19 +114,36 @@
 # define Elf_Versym Elf32_Versym
 # define Elf_Verneed Elf32_Verneed
 # define Elf_Vernaux Elf32_Vernaux
+# define Elf_Chdr Elf32_Chdr
+# define DT_RELOC DT_REL
+# define DT_RELOCSZ DT_RELSZ
 # define ELFW_ST_BIND(v) ELF32_ST_BIND(v)
 # define ELFW_ST_TYPE(v) ELF32_ST_TYPE(v)
+# define ELFW_ST_INFO(b, t) ELF32_ST_INFO(b, t)
 # define ELFW_R_SYM(v) ELF32_R_SYM(v)
 # define ELFW_R_TYPE(v) ELF32_R_TYPE(v)
 #endif
 
-__thread char g_objfcn_tls[OBJFCN_TLS_SIZE];
-
 typedef struct {
   char* name;
   char* addr;
+  size_t size;
+  int type;
 } symbol;
 
+// Index over the global and weak symbols of a relocatable object, laid
+// out like DT_GNU_HASH: exported symbols occupy the front of
+// obj->symbols grouped by bucket, and hashvals has the low bit set on
+// the last symbol of each chain.
+typedef struct {
+  uint32_t nbuckets;
+  uint32_t maskwords;  // power of two
+  uint32_t shift2;
+  Elf_Addr* bloom;
+  uint32_t* buckets;   // first symbol of the bucket + 1, 0 if empty
+  uint32_t* hashvals;
+} sym_index;
+
 typedef struct {
   uint32_t nbuckets;
   uint32_t nchain;
@@ -144,12 +197,70 @@ static uint32_t gnu_hash_calc(const char* p) {
   return h;
 }
 
+#define BLOOM_BITS (sizeof(Elf_Addr) * 8)
+
+static int gnu_hash_bloom_test(const Elf_Addr* bloom, uint32_t maskwords,
+                               uint32_t shift2, uint32_t h) {
+  Elf_Addr word = bloom[(h / BLOOM_BITS) & (maskwords - 1)];
+  return ((word >> (h % BLOOM_BITS)) &
+          (word >> ((h >> shift2) % BLOOM_BITS)) & 1);
+}
+
+static void gnu_hash_bloom_add(Elf_Addr* bloom, uint32_t maskwords,
+                               uint32_t shift2, uint32_t h) {
+  bloom[(h / BLOOM_BITS) & (maskwords - 1)] |=
+      ((Elf_Addr)1 << (h % BLOOM_BITS)) |
+      ((Elf_Addr)1 << ((h >> shift2) % BLOOM_BITS));
+}
+
+// Results of dlsym/dlvsym keyed by (name, version), so each distinct
+// external symbol is looked up in the host only once.
+typedef struct {
+  char* name;
+  char* version;
+  uint32_t hash;
+  void* addr;
+} sym_cache_entry;
+
+typedef struct {
+  sym_cache_entry* entries;
+  size_t capacity;  // power of two
+  size_t count;
+} sym_cache;
+
+// Parts of a loaded object which get different protection under
+// OBJFCN_WX. PLT stubs go with text and GOT slots with rodata.
+enum {
+  SEG_TEXT,
+  SEG_RODATA,
+  SEG_DATA,
+  NUM_SEGS
+};
+
 typedef struct {
+  char* start;
+  size_t size;
+} region;
+
+// Defined global symbols sorted by name, for objsym_foreach and
+// objsym_prefix. Built on first use and published with a CAS, so
+// concurrent callers may both build it and one copy is dropped.
+typedef struct sym_table {
+  obj_symbol_info* syms;
+  int count;
+} sym_table;
+
+typedef struct obj_handle {
   symbol* symbols;
   int num_symbols;
+  int num_exported;  // leading entries of symbols covered by index
+  sym_index index;
   char* code;
   size_t code_size;
-  size_t code_used;
+  size_t code_align;
+  region segs[NUM_SEGS];
+  struct huge_block* huge_text;  // holds segs[SEG_TEXT] if set
+  int flags;
 
   int is_dyn;
   char* base;
@@ -160,822 +271,6179 @@ typedef struct {
   Elf_Versym* versym;
   Elf_Verneed* verneed;
   const char** verstrs;  // indexed by versym
+  int segments_mapped;
+  Elf_Rel* jmprel;  // for OBJFCN_LAZY
+  sym_cache* resolve_cache;  // only while loading
+  char* filename;
+  struct obj_chunk* chunk;  // holds code if set, see objopen_many
+  struct obj_batch* batch;  // only while objopen_many links the object
+  int batch_index;
+  int tls_module;  // 0 without PT_TLS
+  sym_table* sorted_syms;  // built by the first objsym_foreach
+  struct global_sym* global_syms;  // published with OBJFCN_GLOBAL
+  int num_global_syms;
+  struct needed_lib** needed;  // DT_NEEDED loaded by us, see load_needed
+  int num_needed;
+  struct obj_handle** deps;  // search order over needed, transitively
+  int num_deps;
+  obj_stats* stats;  // with OBJFCN_STATS
+  region stub_segs[2];  // PLT stubs and GOT slots we emitted
+  struct jit_code_entry* jit_entry;  // with OBJFCN_PROF_GDB_JIT
+  void** init_funcs;  // DT_INIT and the init arrays, in call order
+  int num_init;
+  void** fini_funcs;  // DT_FINI and the fini arrays, called last first
+  int num_fini;
+  int initialized;
+  uint64_t serial;  // tells handles at the same address apart
+  struct obj_handle* next_live;
+  char* dso_handle;  // __dso_handle of relocatable objects, in the GOT
+  struct reload_table* reload;  // with OBJFCN_RELOADABLE
+  struct reload_redirect* redirects;  // function => stub, see objreload
+  size_t redirect_mask;
 } obj_handle;
 
-static char obj_error[256];
+// Objects loaded together by objopen_many. Undefined symbols of the
+// relocatable members are looked up in the other members first.
+typedef struct obj_batch {
+  obj_handle** objs;  // NULL for members which have failed
+  int count;
+  uint8_t* deps;  // deps[i * count + j] if member i binds to member j
+} obj_batch;
 
-static uintptr_t align_down(uintptr_t v, size_t align) {
-  return v & ~(align - 1);
-}
+// Each thread sees the error of its own last failed call.
+static __thread char obj_error[256];
 
-static uintptr_t align_up(uintptr_t v, size_t align) {
-  return align_down(v + align - 1, align);
+void objlog_set_level(int level) {
+  obj_log_level = level;
 }
 
-#if OBJFCN_SPLIT_ALLOC
+// Statistics of handles loaded with OBJFCN_STATS. Everything is behind
+// a check of obj->stats. Counters may be bumped by lazy binding on any
+// thread, so they are added atomically.
+static obj_stats total_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static char* alloc_code(obj_handle* obj, size_t size) {
-  char* r = obj->code + obj->code_used;
-  obj->code_used += size;
-  return r;
+static uint64_t stat_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void align_code(obj_handle* obj, size_t align) {
-  obj->code_used = align_up(obj->code_used, align);
+static void stat_add(uint64_t* counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
 }
 
-#else
+static void stat_reloc_n(obj_stats* stats, unsigned type, uint64_t n) {
+  stats->relocs += n;
+  for (int i = 0; i < OBJFCN_STAT_RELOC_TYPES; i++) {
+    obj_reloc_count* c = &stats->reloc_types[i];
+    if (c->count && c->type != type) continue;
+    c->type = type;
+    c->count += n;
+    return;
+  }
+  stats->reloc_types_other += n;
+}
 
-static char* code;
-static size_t code_used;
+// Gives |obj| its stats under OBJFCN_STATS.
+static int stat_begin(obj_handle* obj, uint64_t read_ns) {
+  if (!(obj->flags & OBJFCN_STATS)) return 1;
+  obj->stats = (obj_stats*)calloc(1, sizeof(obj_stats));
+  if (!obj->stats) {
+    sprintf(obj_error, "malloc failed");
+    return 0;
+  }
+  obj->stats->num_objects = 1;
+  obj->stats->read_ns = read_ns;
+  return 1;
+}
 
-static char* alloc_code(obj_handle* obj, size_t size) {
-  char* r = code + code_used;
-  code_used += size;
-  return r;
+static void stat_merge(obj_stats* to, const obj_stats* from);
+
+// Completes the stats of an object loaded since |start|.
+static void stat_finish(obj_handle* obj, uint64_t start) {
+  obj_stats* stats = obj->stats;
+  if (!stats) return;
+  stats->total_ns = stat_now() - start;
+  uint64_t other = stats->read_ns + stats->relocate_ns + stats->init_ns;
+  stats->load_ns = stats->total_ns > other ? stats->total_ns - other : 0;
+  stats->code_bytes = obj->code_size;
+  pthread_mutex_lock(&stats_lock);
+  stat_merge(&total_stats, stats);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// Adds |from| to |to|, which is locked by the caller.
+static void stat_merge(obj_stats* to, const obj_stats* from) {
+  to->num_objects += from->num_objects;
+  to->cached += from->cached;
+  to->read_ns += from->read_ns;
+  to->load_ns += from->load_ns;
+  to->relocate_ns += from->relocate_ns;
+  to->resolve_ns += from->resolve_ns;
+  to->init_ns += from->init_ns;
+  to->total_ns += from->total_ns;
+  for (int i = 0; i < OBJFCN_STAT_RELOC_TYPES; i++) {
+    const obj_reloc_count* c = &from->reloc_types[i];
+    if (c->count) stat_reloc_n(to, c->type, c->count);
+  }
+  // stat_reloc_n counted the others in relocs.
+  to->reloc_types_other += from->reloc_types_other;
+  to->relocs += from->reloc_types_other;
+  to->lookups += from->lookups;
+  to->lookup_cache_hits += from->lookup_cache_hits;
+  to->host_lookups += from->host_lookups;
+  to->plt_stubs += from->plt_stubs;
+  to->got_slots += from->got_slots;
+  to->code_bytes += from->code_bytes;
 }
 
-static void align_code(obj_handle* obj, size_t align) {
-  code_used = align_up(code_used, align);
+void objlog_set_map_callback(obj_map_callback cb, void* arg) {
+  obj_map_cb = cb;
+  obj_map_cb_arg = arg;
 }
 
-static void init(void) {
-  code = (char*)mmap(NULL, 1024 * 1024 * 1024,
-                     PROT_READ | PROT_WRITE | PROT_EXEC,
-                     MAP_PRIVATE | MAP_ANONYMOUS,
-                     -1, 0);
-  if (code == MAP_FAILED) {
-    sprintf(obj_error, "mmap failed");
+static void init_log(void) {
+  const char* level = getenv("OBJFCN_LOG_LEVEL");
+  if (level) {
+    obj_log_level = atoi(level);
+  }
+  const char* prof = getenv("OBJFCN_PROF");
+  if (prof) {
+    objprof_set(strtol(prof, NULL, 0));
   }
 }
 
-#endif
+static void prof_notify(const char* event, obj_handle* obj);
 
-static char* read_file(const char* filename) {
-  FILE* fp = NULL;
-  char* bin = NULL;
-  long filesize = 0;
-  fp = fopen(filename, "rb");
-  if (fp == NULL) {
-    sprintf(obj_error, "failed to open %s: %s", filename, strerror(errno));
-    return NULL;
+static void log_map(const char* event, obj_handle* obj) {
+  prof_notify(event, obj);
+  if (obj_map_cb) {
+    obj_map_cb(event, obj->code, obj->code + obj->code_size, obj->filename,
+               obj_map_cb_arg);
   }
+}
 
-  if (fseek(fp, 0, SEEK_END) != 0) {
-    sprintf(obj_error, "fseek failed: %s", strerror(errno));
-    goto error;
+static int str_eq(const char* a, const char* b) {
+  if (a == NULL || b == NULL) return a == b;
+  return !strcmp(a, b);
+}
+
+static sym_cache_entry* sym_cache_find(sym_cache* cache, const char* name,
+                                       const char* version, uint32_t hash) {
+  if (!cache->capacity) return NULL;
+  size_t mask = cache->capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    sym_cache_entry* e = &cache->entries[i];
+    if (e->name == NULL) return e;
+    if (e->hash == hash && !strcmp(e->name, name) &&
+        str_eq(e->version, version)) {
+      return e;
+    }
   }
+}
 
-  filesize = ftell(fp);
-  if (filesize < 0) {
-    sprintf(obj_error, "ftell failed: %s", strerror(errno));
-    goto error;
+static void sym_cache_insert(sym_cache* cache, const char* name,
+                             const char* version, uint32_t hash, void* addr) {
+  if ((cache->count + 1) * 2 > cache->capacity) {
+    sym_cache grown;
+    grown.capacity = cache->capacity ? cache->capacity * 2 : 64;
+    grown.count = cache->count;
+    grown.entries = (sym_cache_entry*)calloc(grown.capacity,
+                                             sizeof(sym_cache_entry));
+    if (grown.entries == NULL) return;
+    for (size_t i = 0; i < cache->capacity; i++) {
+      sym_cache_entry* e = &cache->entries[i];
+      if (e->name) {
+        *sym_cache_find(&grown, e->name, e->version, e->hash) = *e;
+      }
+    }
+    free(cache->entries);
+    *cache = grown;
   }
 
-  if (fseek(fp, 0, SEEK_SET) != 0) {
-    sprintf(obj_error, "fseek failed: %s", strerror(errno));
-    goto error;
+  sym_cache_entry* e = sym_cache_find(cache, name, version, hash);
+  if (e->name) return;
+  e->name = strdup(name);
+  e->version = version ? strdup(version) : NULL;
+  e->hash = hash;
+  e->addr = addr;
+  cache->count++;
+}
+
+static void sym_cache_clear(sym_cache* cache) {
+  for (size_t i = 0; i < cache->capacity; i++) {
+    free(cache->entries[i].name);
+    free(cache->entries[i].version);
   }
+  free(cache->entries);
+  memset(cache, 0, sizeof(*cache));
+}
 
-  bin = (char*)malloc(filesize);
-  if (fread(bin, 1, filesize, fp) != (size_t)filesize) {
-    sprintf(obj_error, "fread failed: %s", strerror(errno));
-    goto error;
+// Shared by objopen calls with OBJFCN_SHARED_SYMBOL_CACHE. Only hits
+// are kept here, as the host may dlopen more libraries between loads.
+static sym_cache shared_sym_cache;
+static pthread_mutex_t shared_sym_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* objsym_dyn_hashed(obj_handle* obj, const char* symbol,
+                               uint32_t gnu_h);
+
+// Symbols of handles loaded with OBJFCN_GLOBAL, consulted before the
+// host. Each name's entries stay in load order, so the first handle
+// defining a name wins as with RTLD_GLOBAL.
+typedef struct global_sym {
+  const char* name;  // owned by the handle's sorted_syms
+  uint32_t hash;
+  void* addr;
+  struct global_sym* next;
+} global_sym;
+
+static global_sym** global_buckets;
+static size_t global_nbuckets;  // power of two
+static size_t global_count;
+static pthread_rwlock_t global_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void* global_lookup(const char* name, uint32_t hash) {
+  void* addr = NULL;
+  if (!__atomic_load_n(&global_count, __ATOMIC_RELAXED)) return NULL;
+  pthread_rwlock_rdlock(&global_lock);
+  if (global_nbuckets) {
+    global_sym* g = global_buckets[hash & (global_nbuckets - 1)];
+    for (; g; g = g->next) {
+      if (g->hash == hash && !strcmp(g->name, name)) {
+        addr = g->addr;
+        break;
+      }
+    }
   }
+  pthread_rwlock_unlock(&global_lock);
+  return addr;
+}
+
+// Appends |g| to its bucket. Called with global_lock held for writing.
+static void global_append(global_sym* g) {
+  global_sym** p = &global_buckets[g->hash & (global_nbuckets - 1)];
+  while (*p) p = &(*p)->next;
+  g->next = NULL;
+  *p = g;
+}
 
-  fclose(fp);
-  return bin;
+// Handles whose constructors have run, newest first. Destructors find
+// their object here by address and check it is still open.
+static obj_handle* live_objs;
+static uint64_t live_serial;
+static pthread_rwlock_t live_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void live_insert(obj_handle* obj) {
+  pthread_rwlock_wrlock(&live_lock);
+  obj->serial = ++live_serial;
+  obj->next_live = live_objs;
+  live_objs = obj;
+  pthread_rwlock_unlock(&live_lock);
+}
 
-error:
-  free(bin);
-  fclose(fp);
+static void live_remove(obj_handle* obj) {
+  pthread_rwlock_wrlock(&live_lock);
+  for (obj_handle** p = &live_objs; *p; p = &(*p)->next_live) {
+    if (*p == obj) {
+      *p = obj->next_live;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&live_lock);
+}
+
+// The handle |addr| belongs to. Called with live_lock held.
+static obj_handle* live_find(void* addr) {
+  for (obj_handle* obj = live_objs; obj; obj = obj->next_live) {
+    char* p = (char*)addr;
+    if ((obj->dso_handle && p == obj->dso_handle) ||
+        (p >= obj->code && p < obj->code + obj->code_size)) {
+      return obj;
+    }
+  }
   return NULL;
 }
 
-static int should_load(Elf_Shdr* shdr) {
-#ifdef SHT_ARM_EXIDX
-  return shdr->sh_flags & SHF_ALLOC && shdr->sh_type != SHT_ARM_EXIDX;
-#else
-  return shdr->sh_flags & SHF_ALLOC;
+// C++ thread_local destructors. The host's __cxa_thread_atexit would
+// take our objects for the main program and run their destructors after
+// objclose, so objects bind to objfcn_cxa_thread_atexit instead. Each
+// thread keeps its own list. objclose runs the entries of the calling
+// thread; other threads skip the entries of closed handles when they
+// exit, leaking what those destructors would have freed.
+typedef struct thread_dtor {
+  void (*func)(void*);
+  void* arg;
+  obj_handle* obj;  // NULL if the host owns it
+  uint64_t serial;
+  struct thread_dtor* next;
+} thread_dtor;
+
+static __thread thread_dtor* thread_dtors;
+static pthread_key_t thread_dtor_key;
+
+#ifdef __cplusplus
+extern "C" {
 #endif
+int __cxa_thread_atexit_impl(void (*func)(void*), void* arg, void* dso)
+    __attribute__((weak));
+void __cxa_finalize(void* dso) __attribute__((weak));
+#ifdef __cplusplus
 }
+#endif
 
-static size_t relocate(obj_handle* obj,
-                       const char* bin,
-                       Elf_Sym* symtab,
-                       const char* strtab,
-                       char** addrs,
-                       int code_size_only) {
-  size_t code_size = 0;
-  Elf_Ehdr* ehdr = (Elf_Ehdr*)bin;
-  Elf_Shdr* shdrs = (Elf_Shdr*)(bin + ehdr->e_shoff);
-  for (int i = 0; i < ehdr->e_shnum; i++) {
-    Elf_Shdr* shdr = &shdrs[i];
-    int has_addend = shdr->sh_type == SHT_RELA;
-    size_t relsize = has_addend ? sizeof(Elf_Rela) : sizeof(Elf_Rel);
-    int relnum = shdr->sh_size / relsize;
-    char* target_base = addrs[shdr->sh_info];
+static int objfcn_cxa_thread_atexit(void (*func)(void*), void* arg,
+                                    void* dso) {
+  pthread_rwlock_rdlock(&live_lock);
+  obj_handle* obj = live_find(dso);
+  uint64_t serial = obj ? obj->serial : 0;
+  pthread_rwlock_unlock(&live_lock);
+  if (!obj && __cxa_thread_atexit_impl) {
+    return __cxa_thread_atexit_impl(func, arg, dso);
+  }
+
+  thread_dtor* d = (thread_dtor*)malloc(sizeof(thread_dtor));
+  if (!d) return -1;
+  d->func = func;
+  d->arg = arg;
+  d->obj = obj;
+  d->serial = serial;
+  d->next = thread_dtors;
+  thread_dtors = d;
+  pthread_setspecific(thread_dtor_key, (void*)1);
+  return 0;
+}
 
-    if ((shdr->sh_type != SHT_REL && shdr->sh_type != SHT_RELA) ||
-        !should_load(&shdrs[shdr->sh_info])) {
+// Runs the calling thread's destructors for |obj| last registered
+// first, or all of them for NULL. A destructor may register more, so
+// the list is rescanned after each one.
+static void run_thread_dtors(obj_handle* obj) {
+  thread_dtor** p = &thread_dtors;
+  while (*p) {
+    thread_dtor* d = *p;
+    if (obj && d->obj != obj) {
+      p = &d->next;
       continue;
     }
+    *p = d->next;
+    if (obj || !d->obj) {
+      d->func(d->arg);
+    } else {
+      // Holding the lock keeps objclose from unmapping the code under us.
+      pthread_rwlock_rdlock(&live_lock);
+      obj_handle* o = live_objs;
+      while (o && !(o == d->obj && o->serial == d->serial)) o = o->next_live;
+      if (o) d->func(d->arg);
+      pthread_rwlock_unlock(&live_lock);
+    }
+    free(d);
+    p = &thread_dtors;
+  }
+}
 
-    for (int j = 0; j < relnum; j++) {
-      Elf_Rela* rel = (Elf_Rela*)(bin + shdr->sh_offset + relsize * j);
-      char* target = target_base + rel->r_offset;
-      Elf_Sym* sym = &symtab[ELFW_R_SYM(rel->r_info)];
-      int addend = has_addend ? rel->r_addend : 0;
-      char* sym_addr = NULL;
+static void thread_dtor_exit(void* p) {
+  run_thread_dtors(NULL);
+}
 
-      if (!code_size_only) {
-        switch (ELFW_ST_TYPE(sym->st_info)) {
-          case STT_SECTION:
-            sym_addr = addrs[sym->st_shndx];
-            break;
+// exit() does not run key destructors for the thread calling it.
+static void thread_dtor_atexit(void) {
+  run_thread_dtors(NULL);
+}
 
-          case STT_FUNC:
-          case STT_OBJECT:
-            sym_addr = (char*)sym->st_value;
-            break;
+// Looks |name| up in the other members of the object's batch.
+static void* batch_lookup(obj_handle* obj, const char* name) {
+  obj_batch* batch = obj->batch;
+  for (int j = 0; j < batch->count; j++) {
+    obj_handle* member = batch->objs[j];
+    if (!member || member == obj) continue;
+    void* addr = objsym(member, name);
+    if (addr) {
+      batch->deps[obj->batch_index * batch->count + j] = 1;
+      return addr;
+    }
+  }
+  return NULL;
+}
 
-          case STT_NOTYPE:
-            if (sym->st_shndx == SHN_UNDEF) {
-              sym_addr = (char*)dlsym(RTLD_DEFAULT, strtab + sym->st_name);
-              if (sym_addr == NULL) {
-                sprintf(obj_error, "failed to resolve %s",
-                        strtab + sym->st_name);
-                return (size_t)-1;
-              }
-            } else {
-              sym_addr = addrs[sym->st_shndx];
-            }
-            break;
+// Looks up a symbol the object does not define. |hash| is
+// gnu_hash_calc(name).
+static void* find_external(obj_handle* obj, const char* name,
+                           const char* version, uint32_t hash) {
+  sym_cache* cache = obj->resolve_cache;
+  sym_cache_entry* e;
+  if (name[0] == '_' && name[1] == '_') {
+    // Shared objects have their own __dso_handle from crtbegin.o.
+    // Ours is a word inside the image, as code refers to it with PC32.
+    if (!strcmp(name, "__dso_handle") && obj->dso_handle) {
+      return obj->dso_handle;
+    }
+    if (!strcmp(name, "__cxa_thread_atexit") ||
+        !strcmp(name, "__cxa_thread_atexit_impl")) {
+      return (void*)&objfcn_cxa_thread_atexit;
+    }
+  }
+  if (obj->batch && !version) {
+    void* addr = batch_lookup(obj, name);
+    if (addr) return addr;
+  }
+  for (int i = 0; i < obj->num_deps; i++) {
+    void* addr = objsym_dyn_hashed(obj->deps[i], name, hash);
+    if (addr) return addr;
+  }
+  if (!version) {
+    void* addr = global_lookup(name, hash);
+    if (addr) return addr;
+  }
+  if (obj->flags & OBJFCN_SHARED_SYMBOL_CACHE) {
+    void* addr = NULL;
+    pthread_mutex_lock(&shared_sym_cache_lock);
+    e = sym_cache_find(&shared_sym_cache, name, version, hash);
+    if (e && e->name) addr = e->addr;
+    pthread_mutex_unlock(&shared_sym_cache_lock);
+    if (addr) {
+      if (obj->stats) stat_add(&obj->stats->lookup_cache_hits, 1);
+      return addr;
+    }
+  }
+  if (cache) {
+    e = sym_cache_find(cache, name, version, hash);
+    if (e && e->name) {
+      if (obj->stats) stat_add(&obj->stats->lookup_cache_hits, 1);
+      return e->addr;
+    }
+  }
 
-          default:
-            sprintf(obj_error, "unsupported relocation sym %d",
-                    ELFW_ST_TYPE(sym->st_info));
-            return (size_t)-1;
-        }
-        //fprintf(stderr, "%d %s target=%p sym_addr=%p addend=%d\n",
-        //        j, strtab + sym->st_name, target, sym_addr, addend);
-      }
+  void* addr;
+  if (obj->stats) stat_add(&obj->stats->host_lookups, 1);
+  if (version) {
+    addr = dlvsym(RTLD_DEFAULT, name, version);
+  } else {
+    addr = dlsym(RTLD_DEFAULT, name);
+  }
 
-      switch (ELFW_R_TYPE(rel->r_info)) {
-#ifdef R_32
-        case R_32:
-          if (!code_size_only)
-            *(uint32_t*)target += (uint32_t)sym_addr + addend;
-          break;
-#endif
+  if (cache) {
+    sym_cache_insert(cache, name, version, hash, addr);
+  }
+  if (addr && (obj->flags & OBJFCN_SHARED_SYMBOL_CACHE)) {
+    pthread_mutex_lock(&shared_sym_cache_lock);
+    sym_cache_insert(&shared_sym_cache, name, version, hash, addr);
+    pthread_mutex_unlock(&shared_sym_cache_lock);
+  }
+  return addr;
+}
 
-#ifdef R_64
-        case R_64:
-          if (!code_size_only)
-            *(uint64_t*)target += (uint64_t)sym_addr + addend;
-          break;
-#endif
+static void* resolve_external(obj_handle* obj, const char* name,
+                              const char* version, uint32_t hash) {
+  if (!obj->stats) return find_external(obj, name, version, hash);
+  uint64_t start = stat_now();
+  void* addr = find_external(obj, name, version, hash);
+  stat_add(&obj->stats->resolve_ns, stat_now() - start);
+  stat_add(&obj->stats->lookups, 1);
+  return addr;
+}
 
-#ifdef R_PC32
-        case R_PC32:
-          if (!code_size_only)
-            *(uint32_t*)target += (sym_addr - target) + addend;
-          break;
-#endif
+static uintptr_t align_down(uintptr_t v, size_t align) {
+  return v & ~(align - 1);
+}
 
-#ifdef R_PLT32
-        case R_PLT32:
-          if (code_size_only) {
-            code_size += 6 + 8;
-          } else {
-#if defined(__x86_64__)
-            void* dest = sym_addr;
-            sym_addr = alloc_code(obj, 6 + 8);
-            sym_addr[0] = 0xff;
-            sym_addr[1] = 0x25;
-            *(uint32_t*)(sym_addr + 2) = 0;
-            *(uint64_t*)(sym_addr + 6) = (uint64_t)dest;
-#endif
-            *(uint32_t*)target += (sym_addr - target) + addend;
-          }
-          break;
-#endif
+static uintptr_t align_up(uintptr_t v, size_t align) {
+  return align_down(v + align - 1, align);
+}
 
-#if defined(__x86_64__)
-        case R_X86_64_REX_GOTPCRELX:
-          if (code_size_only) {
-            code_size += 8;
-          } else {
-            void* dest = sym_addr;
-            sym_addr = alloc_code(obj, 8);
-            *(uint64_t*)(sym_addr) = (uint64_t)dest;
-            *(uint32_t*)target += (sym_addr - target) + addend;
-          }
-          break;
-#endif
+static size_t page_size(void) {
+  static size_t size;
+  if (!size) {
+    size = sysconf(_SC_PAGESIZE);
+  }
+  return size;
+}
 
-#if defined(__arm__)
-        case R_ARM_CALL:
-          if (code_size_only) {
-            code_size += 8;
-          } else {
-            void* dest = sym_addr;
-            sym_addr = alloc_code(obj, 8);
-            // ldr pc, [pc, #-4]
-            *(uint32_t*)sym_addr = 0xe51ff004;
-            *(uint32_t*)(sym_addr + 4) = (uint32_t)dest;
-            int32_t v = ((sym_addr - target) + addend - 8) >> 2;
-            if (v >= (1 << 23) || v < -(1 << 23)) {
-              sprintf(obj_error, "Relocation out of range: %x", v);
-              return (size_t)-1;
-            }
-            *(uint32_t*)target =
-                (((uint8_t*)target)[3] << 24U) | (0xffffff & v);
-          }
-          break;
+#define OBJFCN_ARENA_SIZE (1024 * 1024 * 1024)
+#define OBJFCN_HUGE_PAGE_SIZE (2 * 1024 * 1024)
 
-        case R_ARM_ABS32:
-          if (!code_size_only)
-            *(uint32_t*)target = (uint32_t)sym_addr + addend;
-          break;
-#endif
+#if OBJFCN_SPLIT_ALLOC
 
-        default:
-          sprintf(obj_error, "Unknown reloc: %ld",
-                  (long)ELFW_R_TYPE(rel->r_info));
-          return (size_t)-1;
-      }
-    }
+static char* alloc_region(size_t size, size_t align, int prot) {
+  // mmap gives page alignment, which is all sections ask for in practice.
+  char* p = (char*)mmap(NULL, size, prot,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+  if (p == MAP_FAILED) {
+    sprintf(obj_error, "mmap failed: %s", strerror(errno));
+    return NULL;
   }
-  return code_size;
+  return p;
 }
 
-static int is_defined(Elf_Sym* sym) {
-  int bind = ELFW_ST_BIND(sym->st_info);
-  return ((bind == STB_GLOBAL || bind == STB_WEAK) &&
-          sym->st_shndx != SHN_UNDEF);
+static void free_region(char* p, size_t size) {
+  munmap(p, size);
 }
 
-static void* objsym_dyn_elf_hash(obj_handle* obj, const char* symbol) {
-  assert(obj->elf_hash);
-  Elf_Hash* elf_hash = obj->elf_hash;
+#else
 
-  uint32_t h = elf_hash_calc(symbol);
-  uint32_t n = elf_hash_buckets(elf_hash)[h % elf_hash->nbuckets];
-  for (; n; n = elf_hash_chains(elf_hash)[n]) {
-    Elf_Sym* sym = &obj->symtab[n];
+// All code lives in a single arena so every loaded object and its stubs
+// are within +-2GB of each other, which PC32/PLT32 relocations need.
+// The arena is managed as an address-ordered list of free page runs;
+// freed runs are coalesced with their neighbours. Free pages are
+// PROT_NONE; a chunk gets its protection when it is handed out.
+
+typedef struct arena_extent {
+  char* start;
+  size_t size;
+  struct arena_extent* next;
+} arena_extent;
+
+static char* arena;
+static arena_extent* arena_free_list;
+static size_t arena_used;
+static int arena_chunks;
+// Taken once per objopen/objclose; handles carve stubs out of their own
+// chunk without locking.
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifndef MAP_FIXED_NOREPLACE
+# define MAP_FIXED_NOREPLACE 0x100000
+#endif
 
-    if (!strcmp(symbol, obj->strtab + sym->st_name) && is_defined(sym)) {
-      return obj->base + sym->st_value;
-    }
+// The arena is placed within +-2GB of the main executable if there is
+// room, or else of libc, so calls and PC32 references from loaded code
+// into the host are direct rather than through stubs.
+
+typedef struct {
+  const void* addr;  // any address in the module, or NULL for the first
+  uintptr_t lo;
+  uintptr_t hi;
+} module_range;
+
+static int find_module(struct dl_phdr_info* info, size_t size, void* arg) {
+  module_range* r = (module_range*)arg;
+  uintptr_t lo = UINTPTR_MAX, hi = 0;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_LOAD) continue;
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+    if (lo > start) lo = start;
+    if (hi < start + phdr->p_memsz) hi = start + phdr->p_memsz;
   }
-  return NULL;
+  if (hi && (!r->addr || ((uintptr_t)r->addr >= lo &&
+                          (uintptr_t)r->addr < hi))) {
+    r->lo = lo;
+    r->hi = hi;
+    return 1;
+  }
+  return 0;
 }
 
-static void* objsym_dyn_gnu_hash(obj_handle* obj, const char* symbol) {
-  assert(obj->gnu_hash);
-  Elf_GnuHash* gnu_hash = obj->gnu_hash;
+static char* reserve_at(uintptr_t hint, size_t size) {
+  void* p = mmap((void*)hint, size, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                 MAP_FIXED_NOREPLACE, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  if (p != (void*)hint) {
+    // Kernels before 4.17 take it as a plain hint.
+    munmap(p, size);
+    return NULL;
+  }
+  return (char*)p;
+}
 
-  uint32_t h = gnu_hash_calc(symbol);
-  // TODO(hamaji): Use the bloom filter.
-  int n = gnu_hash_buckets(gnu_hash)[h % gnu_hash->nbuckets];
-  // fprintf(stderr, "lookup n=%d mask=%x\n", n, gnu_hash->maskwords);
-  if (n == 0) return NULL;
-  const uint32_t* hv = &gnu_hash_hashvals(gnu_hash)[n - gnu_hash->symndx];
-  for (Elf_Sym* sym = &obj->symtab[n];; ++sym) {
-    uint32_t h2 = *hv++;
-    if ((h & ~1) == (h2 & ~1) &&
-        !strcmp(symbol, obj->strtab + sym->st_name) &&
-        is_defined(sym)) {
-      return obj->base + sym->st_value;
-    }
-    if (h2 & 1) break;
+// Reserves |size| bytes which, together with the module at |addr|, fit
+// in a signed 32-bit displacement. Spots below the module are tried
+// first, as brk grows the heap upwards from the executable.
+static char* reserve_near(const void* addr, size_t size) {
+  const uintptr_t reach = ((uintptr_t)1 << 31) - OBJFCN_HUGE_PAGE_SIZE;
+  const uintptr_t step = 64 << 20;
+  module_range m = {addr, 0, 0};
+  if (!dl_iterate_phdr(find_module, &m) || m.hi - m.lo + size > reach) {
+    return NULL;
+  }
+  uintptr_t slack = reach - (m.hi - m.lo) - size;
+  uintptr_t lo = m.lo & ~(uintptr_t)(OBJFCN_HUGE_PAGE_SIZE - 1);
+  uintptr_t hi = align_up(m.hi, OBJFCN_HUGE_PAGE_SIZE);
+  for (uintptr_t gap = step; gap <= slack; gap += step) {
+    if (lo < gap + size + step) break;
+    char* p = reserve_at(lo - gap - size, size);
+    if (p) return p;
+  }
+  for (uintptr_t gap = slack; gap >= step; gap -= step) {
+    if (hi + gap + size < hi) continue;
+    char* p = reserve_at(align_up(hi + gap, OBJFCN_HUGE_PAGE_SIZE), size);
+    if (p) return p;
   }
   return NULL;
 }
 
-static void* objsym_dyn(obj_handle* obj, const char* symbol) {
-  assert(obj->symtab);
-  if (obj->gnu_hash) {
-    return objsym_dyn_gnu_hash(obj, symbol);
-  } else {
-    return objsym_dyn_elf_hash(obj, symbol);
+static void init_arena(void) {
+  arena = reserve_near(NULL, OBJFCN_ARENA_SIZE);
+  if (!arena) {
+    // stdout points into libc's data even when the executable has a
+    // copy of the pointer itself.
+    arena = reserve_near(stdout, OBJFCN_ARENA_SIZE);
+  }
+  if (!arena) {
+    arena = (char*)mmap(NULL, OBJFCN_ARENA_SIZE, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1, 0);
+  }
+  LOGF(OBJFCN_LOG_INFO, "arena at %p\n", (void*)arena);
+  if (arena == MAP_FAILED) {
+    sprintf(obj_error, "mmap failed");
+    return;
   }
+  arena_free_list = (arena_extent*)malloc(sizeof(arena_extent));
+  arena_free_list->start = arena;
+  arena_free_list->size = OBJFCN_ARENA_SIZE;
+  arena_free_list->next = NULL;
 }
 
-#if DYN_SUPPORTED
-
-static void undefined() {
-  LOGF("undefined function called\n");
-  abort();
+static void arena_release(char* p, size_t size);
+
+static char* arena_take(size_t size, size_t align, int prot) {
+  size = align_up(size, page_size());
+  if (align < page_size()) align = page_size();
+  for (arena_extent** pe = &arena_free_list; *pe; pe = &(*pe)->next) {
+    arena_extent* e = *pe;
+    char* p = (char*)align_up((uintptr_t)e->start, align);
+    if (p + size > e->start + e->size) continue;
+
+    size_t head = p - e->start;
+    size_t tail = e->size - head - size;
+    if (head) {
+      // Keep the alignment padding as its own free extent.
+      if (tail) {
+        arena_extent* t = (arena_extent*)malloc(sizeof(arena_extent));
+        t->start = p + size;
+        t->size = tail;
+        t->next = e->next;
+        e->next = t;
+      }
+      e->size = head;
+    } else if (tail) {
+      e->start += size;
+      e->size = tail;
+    } else {
+      *pe = e->next;
+      free(e);
+    }
+    arena_used += size;
+    arena_chunks++;
+    if (mprotect(p, size, prot) != 0) {
+      sprintf(obj_error, "mprotect failed: %s", strerror(errno));
+      arena_release(p, size);
+      return NULL;
+    }
+    return p;
+  }
+  sprintf(obj_error, "code arena exhausted (%zu bytes requested)", size);
+  return NULL;
 }
 
-#endif
+static void arena_release(char* p, size_t size) {
+  size = align_up(size, page_size());
+  // Replacing the pages zeroes them for the next user (.bss relies on
+  // it) and drops any file mappings made by OBJFCN_MAP_SEGMENTS.
+  mmap(p, size, PROT_NONE,
+       MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  arena_used -= size;
+  arena_chunks--;
+
+  arena_extent* prev = NULL;
+  arena_extent* next = arena_free_list;
+  while (next && next->start < p) {
+    prev = next;
+    next = next->next;
+  }
 
-#if defined(__aarch64__)
+  if (prev && prev->start + prev->size == p) {
+    prev->size += size;
+    if (next && prev->start + prev->size == next->start) {
+      prev->size += next->size;
+      prev->next = next->next;
+      free(next);
+    }
+    return;
+  }
+  if (next && p + size == next->start) {
+    next->start = p;
+    next->size += size;
+    return;
+  }
 
-typedef struct TlsDesc {
-  ptrdiff_t (*entry)(struct TlsDesc*);
-  void* arg;
-} TlsDesc;
+  arena_extent* e = (arena_extent*)malloc(sizeof(arena_extent));
+  e->start = p;
+  e->size = size;
+  e->next = next;
+  if (prev) {
+    prev->next = e;
+  } else {
+    arena_free_list = e;
+  }
+}
+
+static char* alloc_region(size_t size, size_t align, int prot) {
+  pthread_mutex_lock(&arena_lock);
+  char* p = arena_take(size, align, prot);
+  pthread_mutex_unlock(&arena_lock);
+  return p;
+}
 
-static ptrdiff_t return_tls(struct TlsDesc* desc) {
-  return (ptrdiff_t)desc->arg;
+static void free_region(char* p, size_t size) {
+  pthread_mutex_lock(&arena_lock);
+  arena_release(p, size);
+  pthread_mutex_unlock(&arena_lock);
 }
 
 #endif
 
-static void relocate_dyn(const char* reloc_type, obj_handle* obj,
-                         Elf_Rel* rel, int relsz) {
-  size_t i;
-  for (i = 0; i < relsz / sizeof(*rel); rel++, i++) {
-    LOGF("rel offset=%x\n", (int)rel->r_offset);
-    void** addr = (void**)(obj->base + rel->r_offset);
-    int type = ELFW_R_TYPE(rel->r_info);
-    int sym_idx = ELFW_R_SYM(rel->r_info);
-    Elf_Sym* sym = obj->symtab + sym_idx;
-    const char* sname = obj->strtab + sym->st_name;
-    void* val = 0;
+// Text of OBJFCN_HUGE_TEXT objects is packed into 2MB blocks so hot code
+// from several objects shares a few large TLB entries. Blocks are backed
+// by MAP_HUGETLB when the system has reserved huge pages and by THP
+// otherwise, and go back to the arena when their last user is closed.
+// Under OBJFCN_WX a block is never shared, as mprotect on part of it
+// would split the huge page.
+
+typedef struct huge_block {
+  char* start;
+  size_t size;
+  size_t used;
+  int live;
+  int shared;
+  struct huge_block* next;
+} huge_block;
+
+static huge_block* huge_blocks;
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* alloc_huge_text(size_t size, size_t align, int prot, int shared,
+                             huge_block** out) {
+  size = align_up(size, page_size());
+  if (align < page_size()) align = page_size();
+  pthread_mutex_lock(&huge_lock);
+  huge_block* b = huge_blocks;
+  for (; b; b = b->next) {
+    if (b->shared && shared &&
+        align_up(b->used, align) + size <= b->size) {
+      break;
+    }
+  }
 
-    val = objsym_dyn(obj, sname);
-    if (!val) {
-      const char* verstr = 0;
-      if (obj->versym && obj->verneed) {
-        int ver = obj->versym[sym_idx];
-        verstr = obj->verstrs[ver];
-      }
-      if (verstr) {
-        val = dlvsym(RTLD_DEFAULT, sname, verstr);
-      } else {
-        val = dlsym(RTLD_DEFAULT, sname);
+  if (b == NULL) {
+    size_t block_size = align_up(size, OBJFCN_HUGE_PAGE_SIZE);
+    char* p = alloc_region(block_size, OBJFCN_HUGE_PAGE_SIZE, prot);
+    if (p == NULL) {
+      pthread_mutex_unlock(&huge_lock);
+      return NULL;
+    }
+    if (mmap(p, block_size, prot,
+             MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_HUGETLB,
+             -1, 0) == MAP_FAILED) {
+      // A failed MAP_FIXED may already have torn down the old range.
+      if (mmap(p, block_size, prot, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS,
+               -1, 0) == MAP_FAILED) {
+        sprintf(obj_error, "mmap failed: %s", strerror(errno));
+        free_region(p, block_size);
+        pthread_mutex_unlock(&huge_lock);
+        return NULL;
       }
+#ifdef MADV_HUGEPAGE
+      madvise(p, block_size, MADV_HUGEPAGE);
+#endif
+    }
+    b = (huge_block*)calloc(1, sizeof(huge_block));
+    if (b == NULL) {
+      sprintf(obj_error, "malloc failed");
+      free_region(p, block_size);
+      pthread_mutex_unlock(&huge_lock);
+      return NULL;
     }
+    b->start = p;
+    b->size = block_size;
+    b->shared = shared;
+    b->next = huge_blocks;
+    huge_blocks = b;
+  }
 
-    LOGF("%s: %p %s(%p) %d => %p\n",
-         reloc_type, (void*)addr, sname, sym, type, val);
+  char* r = b->start + align_up(b->used, align);
+  b->used = r + size - b->start;
+  b->live++;
+  *out = b;
+  pthread_mutex_unlock(&huge_lock);
+  return r;
+}
+
+static void free_huge_text(huge_block* b) {
+  pthread_mutex_lock(&huge_lock);
+  if (--b->live) {
+    pthread_mutex_unlock(&huge_lock);
+    return;
+  }
+  for (huge_block** pb = &huge_blocks; *pb; pb = &(*pb)->next) {
+    if (*pb == b) {
+      *pb = b->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&huge_lock);
+  free_region(b->start, b->size);
+  free(b);
+}
+
+// One allocation shared by the relocatable objects of an objopen_many
+// call. It goes back to the arena when the last of them is closed.
+typedef struct obj_chunk {
+  char* start;
+  size_t size;
+  int refs;
+} obj_chunk;
+
+static void release_chunk(obj_chunk* chunk) {
+  if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free_region(chunk->start, chunk->size);
+    free(chunk);
+  }
+}
+
+int objarena_stats(obj_arena_stats* stats) {
+  memset(stats, 0, sizeof(*stats));
+#if !OBJFCN_SPLIT_ALLOC
+  pthread_mutex_lock(&arena_lock);
+  stats->arena_size = arena && arena != MAP_FAILED ? OBJFCN_ARENA_SIZE : 0;
+  stats->used = arena_used;
+  stats->chunks = arena_chunks;
+  for (arena_extent* e = arena_free_list; e; e = e->next) {
+    stats->free += e->size;
+    stats->free_extents++;
+    if (stats->largest_free < e->size) {
+      stats->largest_free = e->size;
+    }
+  }
+  pthread_mutex_unlock(&arena_lock);
+#endif
+  return 0;
+}
+
+// Thread-local storage. Each object with a PT_TLS segment gets a module
+// ID of its own. A thread allocates its block for a module from the
+// module's template on its first access, and finds it again through its
+// dtv, an array of blocks indexed by module ID. IDs of closed modules
+// are reused; blocks left behind by them are told apart by generation
+// and freed on the next access or when the thread exits.
+
+#define OBJFCN_MAX_TLS_MODULES 4096
+
+// TLS descriptors carry the module ID in the bits above the offset.
+#if __SIZEOF_POINTER__ == 8
+# define TLSDESC_MODULE_SHIFT 40
+#else
+# define TLSDESC_MODULE_SHIFT 20
+#endif
+
+typedef struct {
+  unsigned long ti_module;
+  unsigned long ti_offset;
+} tls_index;
+
+typedef struct {
+  char* image;
+  size_t filesz;
+  size_t memsz;
+  size_t align;
+} tls_module;
+
+typedef struct {
+  char* block;
+  uintptr_t gen;  // dtv[0].gen is the number of slots
+} tls_slot;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// 0 for free IDs. Read without the lock by the fast paths.
+__attribute__((visibility("hidden")))
+uintptr_t objfcn_tls_gens[OBJFCN_MAX_TLS_MODULES];
+__attribute__((visibility("hidden"), tls_model("initial-exec")))
+__thread tls_slot* objfcn_tls_dtv;
+__attribute__((visibility("hidden")))
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((force_align_arg_pointer))
+#endif
+void* objfcn_tls_get_addr(tls_index* ti);
+#if defined(__i386__)
+__attribute__((visibility("hidden"))) void* objfcn_tls_get_addr_eax(void);
+#endif
+__attribute__((visibility("hidden"))) char* objfcn_tlsdesc_slow(uintptr_t arg);
+__attribute__((visibility("hidden")))
+ptrdiff_t objfcn_tlsdesc_dynamic(void* desc);
+__attribute__((visibility("hidden")))
+ptrdiff_t objfcn_tlsdesc_static(void* desc);
+#ifdef __cplusplus
+}
+#endif
+
+static tls_module tls_modules[OBJFCN_MAX_TLS_MODULES];
+static uintptr_t tls_next_gen;
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tls_key;
+
+static void free_dtv(void* p) {
+  tls_slot* dtv = (tls_slot*)p;
+  for (uintptr_t m = 1; m < dtv[0].gen; m++) {
+    free(dtv[m].block);
+  }
+  free(dtv);
+}
+
+static void init_tls(void) {
+  // glibc runs key destructors in creation order; thread_local
+  // destructors must still see their TLS blocks.
+  pthread_key_create(&thread_dtor_key, thread_dtor_exit);
+  pthread_key_create(&tls_key, free_dtv);
+  atexit(thread_dtor_atexit);
+}
+
+// Gives |obj| a module ID for a TLS block of |memsz| bytes, the first
+// |filesz| of which are copied from |image|, or zero if it is NULL.
+static int tls_register(obj_handle* obj, const char* image, size_t filesz,
+                        size_t memsz, size_t align) {
+  int m;
+  pthread_mutex_lock(&tls_lock);
+  for (m = 1; m < OBJFCN_MAX_TLS_MODULES && objfcn_tls_gens[m]; m++) {
+  }
+  if (m == OBJFCN_MAX_TLS_MODULES) {
+    pthread_mutex_unlock(&tls_lock);
+    sprintf(obj_error, "too many TLS modules");
+    return 0;
+  }
+  tls_module* t = &tls_modules[m];
+  t->image = (char*)calloc(1, filesz + 1);
+  if (!t->image) {
+    pthread_mutex_unlock(&tls_lock);
+    sprintf(obj_error, "malloc failed");
+    return 0;
+  }
+  if (image) memcpy(t->image, image, filesz);
+  t->filesz = filesz;
+  t->memsz = memsz;
+  t->align = align > sizeof(void*) ? align : sizeof(void*);
+  __atomic_store_n(&objfcn_tls_gens[m], ++tls_next_gen, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&tls_lock);
+  obj->tls_module = m;
+  return 1;
+}
+
+static void tls_unregister(obj_handle* obj) {
+  int m = obj->tls_module;
+  if (!m) return;
+  pthread_mutex_lock(&tls_lock);
+  __atomic_store_n(&objfcn_tls_gens[m], 0, __ATOMIC_RELEASE);
+  free(tls_modules[m].image);
+  memset(&tls_modules[m], 0, sizeof(tls_modules[m]));
+  pthread_mutex_unlock(&tls_lock);
+
+  // Blocks of other threads go when they exit or touch the ID again.
+  tls_slot* dtv = objfcn_tls_dtv;
+  if (dtv && (uintptr_t)m < dtv[0].gen) {
+    free(dtv[m].block);
+    dtv[m].block = NULL;
+    dtv[m].gen = 0;
+  }
+}
+
+// Returns the calling thread's block for module |m|, allocating it on
+// the first access.
+static char* tls_block_slow(uintptr_t m) {
+  tls_slot* dtv = objfcn_tls_dtv;
+  if (m == 0 || m >= OBJFCN_MAX_TLS_MODULES) {
+    LOGF(OBJFCN_LOG_ERROR, "bad TLS module %ld\n", (long)m);
+    abort();
+  }
+  if (!dtv || m >= dtv[0].gen) {
+    uintptr_t old = dtv ? dtv[0].gen : 1;
+    uintptr_t n = old * 2 > m + 1 ? old * 2 : m + 1;
+    if (n < 16) n = 16;
+    tls_slot* p = (tls_slot*)realloc(dtv, sizeof(tls_slot) * n);
+    if (!p) {
+      LOGF(OBJFCN_LOG_ERROR, "failed to allocate a dtv\n");
+      abort();
+    }
+    memset(&p[old], 0, sizeof(tls_slot) * (n - old));
+    p[0].block = NULL;
+    p[0].gen = n;
+    dtv = objfcn_tls_dtv = p;
+    pthread_setspecific(tls_key, dtv);
+  }
+
+  tls_slot* s = &dtv[m];
+  pthread_mutex_lock(&tls_lock);
+  uintptr_t gen = objfcn_tls_gens[m];
+  if (s->gen != gen) {
+    tls_module* t = &tls_modules[m];
+    void* block = NULL;
+    free(s->block);
+    s->block = NULL;
+    s->gen = 0;
+    if (gen && posix_memalign(&block, t->align, t->memsz + 1) == 0) {
+      memcpy(block, t->image, t->filesz);
+      memset((char*)block + t->filesz, 0, t->memsz - t->filesz);
+      s->block = (char*)block;
+      s->gen = gen;
+    }
+  }
+  pthread_mutex_unlock(&tls_lock);
+  if (!s->block) {
+    LOGF(OBJFCN_LOG_ERROR, "no TLS block for module %ld\n", (long)m);
+    abort();
+  }
+  return s->block;
+}
+
+// Replaces __tls_get_addr for loaded objects.
+void* objfcn_tls_get_addr(tls_index* ti) {
+  tls_slot* dtv = objfcn_tls_dtv;
+  uintptr_t m = ti->ti_module;
+  if (dtv && m < dtv[0].gen &&
+      dtv[m].gen == __atomic_load_n(&objfcn_tls_gens[m], __ATOMIC_ACQUIRE)) {
+    return dtv[m].block + ti->ti_offset;
+  }
+#if defined(__x86_64__)
+  if (m == 0) {
+    // The host's static TLS, for relocatable objects.
+    return (char*)__builtin_thread_pointer() + ti->ti_offset;
+  }
+#endif
+  return tls_block_slow(m) + ti->ti_offset;
+}
+
+char* objfcn_tlsdesc_slow(uintptr_t arg) {
+  uintptr_t offset = arg & (((uintptr_t)1 << TLSDESC_MODULE_SHIFT) - 1);
+  return tls_block_slow(arg >> TLSDESC_MODULE_SHIFT) + offset;
+}
+
+// TLS descriptor entry. It gets the descriptor in %rax (x0) and returns
+// the address of the variable less the thread pointer, preserving all
+// other registers. The fast path repeats objfcn_tls_get_addr; the slow
+// one saves everything before calling objfcn_tlsdesc_slow.
+#if defined(__x86_64__)
+__asm__(
+    ".pushsection .text\n"
+    ".p2align 4\n"
+    ".type objfcn_tlsdesc_dynamic, @function\n"
+    "objfcn_tlsdesc_dynamic:\n"
+    "endbr64\n"
+    "mov 8(%rax), %rax\n"
+    "push %rcx\n"
+    "push %rdx\n"
+    "mov objfcn_tls_dtv@gottpoff(%rip), %rcx\n"
+    "mov %fs:(%rcx), %rcx\n"
+    "test %rcx, %rcx\n"
+    "jz 1f\n"
+    "mov %rax, %rdx\n"
+    "shr $40, %rdx\n"
+    "cmp 8(%rcx), %rdx\n"
+    "jae 1f\n"
+    "shl $4, %rdx\n"
+    "add %rdx, %rcx\n"
+    "shr $4, %rdx\n"
+    "push %rsi\n"
+    "lea objfcn_tls_gens(%rip), %rsi\n"
+    "mov (%rsi,%rdx,8), %rdx\n"
+    "pop %rsi\n"
+    "cmp 8(%rcx), %rdx\n"
+    "jne 1f\n"
+    "shl $24, %rax\n"
+    "shr $24, %rax\n"
+    "add (%rcx), %rax\n"
+    "sub %fs:0, %rax\n"
+    "pop %rdx\n"
+    "pop %rcx\n"
+    "ret\n"
+    "1:\n"
+    "pop %rdx\n"
+    "pop %rcx\n"
+    "push %rbx\n"
+    "mov %rsp, %rbx\n"
+    "push %rax\n"  // the result goes here
+    "push %rcx\n"
+    "push %rdx\n"
+    "push %rsi\n"
+    "push %rdi\n"
+    "push %r8\n"
+    "push %r9\n"
+    "push %r10\n"
+    "push %r11\n"
+    "mov %rax, %rdi\n"
+    "cmpq $0, objfcn_xsave_size(%rip)\n"
+    "je 2f\n"
+    "sub objfcn_xsave_size(%rip), %rsp\n"
+    "and $-64, %rsp\n"
+    "xor %eax, %eax\n"
+    "mov %rax, 512(%rsp)\n"
+    "mov %rax, 520(%rsp)\n"
+    "mov %rax, 528(%rsp)\n"
+    "mov %rax, 536(%rsp)\n"
+    "mov %rax, 544(%rsp)\n"
+    "mov %rax, 552(%rsp)\n"
+    "mov %rax, 560(%rsp)\n"
+    "mov %rax, 568(%rsp)\n"
+    "mov $-1, %eax\n"
+    "mov $-1, %edx\n"
+    "xsave (%rsp)\n"
+    "call objfcn_tlsdesc_slow\n"
+    "mov %rax, -8(%rbx)\n"
+    "mov $-1, %eax\n"
+    "mov $-1, %edx\n"
+    "xrstor (%rsp)\n"
+    "jmp 3f\n"
+    "2:\n"
+    "sub $512, %rsp\n"
+    "and $-16, %rsp\n"
+    "fxsave (%rsp)\n"
+    "call objfcn_tlsdesc_slow\n"
+    "mov %rax, -8(%rbx)\n"
+    "fxrstor (%rsp)\n"
+    "3:\n"
+    "lea -72(%rbx), %rsp\n"
+    "pop %r11\n"
+    "pop %r10\n"
+    "pop %r9\n"
+    "pop %r8\n"
+    "pop %rdi\n"
+    "pop %rsi\n"
+    "pop %rdx\n"
+    "pop %rcx\n"
+    "pop %rax\n"
+    "pop %rbx\n"
+    "sub %fs:0, %rax\n"
+    "ret\n"
+    ".size objfcn_tlsdesc_dynamic, .-objfcn_tlsdesc_dynamic\n"
+    // The host's static TLS, whose offset is the argument.
+    ".p2align 4\n"
+    ".type objfcn_tlsdesc_static, @function\n"
+    "objfcn_tlsdesc_static:\n"
+    "endbr64\n"
+    "mov 8(%rax), %rax\n"
+    "ret\n"
+    ".size objfcn_tlsdesc_static, .-objfcn_tlsdesc_static\n"
+    ".popsection\n");
+#elif defined(__aarch64__)
+__asm__(
+    ".pushsection .text\n"
+    ".p2align 4\n"
+    ".type objfcn_tlsdesc_dynamic, %function\n"
+    "objfcn_tlsdesc_dynamic:\n"
+    "ldr x0, [x0, #8]\n"
+    "stp x1, x2, [sp, #-32]!\n"
+    "str x3, [sp, #16]\n"
+    "mrs x1, tpidr_el0\n"
+    "adrp x2, :gottprel:objfcn_tls_dtv\n"
+    "ldr x2, [x2, #:gottprel_lo12:objfcn_tls_dtv]\n"
+    "ldr x2, [x1, x2]\n"
+    "cbz x2, 1f\n"
+    "lsr x3, x0, #40\n"
+    "ldr x1, [x2, #8]\n"
+    "cmp x3, x1\n"
+    "b.hs 1f\n"
+    "add x2, x2, x3, lsl #4\n"
+    "adrp x1, objfcn_tls_gens\n"
+    "add x1, x1, :lo12:objfcn_tls_gens\n"
+    "ldr x1, [x1, x3, lsl #3]\n"
+    "ldr x3, [x2, #8]\n"
+    "cmp x1, x3\n"
+    "b.ne 1f\n"
+    "ldr x2, [x2]\n"
+    "and x0, x0, #0xffffffffff\n"
+    "add x0, x2, x0\n"
+    "mrs x1, tpidr_el0\n"
+    "sub x0, x0, x1\n"
+    "ldr x3, [sp, #16]\n"
+    "ldp x1, x2, [sp], #32\n"
+    "ret\n"
+    "1:\n"
+    "ldr x3, [sp, #16]\n"
+    "ldp x1, x2, [sp], #32\n"
+    "stp x29, x30, [sp, #-16]!\n"
+    "mov x29, sp\n"
+    "stp x1, x2, [sp, #-16]!\n"
+    "stp x3, x4, [sp, #-16]!\n"
+    "stp x5, x6, [sp, #-16]!\n"
+    "stp x7, x8, [sp, #-16]!\n"
+    "stp x9, x10, [sp, #-16]!\n"
+    "stp x11, x12, [sp, #-16]!\n"
+    "stp x13, x14, [sp, #-16]!\n"
+    "stp x15, x16, [sp, #-16]!\n"
+    "stp x17, x18, [sp, #-16]!\n"
+    "sub sp, sp, #512\n"
+    "stp q0, q1, [sp, #0]\n"
+    "stp q2, q3, [sp, #32]\n"
+    "stp q4, q5, [sp, #64]\n"
+    "stp q6, q7, [sp, #96]\n"
+    "stp q8, q9, [sp, #128]\n"
+    "stp q10, q11, [sp, #160]\n"
+    "stp q12, q13, [sp, #192]\n"
+    "stp q14, q15, [sp, #224]\n"
+    "stp q16, q17, [sp, #256]\n"
+    "stp q18, q19, [sp, #288]\n"
+    "stp q20, q21, [sp, #320]\n"
+    "stp q22, q23, [sp, #352]\n"
+    "stp q24, q25, [sp, #384]\n"
+    "stp q26, q27, [sp, #416]\n"
+    "stp q28, q29, [sp, #448]\n"
+    "stp q30, q31, [sp, #480]\n"
+    "bl objfcn_tlsdesc_slow\n"
+    "mrs x1, tpidr_el0\n"
+    "sub x0, x0, x1\n"
+    "ldp q0, q1, [sp, #0]\n"
+    "ldp q2, q3, [sp, #32]\n"
+    "ldp q4, q5, [sp, #64]\n"
+    "ldp q6, q7, [sp, #96]\n"
+    "ldp q8, q9, [sp, #128]\n"
+    "ldp q10, q11, [sp, #160]\n"
+    "ldp q12, q13, [sp, #192]\n"
+    "ldp q14, q15, [sp, #224]\n"
+    "ldp q16, q17, [sp, #256]\n"
+    "ldp q18, q19, [sp, #288]\n"
+    "ldp q20, q21, [sp, #320]\n"
+    "ldp q22, q23, [sp, #352]\n"
+    "ldp q24, q25, [sp, #384]\n"
+    "ldp q26, q27, [sp, #416]\n"
+    "ldp q28, q29, [sp, #448]\n"
+    "ldp q30, q31, [sp, #480]\n"
+    "add sp, sp, #512\n"
+    "ldp x17, x18, [sp], #16\n"
+    "ldp x15, x16, [sp], #16\n"
+    "ldp x13, x14, [sp], #16\n"
+    "ldp x11, x12, [sp], #16\n"
+    "ldp x9, x10, [sp], #16\n"
+    "ldp x7, x8, [sp], #16\n"
+    "ldp x5, x6, [sp], #16\n"
+    "ldp x3, x4, [sp], #16\n"
+    "ldp x1, x2, [sp], #16\n"
+    "ldp x29, x30, [sp], #16\n"
+    "ret\n"
+    ".size objfcn_tlsdesc_dynamic, .-objfcn_tlsdesc_dynamic\n"
+    ".popsection\n");
+#elif defined(__i386__)
+// ___tls_get_addr, which i386 objects call with the argument in %eax.
+__asm__(
+    ".pushsection .text\n"
+    ".p2align 4\n"
+    ".type objfcn_tls_get_addr_eax, @function\n"
+    "objfcn_tls_get_addr_eax:\n"
+    "push %eax\n"
+    "call objfcn_tls_get_addr\n"
+    "add $4, %esp\n"
+    "ret\n"
+    ".size objfcn_tls_get_addr_eax, .-objfcn_tls_get_addr_eax\n"
+    ".popsection\n");
+#endif
+
+typedef struct {
+  char* bin;
+  size_t size;
+  int mapped;
+  int borrowed;  // bin belongs to the caller of objopen_mem
+  int fd;  // kept open for OBJFCN_MAP_SEGMENTS, -1 otherwise
+} obj_input;
+
+static void free_input(obj_input* in) {
+  if (in->mapped) {
+    munmap(in->bin, in->size);
+  } else if (!in->borrowed) {
+    free(in->bin);
+  }
+  in->bin = NULL;
+  if (in->fd >= 0) {
+    close(in->fd);
+    in->fd = -1;
+  }
+}
+
+static int read_stream(int fd, obj_input* in) {
+  size_t capacity = 1 << 16;
+  in->bin = (char*)malloc(capacity);
+  in->size = 0;
+  for (;;) {
+    if (in->bin == NULL) {
+      sprintf(obj_error, "malloc failed");
+      return 0;
+    }
+    ssize_t r = read(fd, in->bin + in->size, capacity - in->size);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      sprintf(obj_error, "read failed: %s", strerror(errno));
+      free(in->bin);
+      in->bin = NULL;
+      return 0;
+    }
+    if (r == 0) return 1;
+    in->size += r;
+    if (in->size == capacity) {
+      capacity *= 2;
+      char* bin = (char*)realloc(in->bin, capacity);
+      if (bin == NULL) free(in->bin);
+      in->bin = bin;
+    }
+  }
+}
+
+static int should_load(Elf_Shdr* shdr);
+
+#ifndef ELFCOMPRESS_ZSTD
+# define ELFCOMPRESS_ZSTD 2
+#endif
+
+#define OBJFCN_INFLATE_CHUNK 65536
+
+static int pread_full(int fd, char* buf, size_t size, off_t offset) {
+  while (size) {
+    ssize_t r = pread(fd, buf, size, offset);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return 0;
+    buf += r;
+    size -= r;
+    offset += r;
+  }
+  return 1;
+}
+
+// Whether loading a relocatable object reads section |i|.
+static int section_needed(Elf_Shdr* shdrs, int shnum, int shstrndx, int i) {
+  Elf_Shdr* shdr = &shdrs[i];
+  if (i == shstrndx) return 1;
+  switch (shdr->sh_type) {
+  case SHT_NOBITS:
+    return 0;
+  case SHT_SYMTAB:
+  case SHT_SYMTAB_SHNDX:
+    return 1;
+  case SHT_REL:
+  case SHT_RELA:
+    // Relocations of debug sections are skipped with them.
+    return (shdr->sh_info < (unsigned)shnum &&
+            should_load(&shdrs[shdr->sh_info]));
+  case SHT_STRTAB:
+    for (int j = 0; j < shnum; j++) {
+      if (shdrs[j].sh_type == SHT_SYMTAB && shdrs[j].sh_link == (unsigned)i) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+  return should_load(shdr);
+}
+
+// Inflates the SHF_COMPRESSED section |shdr| of |fd| into |out|, which
+// has room for chdr->ch_size bytes, reading the input a chunk at a time.
+static int inflate_section(int fd, const char* name, Elf_Shdr* shdr,
+                           const Elf_Chdr* chdr, char* out) {
+  // Left to read.
+  size_t in_size __attribute__((unused)) = shdr->sh_size - sizeof(Elf_Chdr);
+  off_t offset __attribute__((unused)) = shdr->sh_offset + sizeof(Elf_Chdr);
+  char* buf = (char*)malloc(OBJFCN_INFLATE_CHUNK);
+  int ok = 0;
+  if (!buf) {
+    sprintf(obj_error, "malloc failed");
+    return 0;
+  }
+  snprintf(obj_error, sizeof(obj_error), "%.200s: corrupt compressed section",
+           name);
+
+  switch (chdr->ch_type) {
+#if OBJFCN_ZLIB
+  case ELFCOMPRESS_ZLIB: {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (inflateInit(&z) != Z_OK) break;
+    z.next_out = (Bytef*)out;
+    z.avail_out = chdr->ch_size;
+    int r = Z_OK;
+    while (r == Z_OK && in_size) {
+      size_t n =
+          in_size < OBJFCN_INFLATE_CHUNK ? in_size : OBJFCN_INFLATE_CHUNK;
+      if (!pread_full(fd, buf, n, offset)) break;
+      offset += n;
+      in_size -= n;
+      z.next_in = (Bytef*)buf;
+      z.avail_in = n;
+      do {
+        r = inflate(&z, Z_NO_FLUSH);
+      } while (r == Z_OK && z.avail_in && z.avail_out);
+    }
+    ok = r == Z_STREAM_END && z.total_out == chdr->ch_size;
+    inflateEnd(&z);
+    break;
+  }
+#endif
+#if OBJFCN_ZSTD
+  case ELFCOMPRESS_ZSTD: {
+    ZSTD_DStream* z = ZSTD_createDStream();
+    if (!z) break;
+    ZSTD_initDStream(z);
+    ZSTD_outBuffer zout = {out, (size_t)chdr->ch_size, 0};
+    size_t r = 1;
+    while (r && in_size) {
+      size_t n =
+          in_size < OBJFCN_INFLATE_CHUNK ? in_size : OBJFCN_INFLATE_CHUNK;
+      if (!pread_full(fd, buf, n, offset)) break;
+      offset += n;
+      in_size -= n;
+      ZSTD_inBuffer zin = {buf, n, 0};
+      while (zin.pos < zin.size) {
+        r = ZSTD_decompressStream(z, &zout, &zin);
+        if (ZSTD_isError(r) || !r) break;
+      }
+      if (ZSTD_isError(r)) break;
+    }
+    ok = r == 0 && zout.pos == chdr->ch_size;
+    ZSTD_freeDStream(z);
+    break;
+  }
+#endif
+  default:
+    snprintf(obj_error, sizeof(obj_error),
+             "%.200s: unsupported compression type %d", name,
+             (int)chdr->ch_type);
+  }
+  free(buf);
+  return ok;
+}
+
+// OBJFCN_STREAM. The image is laid out at its file offsets in reserved
+// address space, but only what the loader reads is pread into it: the
+// headers, then the loaded sections with their symbols and relocations,
+// or the PT_LOAD segments of a shared object. Debug info costs neither
+// I/O nor memory. SHF_COMPRESSED sections among them are inflated past
+// the end of the file and their headers pointed there.
+static int read_sparse(int fd, const char* name, size_t file_size,
+                       obj_input* in) {
+  Elf_Ehdr ehdr;
+  Elf_Shdr* shdrs = NULL;
+  Elf_Chdr* chdrs = NULL;
+  int ok = 0;
+
+  if (file_size < sizeof(ehdr) ||
+      !pread_full(fd, (char*)&ehdr, sizeof(ehdr), 0)) {
+    sprintf(obj_error, "%s is too small to be ELF", name);
+    return 0;
+  }
+  if (memcmp(ehdr.e_ident, ELFMAG, 4) ||
+      ehdr.e_shoff + (size_t)ehdr.e_shnum * sizeof(Elf_Shdr) > file_size ||
+      ehdr.e_phoff + (size_t)ehdr.e_phnum * sizeof(Elf_Phdr) > file_size) {
+    sprintf(obj_error, "%s is not ELF", name);
+    return 0;
+  }
+
+  shdrs = (Elf_Shdr*)malloc(sizeof(Elf_Shdr) * (ehdr.e_shnum + 1));
+  chdrs = (Elf_Chdr*)calloc(ehdr.e_shnum + 1, sizeof(Elf_Chdr));
+  if (!shdrs || !chdrs) {
+    sprintf(obj_error, "malloc failed");
+    goto out;
+  }
+  if (!pread_full(fd, (char*)shdrs, sizeof(Elf_Shdr) * ehdr.e_shnum,
+                  ehdr.e_shoff)) {
+    sprintf(obj_error, "read failed: %s", strerror(errno));
+    goto out;
+  }
+
+  {
+    int rel = ehdr.e_type != ET_DYN;
+    size_t total = align_up(file_size, 16);
+    for (int i = 0; i < ehdr.e_shnum; i++) {
+      Elf_Shdr* shdr = &shdrs[i];
+      if (!rel || !section_needed(shdrs, ehdr.e_shnum, ehdr.e_shstrndx, i)) {
+        continue;
+      }
+      if (shdr->sh_offset + shdr->sh_size > file_size ||
+          ((shdr->sh_flags & SHF_COMPRESSED) &&
+           (shdr->sh_size < sizeof(Elf_Chdr) ||
+            !pread_full(fd, (char*)&chdrs[i], sizeof(Elf_Chdr),
+                        shdr->sh_offset)))) {
+        snprintf(obj_error, sizeof(obj_error),
+                 "%.200s: section %d is truncated", name, i);
+        goto out;
+      }
+      if (shdr->sh_flags & SHF_COMPRESSED) {
+        total += align_up(chdrs[i].ch_size, 16);
+      }
+    }
+
+    in->bin = (char*)mmap(NULL, total, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (in->bin == MAP_FAILED) {
+      in->bin = NULL;
+      sprintf(obj_error, "mmap failed: %s", strerror(errno));
+      goto out;
+    }
+    in->size = total;
+    in->mapped = 1;
+    memcpy(in->bin, &ehdr, sizeof(ehdr));
+    memcpy(in->bin + ehdr.e_shoff, shdrs, sizeof(Elf_Shdr) * ehdr.e_shnum);
+    if (ehdr.e_phnum &&
+        !pread_full(fd, in->bin + ehdr.e_phoff,
+                    sizeof(Elf_Phdr) * ehdr.e_phnum, ehdr.e_phoff)) {
+      sprintf(obj_error, "read failed: %s", strerror(errno));
+      goto out;
+    }
+
+    if (!rel) {
+      Elf_Phdr* phdrs = (Elf_Phdr*)(in->bin + ehdr.e_phoff);
+      for (int i = 0; i < ehdr.e_phnum; i++) {
+        Elf_Phdr* phdr = &phdrs[i];
+        if (phdr->p_type != PT_LOAD) continue;
+        if (phdr->p_offset + phdr->p_filesz > file_size ||
+            !pread_full(fd, in->bin + phdr->p_offset, phdr->p_filesz,
+                        phdr->p_offset)) {
+          snprintf(obj_error, sizeof(obj_error),
+                   "%.200s: segment %d is truncated", name, i);
+          goto out;
+        }
+      }
+    }
+
+    Elf_Shdr* out_shdrs = (Elf_Shdr*)(in->bin + ehdr.e_shoff);
+    size_t next = align_up(file_size, 16);
+    for (int i = 0; i < ehdr.e_shnum && rel; i++) {
+      Elf_Shdr* shdr = &shdrs[i];
+      if (!section_needed(shdrs, ehdr.e_shnum, ehdr.e_shstrndx, i)) continue;
+      if (shdr->sh_flags & SHF_COMPRESSED) {
+        if (!inflate_section(fd, name, shdr, &chdrs[i], in->bin + next)) {
+          goto out;
+        }
+        out_shdrs[i].sh_offset = next;
+        out_shdrs[i].sh_size = chdrs[i].ch_size;
+        out_shdrs[i].sh_addralign = chdrs[i].ch_addralign;
+        out_shdrs[i].sh_flags &= ~SHF_COMPRESSED;
+        next += align_up(chdrs[i].ch_size, 16);
+      } else if (!pread_full(fd, in->bin + shdr->sh_offset, shdr->sh_size,
+                             shdr->sh_offset)) {
+        sprintf(obj_error, "read failed: %s", strerror(errno));
+        goto out;
+      }
+    }
+    mprotect(in->bin, total, PROT_READ);
+    ok = 1;
+  }
+
+out:
+  free(shdrs);
+  free(chdrs);
+  return ok;
+}
+
+// Maps regular files read-only so headers, symbols and relocations are
+// parsed in place. Pipes and other non-regular files are read into a
+// malloc'ed buffer instead. |fd| stays open and is read from its
+// current offset unless it is mapped.
+static int read_fd(int fd, const char* name, int flags, obj_input* in) {
+  struct stat st;
+  int ok = 0;
+  memset(in, 0, sizeof(*in));
+  in->fd = -1;
+
+  if (fstat(fd, &st) != 0) {
+    sprintf(obj_error, "fstat failed: %s", strerror(errno));
+    return 0;
+  }
+
+  if (S_ISREG(st.st_mode) && (flags & OBJFCN_STREAM)) {
+    ok = read_sparse(fd, name, st.st_size, in);
+    if (ok && (flags & OBJFCN_MAP_SEGMENTS)) {
+      in->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    }
+    if (!ok) free_input(in);
+    return ok;
+  }
+
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    in->size = st.st_size;
+    in->bin = (char*)mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (in->bin != MAP_FAILED) {
+      in->mapped = 1;
+      if (flags & OBJFCN_MAP_SEGMENTS) {
+        in->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+      }
+      ok = 1;
+    } else {
+      in->bin = NULL;
+    }
+  }
+
+  if (!ok) {
+    ok = read_stream(fd, in);
+  }
+  if (ok && in->size < sizeof(Elf_Ehdr)) {
+    sprintf(obj_error, "%s is too small to be ELF", name);
+    ok = 0;
+  }
+  if (!ok) {
+    free_input(in);
+  }
+  return ok;
+}
+
+static int read_file(const char* filename, int flags, obj_input* in) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    memset(in, 0, sizeof(*in));
+    in->fd = -1;
+    sprintf(obj_error, "failed to open %s: %s", filename, strerror(errno));
+    return 0;
+  }
+  int ok = read_fd(fd, filename, flags, in);
+  close(fd);
+  return ok;
+}
+
+static size_t section_align(Elf_Shdr* shdr) {
+  return shdr->sh_addralign > 16 ? shdr->sh_addralign : 16;
+}
+
+static int should_load(Elf_Shdr* shdr) {
+#ifdef SHT_ARM_EXIDX
+  return shdr->sh_flags & SHF_ALLOC && shdr->sh_type != SHT_ARM_EXIDX;
+#else
+  return shdr->sh_flags & SHF_ALLOC;
+#endif
+}
+
+// Parallel relocation. Relocations are split into chunks of
+// OBJFCN_RELOC_CHUNK, which touch disjoint targets once symbols and
+// stubs are resolved, so the chunks can be applied in any order.
+
+#ifndef OBJFCN_RELOC_CHUNK
+#define OBJFCN_RELOC_CHUNK 4096
+#endif
+
+#define OBJFCN_MAX_THREADS 64
+
+static int reloc_threads = 1;
+
+void objreloc_set_threads(int threads) {
+  if (threads < 1) threads = 1;
+  if (threads > OBJFCN_MAX_THREADS) threads = OBJFCN_MAX_THREADS;
+  reloc_threads = threads;
+}
+
+typedef struct {
+  int (*fn)(void* arg, size_t item);
+  void* arg;
+  size_t num_items;
+  size_t next;
+  size_t failed;  // the lowest failing item, or num_items
+  char error[sizeof(obj_error)];
+  pthread_mutex_t lock;
+} par_job;
+
+static void* par_worker(void* p) {
+  par_job* job = (par_job*)p;
+  for (;;) {
+    size_t item = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (item >= job->num_items) break;
+    if (!job->fn(job->arg, item)) {
+      pthread_mutex_lock(&job->lock);
+      if (item < job->failed) {
+        job->failed = item;
+        memcpy(job->error, obj_error, sizeof(job->error));
+      }
+      pthread_mutex_unlock(&job->lock);
+    }
+  }
+  return NULL;
+}
+
+// Calls fn for items [0, num_items) on up to |threads| threads, the
+// calling one included. On failure, obj_error is set by the lowest
+// failing item as it would be by the serial path.
+static int run_parallel(int (*fn)(void*, size_t), void* arg,
+                        size_t num_items, int threads) {
+  if (threads > OBJFCN_MAX_THREADS) threads = OBJFCN_MAX_THREADS;
+  if ((size_t)threads > num_items) threads = (int)num_items;
+  if (threads <= 1) {
+    for (size_t i = 0; i < num_items; i++) {
+      if (!fn(arg, i)) return 0;
+    }
+    return 1;
+  }
+
+  par_job job;
+  pthread_t tids[OBJFCN_MAX_THREADS];
+  int started = 0;
+  job.fn = fn;
+  job.arg = arg;
+  job.num_items = num_items;
+  job.next = 0;
+  job.failed = num_items;
+  pthread_mutex_init(&job.lock, NULL);
+  // Fewer workers than asked for is fine; the calling thread picks up
+  // whatever is left.
+  while (started < threads - 1 &&
+         !pthread_create(&tids[started], NULL, par_worker, &job)) {
+    started++;
+  }
+  par_worker(&job);
+  for (int i = 0; i < started; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  pthread_mutex_destroy(&job.lock);
+  LOGF(OBJFCN_LOG_INFO, "ran %zu jobs on %d threads\n", num_items,
+       started + 1);
+
+  if (job.failed < num_items) {
+    memcpy(obj_error, job.error, sizeof(obj_error));
+    return 0;
+  }
+  return 1;
+}
+
+// GOT entries for TLS references, by access model.
+enum { TLS_GD, TLS_LD, TLS_IE, TLS_DESC, NUM_TLS_KINDS };
+
+// PLT stubs and GOT slots for a relocatable object, indexed by symbol
+// so all relocations against the same symbol share one.
+typedef struct {
+  char** plt;
+  char** got;
+  char** tls[NUM_TLS_KINDS];  // allocated on the first use of each
+  int num_syms;
+  uint8_t* sized;  // STUB_* bits already counted by the sizing pass
+  size_t plt_size;
+  size_t got_size;
+  char* plt_next;
+  char* got_next;
+  char* plt_end;
+  char* got_end;
+  size_t num_plt;
+  size_t num_got;
+} stub_table;
+
+#define STUB_PLT 1
+#define STUB_GOT 2
+#define STUB_TLS 4  // STUB_TLS << TLS_* for the TLS entries
+
+// Whether |dest| can be reached with a signed |bits|-bit displacement
+// from anywhere in the object's text. Deciding per object rather than
+// per call site keeps the stub layout independent of relocation order.
+#if defined(__x86_64__) || defined(__arm__) || defined(__aarch64__)
+static int reachable(obj_handle* obj, const char* dest, int bits) {
+  region* text = &obj->segs[SEG_TEXT];
+  intptr_t limit = (intptr_t)1 << (bits - 1);
+  intptr_t lo = dest - text->start;
+  intptr_t hi = dest - (text->start + text->size);
+  return (lo < limit && lo >= -limit && hi < limit && hi >= -limit);
+}
+#endif
+
+// Reserves space for a stub of |kind| for |sym_idx| in the sizing pass.
+static size_t reserve_stub(stub_table* stubs, int sym_idx, int kind,
+                           size_t size) {
+  if (stubs->sized[sym_idx] & kind) return 0;
+  stubs->sized[sym_idx] |= kind;
+  if (kind == STUB_PLT) {
+    stubs->plt_size += size;
+  } else {
+    stubs->got_size += size;
+  }
+  return size;
+}
+
+// Takes a stub counted by reserve_stub, or fails if the sizing pass
+// counted too few.
+static char* alloc_stub(stub_table* stubs, int kind, size_t size) {
+  char** next = kind == STUB_PLT ? &stubs->plt_next : &stubs->got_next;
+  char* end = kind == STUB_PLT ? stubs->plt_end : stubs->got_end;
+  char* r = *next;
+  if ((size_t)(end - r) < size) {
+    sprintf(obj_error, "%s stubs overflow",
+            kind == STUB_PLT ? "PLT" : "GOT");
+    return NULL;
+  }
+  *next += size;
+  if (kind == STUB_PLT) {
+    stubs->num_plt++;
+  } else {
+    stubs->num_got++;
+  }
+  return r;
+}
+
+// Slots of a loaded image which depend on where it and the symbols it
+// imports are, recorded for the image cache. Replaying a fixup adds the
+// distance its source moved by, less the distance the image moved by
+// for PC-relative slots.
+#define FIXUP_NONE 0  // absolute symbols
+#define FIXUP_BASE 1  // the image itself
+#define FIXUP_EXT 2   // FIXUP_EXT + i for the i-th imported symbol
+
+#define FIXUP_64 1
+#define FIXUP_PCREL 2
+
+typedef struct {
+  uint64_t offset;
+  uint32_t source;
+  uint32_t kind;
+} obj_fixup;
+
+typedef struct {
+  const char* name;
+  char* addr;
+} fixup_ext;
+
+typedef struct {
+  obj_fixup* fixups;
+  size_t num_fixups;
+  size_t cap_fixups;
+  fixup_ext* exts;
+  size_t num_exts;
+  size_t cap_exts;
+  uint32_t* ext_of_sym;  // FIXUP_EXT + i by symbol index, or 0
+  int failed;
+} fixup_log;
+
+static int grow(void** p, size_t* cap, size_t num, size_t elem_size) {
+  if (num < *cap) return 1;
+  size_t n = *cap ? *cap * 2 : 64;
+  void* q = realloc(*p, n * elem_size);
+  if (!q) return 0;
+  *p = q;
+  *cap = n;
+  return 1;
+}
+
+static void free_fixup_log(fixup_log* log) {
+  free(log->fixups);
+  free(log->exts);
+  free(log->ext_of_sym);
+}
+
+// Relocations of relocatable objects are handled in three passes.
+// RELOC_SIZE counts stubs and GOT slots before the layout is known.
+// RELOC_RESOLVE looks up every symbol once and fills in the stubs, in
+// relocation order. RELOC_APPLY then only patches targets, which lets it
+// run on several threads.
+enum { RELOC_SIZE, RELOC_RESOLVE, RELOC_APPLY };
+
+typedef struct {
+  int shndx;
+  int begin;
+  int end;
+} reloc_chunk;
+
+typedef struct {
+  obj_handle* obj;
+  const char* bin;
+  Elf_Sym* symtab;
+  const char* strtab;
+  char** addrs;
+  size_t* tls_offsets;  // by section, for SHF_TLS sections
+  stub_table* stubs;
+  size_t text_size;  // of the sections, before the stubs are added
+  char** sym_addrs;  // by symbol index, filled by RELOC_RESOLVE
+  uint8_t* resolved;
+  reloc_chunk* chunks;
+  fixup_log* log;  // for the image cache, filled by RELOC_RESOLVE
+} reloc_ctx;
+
+static int is_tls_section(reloc_ctx* ctx, int shndx) {
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)ctx->bin;
+  Elf_Shdr* shdrs = (Elf_Shdr*)(ctx->bin + ehdr->e_shoff);
+  return (ctx->tls_offsets && shndx < ehdr->e_shnum &&
+          (shdrs[shndx].sh_flags & SHF_TLS));
+}
+
+static int resolve_sym(reloc_ctx* ctx, int sym_idx) {
+  Elf_Sym* sym = &ctx->symtab[sym_idx];
+  char* sym_addr = NULL;
+
+  if (ctx->resolved[sym_idx]) return 1;
+
+  switch (ELFW_ST_TYPE(sym->st_info)) {
+    case STT_SECTION:
+      if (is_tls_section(ctx, sym->st_shndx)) {
+        sym_addr = (char*)ctx->tls_offsets[sym->st_shndx];
+      } else {
+        sym_addr = ctx->addrs[sym->st_shndx];
+      }
+      break;
+
+#if defined(__x86_64__)
+    case STT_TLS:
+      if (sym->st_shndx == SHN_UNDEF) {
+        // Only the host's static TLS is at a fixed offset from the
+        // thread pointer, which is what the reference gets.
+        const char* name = ctx->strtab + sym->st_name;
+        char* addr = (char*)dlsym(RTLD_DEFAULT, name);
+        if (addr == NULL) {
+          sprintf(obj_error, "failed to resolve %s", name);
+          return 0;
+        }
+        sym_addr = (char*)(addr - (char*)__builtin_thread_pointer());
+      } else if (is_tls_section(ctx, sym->st_shndx)) {
+        sym_addr =
+            (char*)(ctx->tls_offsets[sym->st_shndx] + sym->st_value);
+      } else {
+        sprintf(obj_error, "TLS symbol outside TLS sections");
+        return 0;
+      }
+      break;
+#endif
+
+    case STT_FUNC:
+    case STT_OBJECT:
+    case STT_NOTYPE:
+      if (sym->st_shndx == SHN_UNDEF) {
+        const char* name = ctx->strtab + sym->st_name;
+        if (!strcmp(name, "__tls_get_addr")) {
+          // The dtv of the host does not know about our modules.
+          sym_addr = (char*)&objfcn_tls_get_addr;
+          break;
+        }
+        if (!strcmp(name, "_GLOBAL_OFFSET_TABLE_")) {
+          sym_addr = ctx->obj->stub_segs[1].start;
+          break;
+        }
+        sym_addr = (char*)resolve_external(ctx->obj, name, NULL,
+                                           gnu_hash_calc(name));
+        if (sym_addr == NULL) {
+          sprintf(obj_error, "failed to resolve %s", name);
+          return 0;
+        }
+      } else if (sym->st_shndx == SHN_ABS) {
+        sym_addr = (char*)sym->st_value;
+      } else {
+        sym_addr = ctx->addrs[sym->st_shndx] + sym->st_value;
+      }
+      break;
+
+    default:
+      sprintf(obj_error, "unsupported relocation sym %d",
+              ELFW_ST_TYPE(sym->st_info));
+      return 0;
+  }
+
+  ctx->sym_addrs[sym_idx] = sym_addr;
+  ctx->resolved[sym_idx] = 1;
+  return 1;
+}
+
+// Records that |where| was relocated against |sym_idx|.
+static void record_fixup(reloc_ctx* ctx, char* where, int sym_idx,
+                         int kind) {
+  fixup_log* log = ctx->log;
+  if (!log || log->failed) return;
+
+  Elf_Sym* sym = &ctx->symtab[sym_idx];
+  uint32_t source = FIXUP_BASE;
+  if (sym->st_shndx == SHN_ABS) {
+    source = FIXUP_NONE;
+  } else if (sym->st_shndx == SHN_UNDEF) {
+    source = log->ext_of_sym[sym_idx];
+    if (!source) {
+      if (!grow((void**)&log->exts, &log->cap_exts, log->num_exts,
+                sizeof(fixup_ext))) {
+        log->failed = 1;
+        return;
+      }
+      log->exts[log->num_exts].name = ctx->strtab + sym->st_name;
+      log->exts[log->num_exts].addr = ctx->sym_addrs[sym_idx];
+      source = log->ext_of_sym[sym_idx] = FIXUP_EXT + log->num_exts++;
+    }
+  }
+  // Nothing to redo for PC-relative references within the image and
+  // absolute references to absolute symbols.
+  if (kind & FIXUP_PCREL ? source == FIXUP_BASE : source == FIXUP_NONE) {
+    return;
+  }
+
+  if (!grow((void**)&log->fixups, &log->cap_fixups, log->num_fixups,
+            sizeof(obj_fixup))) {
+    log->failed = 1;
+    return;
+  }
+  obj_fixup* f = &log->fixups[log->num_fixups++];
+  f->offset = where - ctx->obj->code;
+  f->source = source;
+  f->kind = kind;
+}
+
+// One relocation of a relocatable object, as its handler sees it.
+typedef struct {
+  int type;
+  char* target;
+  int sym_idx;
+  int is_external;
+  intptr_t addend;
+  char* sym_addr;  // NULL in RELOC_SIZE
+} reloc_site;
+
+// Handles |r| in |pass|. Returns the stub space needed in RELOC_SIZE, 0
+// in the other passes, or -1 on error.
+typedef size_t (*reloc_fn)(reloc_ctx* ctx, reloc_site* r, int pass);
+
+#if defined(__x86_64__) || defined(__aarch64__)
+static const char* reloc_sym_name(reloc_ctx* ctx, reloc_site* r) {
+  return ctx->strtab + ctx->symtab[r->sym_idx].st_name;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__arm__) || defined(__aarch64__)
+// Whether a call within the object may be out of reach of a |bits|-bit
+// displacement, so the sizing pass has to count a stub of |size| for
+// it too. The stubs follow the sections and may add one per symbol.
+static int text_exceeds(reloc_ctx* ctx, int bits, size_t size) {
+  size_t text = ctx->text_size + (size_t)ctx->stubs->num_syms * size;
+  return text >= (size_t)1 << (bits - 1);
+}
+#endif
+
+#if defined(__x86_64__)
+// Keeps the image out of the cache, for slots replaying a fixup cannot
+// redo.
+static void no_cache(reloc_ctx* ctx) {
+  if (ctx->log) ctx->log->failed = 1;
+}
+#endif
+
+static size_t reloc_none(reloc_ctx* ctx, reloc_site* r, int pass) {
+  return 0;
+}
+
+#ifdef R_32
+static size_t reloc_abs32(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass == RELOC_APPLY)
+    *(uint32_t*)r->target += (uint32_t)r->sym_addr + r->addend;
+  else if (pass == RELOC_RESOLVE)
+    record_fixup(ctx, r->target, r->sym_idx, 0);
+  return 0;
+}
+#endif
+
+#ifdef R_64
+static size_t reloc_abs64(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass == RELOC_APPLY)
+    *(uint64_t*)r->target += (uint64_t)r->sym_addr + r->addend;
+  else if (pass == RELOC_RESOLVE)
+    record_fixup(ctx, r->target, r->sym_idx, FIXUP_64);
+  return 0;
+}
+#endif
+
+#ifdef R_PC32
+static size_t reloc_pc32(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass == RELOC_APPLY) {
+    *(uint32_t*)r->target += (r->sym_addr - r->target) + r->addend;
+  } else if (pass == RELOC_RESOLVE) {
+#if defined(__x86_64__)
+    // Data references cannot go through a stub.
+    int64_t v = (r->sym_addr - r->target) + (int64_t)r->addend;
+    if (v < INT32_MIN || v > INT32_MAX) {
+      snprintf(obj_error, sizeof(obj_error),
+               "%.100s: PC32 relocation against %.100s out of range",
+               ctx->obj->filename, reloc_sym_name(ctx, r));
+      return (size_t)-1;
+    }
+#endif
+    record_fixup(ctx, r->target, r->sym_idx, FIXUP_PCREL);
+  }
+  return 0;
+}
+#endif
+
+#if defined(__x86_64__)
+
+// Calls into the host when it happens to be near enough, or within an
+// object whose text is smaller than the reach, need no stub.
+static size_t reloc_plt32(reloc_ctx* ctx, reloc_site* r, int pass) {
+  stub_table* stubs = ctx->stubs;
+  int sym_idx = r->sym_idx;
+  if (pass == RELOC_SIZE) {
+    if (r->is_external || text_exceeds(ctx, 32, 16))
+      return reserve_stub(stubs, sym_idx, STUB_PLT, 16);
+  } else if (pass == RELOC_RESOLVE) {
+    if (!reachable(ctx->obj, r->sym_addr, 32) && !stubs->plt[sym_idx]) {
+      // jmp *0(%rip); .quad dest
+      char* stub = alloc_stub(stubs, STUB_PLT, 16);
+      if (!stub) return (size_t)-1;
+      stub[0] = 0xff;
+      stub[1] = 0x25;
+      *(uint32_t*)(stub + 2) = 0;
+      *(uint64_t*)(stub + 6) = (uint64_t)r->sym_addr;
+      stub[14] = stub[15] = 0xcc;
+      stubs->plt[sym_idx] = stub;
+      record_fixup(ctx, stub + 6, sym_idx, FIXUP_64);
+    }
+    if (!stubs->plt[sym_idx])
+      record_fixup(ctx, r->target, sym_idx, FIXUP_PCREL);
+  } else {
+    char* dest = stubs->plt[sym_idx] ? stubs->plt[sym_idx] : r->sym_addr;
+    *(uint32_t*)r->target += (dest - r->target) + r->addend;
+  }
+  return 0;
+}
+
+// R_X86_64_32 and R_X86_64_32S, which only fit when everything they
+// refer to is in the low or high 2GB.
+static size_t reloc_abs32s(reloc_ctx* ctx, reloc_site* r, int pass) {
+  uint64_t v = (uint64_t)r->sym_addr + r->addend;
+  if (pass == RELOC_RESOLVE) {
+    if (r->type == R_X86_64_32 ? v != (uint32_t)v
+                               : (int64_t)v != (int32_t)v) {
+      snprintf(obj_error, sizeof(obj_error),
+               "%.80s: 32-bit relocation against %.80s out of range, "
+               "build it with -fPIC",
+               ctx->obj->filename, reloc_sym_name(ctx, r));
+      return (size_t)-1;
+    }
+    // Fixups do not check the range again.
+    no_cache(ctx);
+  } else if (pass == RELOC_APPLY) {
+    *(uint32_t*)r->target += (uint32_t)v;
+  }
+  return 0;
+}
+
+// R_X86_64_PC64, and R_X86_64_GOTOFF64 and R_X86_64_PLTOFF64 of the
+// large code model, which are relative to the GOT instead. 64 bits reach
+// anything, so PLTOFF64 needs no stub either.
+static size_t reloc_pc64(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass == RELOC_APPLY) {
+    char* base = r->type == R_X86_64_PC64 ? r->target
+                                          : ctx->obj->stub_segs[1].start;
+    *(uint64_t*)r->target += (r->sym_addr - base) + r->addend;
+  } else if (pass == RELOC_RESOLVE) {
+    record_fixup(ctx, r->target, r->sym_idx, FIXUP_64 | FIXUP_PCREL);
+  }
+  return 0;
+}
+
+// R_X86_64_GOTPC32 and R_X86_64_GOTPC64, the distance to the GOT.
+static size_t reloc_gotpc(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass == RELOC_APPLY) {
+    intptr_t v = (ctx->obj->stub_segs[1].start - r->target) + r->addend;
+    if (r->type == R_X86_64_GOTPC64) {
+      *(uint64_t*)r->target += v;
+    } else {
+      *(uint32_t*)r->target += v;
+    }
+  }
+  return 0;
+}
+
+// Whether the instruction loading the GOT slot of |r| can use the
+// symbol itself, as the linker would relax it: a mov from the slot
+// becomes a lea, and an indirect call or jmp through it a direct one.
+static int gotpcrel_relaxable(reloc_site* r) {
+  const uint8_t* op = (const uint8_t*)r->target - 2;
+  int64_t v = (r->sym_addr - r->target) + (int64_t)r->addend;
+  if (v < INT32_MIN || v > INT32_MAX) return 0;
+  // mov foo@GOTPCREL(%rip), %reg
+  if (op[0] == 0x8b && (op[1] & 0xc7) == 0x05) {
+    return (r->type == R_X86_64_REX_GOTPCRELX ||
+            r->type == R_X86_64_GOTPCRELX);
+  }
+  // call *foo@GOTPCREL(%rip) and jmp *foo@GOTPCREL(%rip)
+  return (r->type == R_X86_64_GOTPCRELX && op[0] == 0xff &&
+          (op[1] == 0x15 || op[1] == 0x25));
+}
+
+// References to GOT slots. The sizing pass cannot tell which ones will
+// be relaxed and reserves a slot for each symbol anyway.
+static size_t reloc_got(reloc_ctx* ctx, reloc_site* r, int pass) {
+  stub_table* stubs = ctx->stubs;
+  int sym_idx = r->sym_idx;
+  int relax = (pass != RELOC_SIZE && r->type != R_X86_64_GOTPCREL &&
+               gotpcrel_relaxable(r));
+  if (pass == RELOC_SIZE) {
+    return reserve_stub(stubs, sym_idx, STUB_GOT, 8);
+  } else if (pass == RELOC_RESOLVE) {
+    if (relax) {
+      record_fixup(ctx, r->target, sym_idx, FIXUP_PCREL);
+    } else if (!stubs->got[sym_idx]) {
+      char* slot = alloc_stub(stubs, STUB_GOT, 8);
+      if (!slot) return (size_t)-1;
+      *(uint64_t*)(slot) = (uint64_t)r->sym_addr;
+      stubs->got[sym_idx] = slot;
+      record_fixup(ctx, slot, sym_idx, FIXUP_64);
+    }
+  } else if (relax) {
+    uint8_t* op = (uint8_t*)r->target - 2;
+    if (op[0] == 0x8b) {
+      op[0] = 0x8d;
+    } else if (op[1] == 0x15) {
+      // addr32 call foo
+      op[0] = 0x67;
+      op[1] = 0xe8;
+    } else {
+      // nop; jmp foo
+      op[0] = 0x90;
+      op[1] = 0xe9;
+    }
+    *(uint32_t*)r->target += (r->sym_addr - r->target) + r->addend;
+  } else {
+    char* got = ctx->obj->stub_segs[1].start;
+    char* slot = stubs->got[sym_idx];
+    switch (r->type) {
+      case R_X86_64_GOT32:
+        *(uint32_t*)r->target += (slot - got) + r->addend;
+        break;
+      case R_X86_64_GOT64:
+        *(uint64_t*)r->target += (slot - got) + r->addend;
+        break;
+      case R_X86_64_GOTPCREL64:
+        *(uint64_t*)r->target += (slot - r->target) + r->addend;
+        break;
+      default:
+        *(uint32_t*)r->target += (slot - r->target) + r->addend;
+        break;
+    }
+  }
+  return 0;
+}
+
+// TLS of relocatable objects. The object's own TLS sections make up a
+// module of their own, reached through __tls_get_addr or descriptors;
+// symbols resolve to their offset in it. Its offset from the thread
+// pointer differs from thread to thread, so initial-exec and
+// local-exec references are only possible to the host's static TLS, to
+// which undefined TLS symbols resolve the offset of instead. The host
+// is module 0 to objfcn_tls_get_addr.
+static int tls_kind_of(int type) {
+  switch (type) {
+    case R_X86_64_TLSGD:
+      return TLS_GD;
+    case R_X86_64_TLSLD:
+      return TLS_LD;
+    case R_X86_64_GOTTPOFF:
+      return TLS_IE;
+    default:
+      return TLS_DESC;
+  }
+}
+
+static size_t reloc_tls_got(reloc_ctx* ctx, reloc_site* r, int pass) {
+  stub_table* stubs = ctx->stubs;
+  obj_handle* obj = ctx->obj;
+  int kind = tls_kind_of(r->type);
+  size_t size = kind == TLS_IE ? 8 : 16;
+  int sym_idx = r->sym_idx;
+
+  if (pass == RELOC_SIZE) {
+    if (!stubs->tls[kind]) {
+      stubs->tls[kind] = (char**)calloc(stubs->num_syms, sizeof(char*));
+      if (!stubs->tls[kind]) {
+        sprintf(obj_error, "malloc failed");
+        return (size_t)-1;
+      }
+    }
+    if (kind == TLS_IE && !r->is_external) {
+      snprintf(obj_error, sizeof(obj_error),
+               "%.80s: initial-exec TLS reference to %.80s, build it "
+               "with -fPIC",
+               obj->filename, reloc_sym_name(ctx, r));
+      return (size_t)-1;
+    }
+    if (kind == TLS_LD && r->is_external) {
+      snprintf(obj_error, sizeof(obj_error),
+               "%.80s: local-dynamic TLS reference to %.80s",
+               obj->filename, reloc_sym_name(ctx, r));
+      return (size_t)-1;
+    }
+    return reserve_stub(stubs, sym_idx, STUB_TLS << kind, size);
+  } else if (pass == RELOC_RESOLVE) {
+    if (!stubs->tls[kind][sym_idx]) {
+      uintptr_t* slot = (uintptr_t*)alloc_stub(stubs, STUB_TLS << kind, size);
+      if (!slot) return (size_t)-1;
+      uintptr_t m = r->is_external ? 0 : obj->tls_module;
+      uintptr_t offset = kind == TLS_LD ? 0 : (uintptr_t)r->sym_addr;
+      if (kind == TLS_IE) {
+        slot[0] = offset;
+      } else if (kind == TLS_DESC) {
+        slot[0] = r->is_external ? (uintptr_t)&objfcn_tlsdesc_static
+                                 : (uintptr_t)&objfcn_tlsdesc_dynamic;
+        slot[1] = (m << TLSDESC_MODULE_SHIFT) | offset;
+      } else {
+        slot[0] = m;
+        slot[1] = offset;
+      }
+      stubs->tls[kind][sym_idx] = (char*)slot;
+    }
+    // Module IDs and offsets change from load to load.
+    no_cache(ctx);
+  } else {
+    char* slot = stubs->tls[kind][sym_idx];
+    *(uint32_t*)r->target += (slot - r->target) + r->addend;
+  }
+  return 0;
+}
+
+// R_X86_64_DTPOFF32 and R_X86_64_DTPOFF64, offsets in the object's own
+// module.
+static size_t reloc_dtpoff(reloc_ctx* ctx, reloc_site* r, int pass) {
+  uint64_t v = (uint64_t)r->sym_addr + r->addend;
+  if (pass == RELOC_SIZE && r->is_external) {
+    snprintf(obj_error, sizeof(obj_error),
+             "%.80s: module-relative TLS reference to %.80s",
+             ctx->obj->filename, reloc_sym_name(ctx, r));
+    return (size_t)-1;
+  } else if (pass == RELOC_APPLY) {
+    if (r->type == R_X86_64_DTPOFF64) {
+      *(uint64_t*)r->target += v;
+    } else {
+      *(uint32_t*)r->target += (uint32_t)v;
+    }
+  }
+  return 0;
+}
+
+// R_X86_64_TPOFF32 and R_X86_64_TPOFF64, offsets from the thread
+// pointer, which only undefined symbols have.
+static size_t reloc_tpoff(reloc_ctx* ctx, reloc_site* r, int pass) {
+  int64_t v = (intptr_t)r->sym_addr + (int64_t)r->addend;
+  if (pass == RELOC_SIZE && !r->is_external) {
+    snprintf(obj_error, sizeof(obj_error),
+             "%.80s: local-exec TLS reference to %.80s, build it with "
+             "-fPIC",
+             ctx->obj->filename, reloc_sym_name(ctx, r));
+    return (size_t)-1;
+  } else if (pass == RELOC_RESOLVE) {
+    if (r->type == R_X86_64_TPOFF32 && (v < INT32_MIN || v > INT32_MAX)) {
+      snprintf(obj_error, sizeof(obj_error),
+               "%.100s: TPOFF32 relocation against %.100s out of range",
+               ctx->obj->filename, reloc_sym_name(ctx, r));
+      return (size_t)-1;
+    }
+    // The layout of the static TLS may change from run to run.
+    no_cache(ctx);
+  } else if (pass == RELOC_APPLY) {
+    if (r->type == R_X86_64_TPOFF64) {
+      *(uint64_t*)r->target += (uint64_t)v;
+    } else {
+      *(uint32_t*)r->target += (uint32_t)v;
+    }
+  }
+  return 0;
+}
+
+#endif
+
+#if defined(__aarch64__)
+
+// Replaces the |mask| bits of the instruction at |target|.
+static void patch_insn(char* target, uint32_t mask, uint32_t bits) {
+  uint32_t* insn = (uint32_t*)target;
+  *insn = (*insn & ~mask) | (bits & mask);
+}
+
+static uintptr_t page_of(uintptr_t v) {
+  return v & ~(uintptr_t)0xfff;
+}
+
+// Sets the immediate of the ADRP at |target| to reach the page of
+// |dest|. Returns 0 if it is more than 4GB away.
+static int patch_adrp(char* target, uintptr_t dest, int check) {
+  int64_t v = (int64_t)(page_of(dest) - page_of((uintptr_t)target)) >> 12;
+  if (check && (v >= (1 << 20) || v < -(1 << 20))) return 0;
+  patch_insn(target, (3U << 29) | (0x7ffffU << 5),
+             ((uint32_t)(v & 3) << 29) | ((uint32_t)(v >> 2) << 5));
+  return 1;
+}
+
+static size_t reloc_range_error(reloc_ctx* ctx, reloc_site* r) {
+  snprintf(obj_error, sizeof(obj_error),
+           "%.100s: relocation %d against %.100s out of range",
+           ctx->obj->filename, r->type, reloc_sym_name(ctx, r));
+  return (size_t)-1;
+}
+
+// R_AARCH64_ABS32, R_AARCH64_PREL32 and R_AARCH64_PREL64.
+static size_t reloc_a64_data(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass != RELOC_APPLY) return 0;
+  int64_t v = (int64_t)(r->sym_addr + r->addend);
+  if (r->type != R_AARCH64_ABS32) v -= (int64_t)r->target;
+  if (r->type == R_AARCH64_PREL64) {
+    *(uint64_t*)r->target = v;
+  } else if (v < INT32_MIN ||
+             v > (r->type == R_AARCH64_ABS32 ? UINT32_MAX : INT32_MAX)) {
+    return reloc_range_error(ctx, r);
+  } else {
+    *(uint32_t*)r->target = (uint32_t)v;
+  }
+  return 0;
+}
+
+// R_AARCH64_ADR_PREL_PG_HI21 and its _NC variant.
+static size_t reloc_a64_adrp(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass == RELOC_APPLY &&
+      !patch_adrp(r->target, (uintptr_t)(r->sym_addr + r->addend),
+                  r->type == R_AARCH64_ADR_PREL_PG_HI21)) {
+    return reloc_range_error(ctx, r);
+  }
+  return 0;
+}
+
+// The low 12 bits of the address for ADD and for loads and stores,
+// which scale them by the access size.
+static size_t reloc_a64_lo12(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass != RELOC_APPLY) return 0;
+  int shift = 0;
+  switch (r->type) {
+    case R_AARCH64_LDST16_ABS_LO12_NC:
+      shift = 1;
+      break;
+    case R_AARCH64_LDST32_ABS_LO12_NC:
+      shift = 2;
+      break;
+    case R_AARCH64_LDST64_ABS_LO12_NC:
+      shift = 3;
+      break;
+    case R_AARCH64_LDST128_ABS_LO12_NC:
+      shift = 4;
+      break;
+  }
+  uint32_t lo12 = (uintptr_t)(r->sym_addr + r->addend) & 0xfff;
+  patch_insn(r->target, 0xfffU << 10, (lo12 >> shift) << 10);
+  return 0;
+}
+
+// MOVZ and MOVK of -mcmodel=large, 16 bits at a time.
+static size_t reloc_a64_movw(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass != RELOC_APPLY) return 0;
+  int shift = (r->type - R_AARCH64_MOVW_UABS_G0) / 2 * 16;
+  uint64_t v = (uint64_t)(r->sym_addr + r->addend);
+  patch_insn(r->target, 0xffffU << 5, (uint32_t)((v >> shift) & 0xffff) << 5);
+  return 0;
+}
+
+// B and BL reach +-128MB. Calls further away go through a veneer, one
+// per target shared by all its callers.
+static size_t reloc_a64_call(reloc_ctx* ctx, reloc_site* r, int pass) {
+  stub_table* stubs = ctx->stubs;
+  int sym_idx = r->sym_idx;
+  if (pass == RELOC_SIZE) {
+    if (r->is_external || text_exceeds(ctx, 28, 16))
+      return reserve_stub(stubs, sym_idx, STUB_PLT, 16);
+  } else if (pass == RELOC_RESOLVE) {
+    if (!reachable(ctx->obj, r->sym_addr, 28) && !stubs->plt[sym_idx]) {
+      // ldr x16, 8; br x16; .quad dest
+      char* stub = alloc_stub(stubs, STUB_PLT, 16);
+      if (!stub) return (size_t)-1;
+      *(uint32_t*)stub = 0x58000050;
+      *(uint32_t*)(stub + 4) = 0xd61f0200;
+      *(uint64_t*)(stub + 8) = (uint64_t)r->sym_addr;
+      stubs->plt[sym_idx] = stub;
+    }
+  } else {
+    char* dest = stubs->plt[sym_idx] ? stubs->plt[sym_idx] : r->sym_addr;
+    int64_t v = ((dest - r->target) + r->addend) >> 2;
+    if (v >= (1 << 25) || v < -(1 << 25)) {
+      return reloc_range_error(ctx, r);
+    }
+    patch_insn(r->target, 0x3ffffff, (uint32_t)v);
+  }
+  return 0;
+}
+
+// R_AARCH64_ADR_GOT_PAGE and R_AARCH64_LD64_GOT_LO12_NC. When the
+// symbol is within ADRP's reach of the text, the pair is relaxed: the
+// ADRP gets the page of the symbol itself and the LDR from the slot
+// becomes an ADD. Both relocations of a pair are against the same
+// symbol, so deciding by symbol keeps them consistent.
+static size_t reloc_a64_got(reloc_ctx* ctx, reloc_site* r, int pass) {
+  stub_table* stubs = ctx->stubs;
+  int sym_idx = r->sym_idx;
+  int relax = pass != RELOC_SIZE && reachable(ctx->obj, r->sym_addr, 33);
+  if (pass == RELOC_SIZE) {
+    return reserve_stub(stubs, sym_idx, STUB_GOT, 8);
+  } else if (pass == RELOC_RESOLVE) {
+    if (!relax && !stubs->got[sym_idx]) {
+      char* slot = alloc_stub(stubs, STUB_GOT, 8);
+      if (!slot) return (size_t)-1;
+      *(uint64_t*)slot = (uint64_t)r->sym_addr;
+      stubs->got[sym_idx] = slot;
+    }
+  } else {
+    uintptr_t dest = relax ? (uintptr_t)r->sym_addr
+                           : (uintptr_t)stubs->got[sym_idx];
+    dest += r->addend;
+    if (r->type == R_AARCH64_ADR_GOT_PAGE) {
+      if (!patch_adrp(r->target, dest, 1)) return reloc_range_error(ctx, r);
+    } else if (relax) {
+      // ldr xt, [xn, #lo12] => add xt, xn, #lo12
+      uint32_t* insn = (uint32_t*)r->target;
+      *insn = 0x91000000 | ((uint32_t)(dest & 0xfff) << 10) | (*insn & 0x3ff);
+    } else {
+      patch_insn(r->target, 0xfffU << 10, (uint32_t)(dest & 0xfff) >> 3 << 10);
+    }
+  }
+  return 0;
+}
+
+#endif
+
+#if defined(__i386__)
+
+// R_386_GOTOFF, R_386_GOTPC and R_386_GOT32(X), which are relative to
+// the GOT whose address -fPIC code keeps in a register.
+static size_t reloc_386_got(reloc_ctx* ctx, reloc_site* r, int pass) {
+  stub_table* stubs = ctx->stubs;
+  char* got = ctx->obj->stub_segs[1].start;
+  int sym_idx = r->sym_idx;
+  if (r->type == R_386_GOTOFF) {
+    if (pass == RELOC_APPLY)
+      *(uint32_t*)r->target += r->sym_addr - got;
+  } else if (r->type == R_386_GOTPC) {
+    if (pass == RELOC_APPLY)
+      *(uint32_t*)r->target += got - r->target;
+  } else if (pass == RELOC_SIZE) {
+    return reserve_stub(stubs, sym_idx, STUB_GOT, 4);
+  } else if (pass == RELOC_RESOLVE) {
+    if (!stubs->got[sym_idx]) {
+      char* slot = alloc_stub(stubs, STUB_GOT, 4);
+      if (!slot) return (size_t)-1;
+      *(uint32_t*)slot = (uint32_t)r->sym_addr;
+      stubs->got[sym_idx] = slot;
+    }
+  } else {
+    *(uint32_t*)r->target += stubs->got[sym_idx] - got;
+  }
+  return 0;
+}
+
+#endif
+
+#if defined(__arm__)
+static size_t reloc_arm_call(reloc_ctx* ctx, reloc_site* r, int pass) {
+  stub_table* stubs = ctx->stubs;
+  int sym_idx = r->sym_idx;
+  if (pass == RELOC_SIZE) {
+    if (r->is_external || text_exceeds(ctx, 26, 8))
+      return reserve_stub(stubs, sym_idx, STUB_PLT, 8);
+  } else if (pass == RELOC_RESOLVE) {
+    // BL reaches +-32MB.
+    if (!reachable(ctx->obj, r->sym_addr, 26) && !stubs->plt[sym_idx]) {
+      char* stub = alloc_stub(stubs, STUB_PLT, 8);
+      if (!stub) return (size_t)-1;
+      // ldr pc, [pc, #-4]
+      *(uint32_t*)stub = 0xe51ff004;
+      *(uint32_t*)(stub + 4) = (uint32_t)r->sym_addr;
+      stubs->plt[sym_idx] = stub;
+    }
+  } else {
+    char* dest = stubs->plt[sym_idx] ? stubs->plt[sym_idx] : r->sym_addr;
+    int32_t v = ((dest - r->target) + r->addend - 8) >> 2;
+    if (v >= (1 << 23) || v < -(1 << 23)) {
+      sprintf(obj_error, "Relocation out of range: %x", v);
+      return (size_t)-1;
+    }
+    *(uint32_t*)r->target =
+        (((uint8_t*)r->target)[3] << 24U) | (0xffffff & v);
+  }
+  return 0;
+}
+
+static size_t reloc_arm_abs32(reloc_ctx* ctx, reloc_site* r, int pass) {
+  if (pass == RELOC_APPLY)
+    *(uint32_t*)r->target = (uint32_t)r->sym_addr + r->addend;
+  return 0;
+}
+#endif
+
+typedef struct {
+  int type;
+  reloc_fn fn;
+} reloc_howto;
+
+static const reloc_howto reloc_howtos[] = {
+  {0, reloc_none},  // R_*_NONE
+#ifdef R_32
+  {R_32, reloc_abs32},
+#endif
+#ifdef R_64
+  {R_64, reloc_abs64},
+#endif
+#ifdef R_PC32
+  {R_PC32, reloc_pc32},
+#endif
+#if defined(__x86_64__)
+  {R_X86_64_PLT32, reloc_plt32},
+  {R_X86_64_32, reloc_abs32s},
+  {R_X86_64_32S, reloc_abs32s},
+  {R_X86_64_PC64, reloc_pc64},
+  {R_X86_64_GOTOFF64, reloc_pc64},
+  {R_X86_64_PLTOFF64, reloc_pc64},
+  {R_X86_64_GOTPC32, reloc_gotpc},
+  {R_X86_64_GOTPC64, reloc_gotpc},
+  {R_X86_64_GOT32, reloc_got},
+  {R_X86_64_GOT64, reloc_got},
+  {R_X86_64_GOTPCREL, reloc_got},
+  {R_X86_64_GOTPCREL64, reloc_got},
+  {R_X86_64_GOTPCRELX, reloc_got},
+  {R_X86_64_REX_GOTPCRELX, reloc_got},
+  {R_X86_64_TLSGD, reloc_tls_got},
+  {R_X86_64_TLSLD, reloc_tls_got},
+  {R_X86_64_GOTTPOFF, reloc_tls_got},
+  {R_X86_64_GOTPC32_TLSDESC, reloc_tls_got},
+  {R_X86_64_TLSDESC_CALL, reloc_none},
+  {R_X86_64_DTPOFF32, reloc_dtpoff},
+  {R_X86_64_DTPOFF64, reloc_dtpoff},
+  {R_X86_64_TPOFF32, reloc_tpoff},
+  {R_X86_64_TPOFF64, reloc_tpoff},
+#endif
+#if defined(__i386__)
+  {R_386_PLT32, reloc_pc32},
+  {R_386_GOTOFF, reloc_386_got},
+  {R_386_GOTPC, reloc_386_got},
+  {R_386_GOT32, reloc_386_got},
+  {R_386_GOT32X, reloc_386_got},
+#endif
+#if defined(__aarch64__)
+  {R_AARCH64_ABS32, reloc_a64_data},
+  {R_AARCH64_PREL32, reloc_a64_data},
+  {R_AARCH64_PREL64, reloc_a64_data},
+  {R_AARCH64_ADR_PREL_PG_HI21, reloc_a64_adrp},
+  {R_AARCH64_ADR_PREL_PG_HI21_NC, reloc_a64_adrp},
+  {R_AARCH64_ADD_ABS_LO12_NC, reloc_a64_lo12},
+  {R_AARCH64_LDST8_ABS_LO12_NC, reloc_a64_lo12},
+  {R_AARCH64_LDST16_ABS_LO12_NC, reloc_a64_lo12},
+  {R_AARCH64_LDST32_ABS_LO12_NC, reloc_a64_lo12},
+  {R_AARCH64_LDST64_ABS_LO12_NC, reloc_a64_lo12},
+  {R_AARCH64_LDST128_ABS_LO12_NC, reloc_a64_lo12},
+  {R_AARCH64_MOVW_UABS_G0, reloc_a64_movw},
+  {R_AARCH64_MOVW_UABS_G0_NC, reloc_a64_movw},
+  {R_AARCH64_MOVW_UABS_G1, reloc_a64_movw},
+  {R_AARCH64_MOVW_UABS_G1_NC, reloc_a64_movw},
+  {R_AARCH64_MOVW_UABS_G2, reloc_a64_movw},
+  {R_AARCH64_MOVW_UABS_G2_NC, reloc_a64_movw},
+  {R_AARCH64_MOVW_UABS_G3, reloc_a64_movw},
+  {R_AARCH64_CALL26, reloc_a64_call},
+  {R_AARCH64_JUMP26, reloc_a64_call},
+  {R_AARCH64_ADR_GOT_PAGE, reloc_a64_got},
+  {R_AARCH64_LD64_GOT_LO12_NC, reloc_a64_got},
+#endif
+#if defined(__arm__)
+  {R_ARM_CALL, reloc_arm_call},
+  {R_ARM_ABS32, reloc_arm_abs32},
+#endif
+};
+
+// Handlers by relocation type. All three passes dispatch through it, so
+// each type is decoded in one place.
+static reloc_fn reloc_fns[RELOC_TABLE_SIZE];
+
+static void init_relocs(void) {
+  for (size_t i = 0; i < sizeof(reloc_howtos) / sizeof(reloc_howtos[0]);
+       i++) {
+    reloc_fns[reloc_howtos[i].type] = reloc_howtos[i].fn;
+  }
+}
+
+// Handles relocations [begin, end) of section |shndx|. Returns the stub
+// space needed in RELOC_SIZE, 0 in the other passes, or -1 on error.
+static size_t relocate_range(reloc_ctx* ctx, int shndx, int begin, int end,
+                             int pass) {
+  size_t code_size = 0;
+  obj_handle* obj = ctx->obj;
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)ctx->bin;
+  Elf_Shdr* shdr = &((Elf_Shdr*)(ctx->bin + ehdr->e_shoff))[shndx];
+  int has_addend = shdr->sh_type == SHT_RELA;
+  size_t relsize = has_addend ? sizeof(Elf_Rela) : sizeof(Elf_Rel);
+  char* target_base = ctx->addrs[shdr->sh_info];
+
+  for (int j = begin; j < end; j++) {
+    Elf_Rela* rel = (Elf_Rela*)(ctx->bin + shdr->sh_offset + relsize * j);
+    reloc_site r;
+    r.type = ELFW_R_TYPE(rel->r_info);
+    r.target = target_base + rel->r_offset;
+    r.sym_idx = ELFW_R_SYM(rel->r_info);
+    r.is_external = ctx->symtab[r.sym_idx].st_shndx == SHN_UNDEF;
+    r.addend = has_addend ? rel->r_addend : 0;
+    r.sym_addr = NULL;
+
+    reloc_fn fn = (unsigned)r.type < RELOC_TABLE_SIZE ? reloc_fns[r.type]
+                                                      : NULL;
+    if (!fn) {
+      sprintf(obj_error, "Unknown reloc: %ld", (long)r.type);
+      return (size_t)-1;
+    }
+    if (pass == RELOC_RESOLVE && !resolve_sym(ctx, r.sym_idx)) {
+      return (size_t)-1;
+    }
+    if (pass == RELOC_RESOLVE && obj->stats) {
+      stat_reloc_n(obj->stats, r.type, 1);
+    }
+    if (pass != RELOC_SIZE) {
+      r.sym_addr = ctx->sym_addrs[r.sym_idx];
+    }
+
+    size_t n = fn(ctx, &r, pass);
+    if (n == (size_t)-1) return n;
+    code_size += n;
+  }
+  return code_size;
+}
+
+static int apply_reloc_chunk(void* arg, size_t i) {
+  reloc_ctx* ctx = (reloc_ctx*)arg;
+  reloc_chunk* c = &ctx->chunks[i];
+  return relocate_range(ctx, c->shndx, c->begin, c->end, RELOC_APPLY) !=
+         (size_t)-1;
+}
+
+static size_t relocate(reloc_ctx* ctx, int pass) {
+  size_t code_size = 0;
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)ctx->bin;
+  Elf_Shdr* shdrs = (Elf_Shdr*)(ctx->bin + ehdr->e_shoff);
+  size_t num_chunks = 0;
+
+  // The first round counts the chunks of RELOC_APPLY, the second one
+  // fills them in.
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+      Elf_Shdr* shdr = &shdrs[i];
+      int has_addend = shdr->sh_type == SHT_RELA;
+      size_t relsize = has_addend ? sizeof(Elf_Rela) : sizeof(Elf_Rel);
+      int relnum = shdr->sh_size / relsize;
+
+      if ((shdr->sh_type != SHT_REL && shdr->sh_type != SHT_RELA) ||
+          !should_load(&shdrs[shdr->sh_info])) {
+        continue;
+      }
+
+      if (pass != RELOC_APPLY) {
+        size_t r = relocate_range(ctx, i, 0, relnum, pass);
+        if (r == (size_t)-1) return r;
+        code_size += r;
+        continue;
+      }
+      for (int b = 0; b < relnum; b += OBJFCN_RELOC_CHUNK) {
+        if (round) {
+          reloc_chunk* c = &ctx->chunks[num_chunks];
+          c->shndx = i;
+          c->begin = b;
+          c->end = relnum - b < OBJFCN_RELOC_CHUNK ? relnum
+                                                   : b + OBJFCN_RELOC_CHUNK;
+        }
+        num_chunks++;
+      }
+    }
+    if (pass != RELOC_APPLY) return code_size;
+    if (!round) {
+      ctx->chunks =
+          (reloc_chunk*)malloc(sizeof(reloc_chunk) * (num_chunks + 1));
+      if (!ctx->chunks) {
+        sprintf(obj_error, "malloc failed");
+        return (size_t)-1;
+      }
+      num_chunks = 0;
+    }
+  }
+
+  int ok = run_parallel(apply_reloc_chunk, ctx, num_chunks, reloc_threads);
+  free(ctx->chunks);
+  ctx->chunks = NULL;
+  return ok ? 0 : (size_t)-1;
+}
+
+static int is_defined(Elf_Sym* sym) {
+  int bind = ELFW_ST_BIND(sym->st_info);
+  return ((bind == STB_GLOBAL || bind == STB_WEAK) &&
+          sym->st_shndx != SHN_UNDEF);
+}
+
+static void* objsym_dyn_elf_hash(obj_handle* obj, const char* symbol) {
+  assert(obj->elf_hash);
+  Elf_Hash* elf_hash = obj->elf_hash;
+
+  uint32_t h = elf_hash_calc(symbol);
+  uint32_t n = elf_hash_buckets(elf_hash)[h % elf_hash->nbuckets];
+  for (; n; n = elf_hash_chains(elf_hash)[n]) {
+    Elf_Sym* sym = &obj->symtab[n];
+
+    if (!strcmp(symbol, obj->strtab + sym->st_name) && is_defined(sym)) {
+      return obj->base + sym->st_value;
+    }
+  }
+  return NULL;
+}
+
+// |h| is gnu_hash_calc(symbol).
+static void* objsym_dyn_gnu_hash(obj_handle* obj, const char* symbol,
+                                 uint32_t h) {
+  assert(obj->gnu_hash);
+  Elf_GnuHash* gnu_hash = obj->gnu_hash;
+
+  // Most lookups from relocate_dyn() are for symbols defined elsewhere,
+  // which the bloom filter rejects without touching the buckets.
+  if (!gnu_hash_bloom_test(gnu_hash_bloom_filter(gnu_hash),
+                           gnu_hash->maskwords, gnu_hash->shift2, h)) {
+    return NULL;
+  }
+  int n = gnu_hash_buckets(gnu_hash)[h % gnu_hash->nbuckets];
+  // fprintf(stderr, "lookup n=%d mask=%x\n", n, gnu_hash->maskwords);
+  if (n == 0) return NULL;
+  const uint32_t* hv = &gnu_hash_hashvals(gnu_hash)[n - gnu_hash->symndx];
+  for (Elf_Sym* sym = &obj->symtab[n];; ++sym) {
+    uint32_t h2 = *hv++;
+    if ((h & ~1) == (h2 & ~1) &&
+        !strcmp(symbol, obj->strtab + sym->st_name) &&
+        is_defined(sym)) {
+      return obj->base + sym->st_value;
+    }
+    if (h2 & 1) break;
+  }
+  return NULL;
+}
+
+// Lookup for callers which already have gnu_hash_calc(symbol).
+static void* objsym_dyn_hashed(obj_handle* obj, const char* symbol,
+                               uint32_t gnu_h) {
+  assert(obj->symtab);
+  if (obj->gnu_hash) {
+    return objsym_dyn_gnu_hash(obj, symbol, gnu_h);
+  } else {
+    return objsym_dyn_elf_hash(obj, symbol);
+  }
+}
+
+static void* objsym_dyn(obj_handle* obj, const char* symbol) {
+  return objsym_dyn_hashed(obj, symbol, gnu_hash_calc(symbol));
+}
+
+#if DYN_SUPPORTED
+
+static void undefined() {
+  LOGF(OBJFCN_LOG_ERROR, "undefined function called\n");
+  abort();
+}
+
+#endif
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
+typedef struct TlsDesc {
+  ptrdiff_t (*entry)(struct TlsDesc*);
+  void* arg;
+} TlsDesc;
+
+#endif
+
+static void* lookup_dyn_sym(obj_handle* obj, int sym_idx) {
+  Elf_Sym* sym = obj->symtab + sym_idx;
+  const char* sname = obj->strtab + sym->st_name;
+  if (!strcmp(sname, "__tls_get_addr")) {
+    // The dtv of the host does not know about our modules.
+    return (void*)&objfcn_tls_get_addr;
+  }
+#if defined(__i386__)
+  if (!strcmp(sname, "___tls_get_addr")) {
+    return (void*)&objfcn_tls_get_addr_eax;
+  }
+#endif
+  uint32_t h = gnu_hash_calc(sname);
+  void* val = objsym_dyn_hashed(obj, sname, h);
+  if (!val) {
+    const char* verstr = 0;
+    if (obj->versym && obj->verneed) {
+      int ver = obj->versym[sym_idx];
+      verstr = obj->verstrs[ver];
+    }
+    val = resolve_external(obj, sname, verstr, h);
+  }
+  return val;
+}
+
+#if OBJFCN_LAZY_SUPPORTED
+
+// Lazy binding. PLT0 pushes GOT[1], which we set to the handle, and
+// jumps to GOT[2], one of the trampolines below. They save everything a
+// call may pass arguments in, bind the slot and jump to the target.
+// xsave covers the vector registers in full; fxsave is for CPUs or
+// kernels without it.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void objfcn_lazy_xsave(void);
+void objfcn_lazy_fxsave(void);
+__attribute__((visibility("hidden"))) size_t objfcn_xsave_size;
+__attribute__((visibility("hidden"))) void* objfcn_lazy_bind(obj_handle* obj,
+                                                             size_t index);
+#ifdef __cplusplus
+}
+#endif
+
+#define LAZY_SAVE_GPRS \
+  "endbr64\n" \
+  "push %rbx\n" \
+  "mov %rsp, %rbx\n" \
+  "push %rax\n" \
+  "push %rcx\n" \
+  "push %rdx\n" \
+  "push %rsi\n" \
+  "push %rdi\n" \
+  "push %r8\n" \
+  "push %r9\n" \
+  "push %r10\n"
+
+// %rbx points to the saved %rbx, above which are the handle, the
+// relocation index and the return address of the caller.
+#define LAZY_BIND_AND_JUMP(restore) \
+  "mov 8(%rbx), %rdi\n" \
+  "mov 16(%rbx), %rsi\n" \
+  "call objfcn_lazy_bind\n" \
+  "mov %rax, %r11\n" \
+  restore \
+  "lea -64(%rbx), %rsp\n" \
+  "pop %r10\n" \
+  "pop %r9\n" \
+  "pop %r8\n" \
+  "pop %rdi\n" \
+  "pop %rsi\n" \
+  "pop %rdx\n" \
+  "pop %rcx\n" \
+  "pop %rax\n" \
+  "pop %rbx\n" \
+  "add $16, %rsp\n" \
+  "jmp *%r11\n"
+
+__asm__(
+    ".pushsection .text\n"
+    ".p2align 4\n"
+    ".type objfcn_lazy_xsave, @function\n"
+    "objfcn_lazy_xsave:\n"
+    LAZY_SAVE_GPRS
+    "sub objfcn_xsave_size(%rip), %rsp\n"
+    "and $-64, %rsp\n"
+    // The xsave header must be zero for xrstor.
+    "xor %eax, %eax\n"
+    "mov %rax, 512(%rsp)\n"
+    "mov %rax, 520(%rsp)\n"
+    "mov %rax, 528(%rsp)\n"
+    "mov %rax, 536(%rsp)\n"
+    "mov %rax, 544(%rsp)\n"
+    "mov %rax, 552(%rsp)\n"
+    "mov %rax, 560(%rsp)\n"
+    "mov %rax, 568(%rsp)\n"
+    "mov $-1, %eax\n"
+    "mov $-1, %edx\n"
+    "xsave (%rsp)\n"
+    LAZY_BIND_AND_JUMP(
+        "mov $-1, %eax\n"
+        "mov $-1, %edx\n"
+        "xrstor (%rsp)\n")
+    ".size objfcn_lazy_xsave, .-objfcn_lazy_xsave\n"
+
+    ".p2align 4\n"
+    ".type objfcn_lazy_fxsave, @function\n"
+    "objfcn_lazy_fxsave:\n"
+    LAZY_SAVE_GPRS
+    "sub $512, %rsp\n"
+    "and $-16, %rsp\n"
+    "fxsave (%rsp)\n"
+    LAZY_BIND_AND_JUMP("fxrstor (%rsp)\n")
+    ".size objfcn_lazy_fxsave, .-objfcn_lazy_fxsave\n"
+    ".popsection\n");
+
+static void (*lazy_trampoline)(void);
+
+static void init_lazy(void) {
+  unsigned int eax, ebx, ecx, edx;
+  lazy_trampoline = objfcn_lazy_fxsave;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_OSXSAVE) &&
+      __get_cpuid_count(0xd, 0, &eax, &ebx, &ecx, &edx)) {
+    // The size of the area for all features enabled in XCR0.
+    objfcn_xsave_size = ebx;
+    lazy_trampoline = objfcn_lazy_xsave;
+  }
+}
+
+// Binds a PLT slot on its first call. Threads racing on the same slot
+// look up the same address, so whichever store lands last is fine.
+void* objfcn_lazy_bind(obj_handle* obj, size_t index) {
+  Elf_Rel* rel = obj->jmprel + index;
+  int sym_idx = ELFW_R_SYM(rel->r_info);
+  void* val = lookup_dyn_sym(obj, sym_idx);
+  LOGF(OBJFCN_LOG_DEBUG, "lazy bind %s => %p\n",
+       obj->strtab + obj->symtab[sym_idx].st_name, val);
+  if (!val) {
+    val = (void*)&undefined;
+  }
+  __atomic_store_n((void**)(obj->base + rel->r_offset), val,
+                   __ATOMIC_RELEASE);
+  return val;
+}
+
+#endif
+
+// Looks up the symbols |rel| refers to, once per symbol. JUMP_SLOTs are
+// left to objfcn_lazy_bind if |lazy|.
+static void resolve_dyn_syms(obj_handle* obj, Elf_Rel* rel, size_t num,
+                             int lazy, void** vals, uint8_t* resolved) {
+  for (size_t i = 0; i < num; rel++, i++) {
+    int sym_idx = ELFW_R_SYM(rel->r_info);
+    if (obj->stats) {
+      stat_reloc_n(obj->stats, ELFW_R_TYPE(rel->r_info), 1);
+    }
+    // Relocations without a symbol (R_RELATIVE) need no lookup.
+    if (!sym_idx || resolved[sym_idx]) continue;
+#if OBJFCN_LAZY_SUPPORTED
+    if (lazy && ELFW_R_TYPE(rel->r_info) == R_JUMP_SLOT) continue;
+#endif
+    vals[sym_idx] = lookup_dyn_sym(obj, sym_idx);
+    resolved[sym_idx] = 1;
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+// TLS relocations are only resolved against the object's own block.
+static void check_own_tls(obj_handle* obj, Elf_Sym* sym) {
+  if (!obj->tls_module ||
+      (sym != obj->symtab && sym->st_shndx == SHN_UNDEF)) {
+    LOGF(OBJFCN_LOG_ERROR, "Unsupported TLS reference to %s\n",
+         obj->strtab + sym->st_name);
+    abort();
+  }
+}
+#endif
+
+static void apply_dyn_relocs(const char* reloc_type, obj_handle* obj,
+                             Elf_Rel* rel, size_t num, int lazy,
+                             void** vals) {
+  size_t i;
+  for (i = 0; i < num; rel++, i++) {
+    LOGF(OBJFCN_LOG_DEBUG, "rel offset=%x\n", (int)rel->r_offset);
+    void** addr = (void**)(obj->base + rel->r_offset);
+    int type = ELFW_R_TYPE(rel->r_info);
+    int sym_idx = ELFW_R_SYM(rel->r_info);
+    Elf_Sym* sym = obj->symtab + sym_idx;
+    const char* sname = obj->strtab + sym->st_name;
+    void* val = vals[sym_idx];
+
+    LOGF(OBJFCN_LOG_DEBUG, "%s: %p %s(%p) %d => %p\n",
+         reloc_type, (void*)addr, sname, sym, type, val);
+
+    switch (type) {
+#if DYN_SUPPORTED
+    case R_JUMP_SLOT:
+#if OBJFCN_LAZY_SUPPORTED
+      if (lazy) {
+        // The slot points back into its PLT entry, which calls
+        // objfcn_lazy_bind through PLT0.
+        *addr = (void*)(*(char**)addr + (intptr_t)obj->base);
+        break;
+      }
+#endif
+      // fall through
+    case R_GLOB_DAT: {
+      if (val) {
+        *addr = val;
+      } else if (type == R_GLOB_DAT &&
+                 ELFW_ST_BIND(sym->st_info) == STB_WEAK) {
+        // Tested for NULL, as _init does with __gmon_start__.
+        *addr = NULL;
+      } else {
+        *addr = (void*)&undefined;
+      }
+      break;
+    }
+
+    case R_RELATIVE: {
+#if __SIZEOF_POINTER__ == 8
+      // The linker need not leave the addend in place as well.
+      *addr = (void*)(obj->base + rel->r_addend);
+#else
+      *addr = (void*)(*(char**)addr + (intptr_t)obj->base);
+#endif
+      break;
+    }
+
+#ifdef R_64
+    case R_64: {
+      *addr = (void*)((char*)val + rel->r_addend);
+      break;
+    }
+#endif
+
+#ifdef R_32
+    // Addends of Elf32_Rel are in place.
+    case R_32: {
+      *addr = (void*)(*(char**)addr + (intptr_t)val);
+      break;
+    }
+
+    case R_PC32: {
+      *addr = (void*)(*(char**)addr + ((char*)val - (char*)addr));
+      break;
+    }
+#endif
+#endif
+
+#if defined(__i386__)
+    case R_386_TLS_DTPMOD32: {
+      check_own_tls(obj, sym);
+      *addr = (void*)(uintptr_t)obj->tls_module;
+      break;
+    }
+
+    case R_386_TLS_DTPOFF32: {
+      check_own_tls(obj, sym);
+      *addr = (void*)(*(char**)addr + sym->st_value);
+      break;
+    }
+#endif
+
+#if defined(__x86_64__)
+    case R_X86_64_DTPMOD64: {
+      check_own_tls(obj, sym);
+      *addr = (void*)(uintptr_t)obj->tls_module;
+      break;
+    }
+
+    case R_X86_64_DTPOFF64: {
+      check_own_tls(obj, sym);
+      *addr = (void*)(sym->st_value + rel->r_addend);
+      break;
+    }
+
+    case R_X86_64_TLSDESC: {
+      check_own_tls(obj, sym);
+      TlsDesc* desc = (TlsDesc*)addr;
+      desc->entry = (ptrdiff_t (*)(TlsDesc*))&objfcn_tlsdesc_dynamic;
+      desc->arg = (void*)(((uintptr_t)obj->tls_module << TLSDESC_MODULE_SHIFT) |
+                          (sym->st_value + rel->r_addend));
+      break;
+    }
+#endif
+
+#if defined(__aarch64__)
+    case R_AARCH64_TLSDESC: {
+      check_own_tls(obj, sym);
+      TlsDesc* desc = (TlsDesc*)addr;
+      desc->entry = (ptrdiff_t (*)(TlsDesc*))&objfcn_tlsdesc_dynamic;
+      desc->arg = (void*)(((uintptr_t)obj->tls_module << TLSDESC_MODULE_SHIFT) |
+                          (sym->st_value + rel->r_addend));
+      break;
+    }
+#endif
+
+    default:
+      LOGF(OBJFCN_LOG_ERROR, "Unsupported reloc: %d\n", type);
+      abort();
+      break;
+
+    }
+
+  }
+}
+
+typedef struct {
+  const char* reloc_type;
+  obj_handle* obj;
+  Elf_Rel* rel;
+  size_t num;
+  int lazy;
+  void** vals;
+} dyn_reloc_ctx;
+
+static int apply_dyn_chunk(void* arg, size_t i) {
+  dyn_reloc_ctx* ctx = (dyn_reloc_ctx*)arg;
+  size_t begin = i * OBJFCN_RELOC_CHUNK;
+  size_t n = ctx->num - begin;
+  if (n > OBJFCN_RELOC_CHUNK) n = OBJFCN_RELOC_CHUNK;
+  apply_dyn_relocs(ctx->reloc_type, ctx->obj, ctx->rel + begin, n,
+                   ctx->lazy, ctx->vals);
+  return 1;
+}
+
+// Relocates DT_REL(A) and the PLT relocations. Symbols are resolved
+// serially first, so the relocations can then be applied in parallel.
+// With |lazy|, JUMP_SLOTs are bound on their first call instead.
+static int relocate_dyn(obj_handle* obj, Elf_Rel* rel, int relsz,
+                        Elf_Rel* jmprel, int pltrelsz, int lazy) {
+  size_t num = relsz / sizeof(*rel);
+  size_t pltnum = pltrelsz / sizeof(*rel);
+  size_t num_syms = 1;
+  for (size_t i = 0; i < num + pltnum; i++) {
+    Elf_Rel* r = i < num ? &rel[i] : &jmprel[i - num];
+    size_t sym_idx = ELFW_R_SYM(r->r_info);
+    if (num_syms <= sym_idx) num_syms = sym_idx + 1;
+  }
+
+  void** vals = (void**)calloc(num_syms, sizeof(void*));
+  uint8_t* resolved = (uint8_t*)calloc(num_syms, 1);
+  int ok = 0;
+  if (!vals || !resolved) {
+    sprintf(obj_error, "malloc failed");
+  } else {
+    dyn_reloc_ctx ctx[2] = {
+      {"rel", obj, rel, num, 0, vals},
+      {"pltrel", obj, jmprel, pltnum, lazy, vals},
+    };
+    for (int i = 0; i < 2; i++) {
+      resolve_dyn_syms(obj, ctx[i].rel, ctx[i].num, ctx[i].lazy, vals,
+                       resolved);
+    }
+    ok = 1;
+    for (int i = 0; i < 2 && ok; i++) {
+      size_t chunks = (ctx[i].num + OBJFCN_RELOC_CHUNK - 1) /
+                      OBJFCN_RELOC_CHUNK;
+      ok = run_parallel(apply_dyn_chunk, &ctx[i], chunks, reloc_threads);
+    }
+  }
+  free(vals);
+  free(resolved);
+  return ok;
+}
+
+static void parse_version(obj_handle* obj, int verneed_num) {
+  int num_verstrs = 2;
+  obj->verstrs = (const char**)calloc(num_verstrs, sizeof(char*));
+
+  Elf_Verneed* vn = obj->verneed;
+  for (int i = 0; i < verneed_num; ++i) {
+    LOGF(OBJFCN_LOG_DEBUG,
+         "VERNEED: ver=%d cnt=%d file=%s aux=%d next=%d\n",
+         vn->vn_version, vn->vn_cnt, obj->strtab + vn->vn_file,
+         vn->vn_aux, vn->vn_next);
+    Elf_Vernaux* vna = (Elf_Vernaux*)((char*)vn + vn->vn_aux);
+    for (int j = 0; j < vn->vn_cnt; ++j) {
+      LOGF(OBJFCN_LOG_DEBUG,
+           " VERNAUX: hash=%d flags=%d other=%d name=%s next=%d\n",
+           vna->vna_hash, vna->vna_flags, vna->vna_other,
+           obj->strtab + vna->vna_name, vna->vna_next);
+
+      int ver = vna->vna_other;
+      if (num_verstrs <= ver) {
+        num_verstrs = ver + 1;
+        obj->verstrs = (const char**)realloc(obj->verstrs,
+                                             sizeof(char*) * num_verstrs);
+      }
+      obj->verstrs[ver] = obj->strtab + vna->vna_name;
+
+      vna = (Elf_Vernaux*)((char*)vna + vna->vna_next);
+    }
+    vn = (Elf_Verneed*)((char*)vn + vn->vn_next);
+  }
+}
+
+static int segment_prot(Elf_Phdr* phdr) {
+  return ((phdr->p_flags & PF_R ? PROT_READ : 0) |
+          (phdr->p_flags & PF_W ? PROT_WRITE : 0) |
+          (phdr->p_flags & PF_X ? PROT_EXEC : 0));
+}
+
+// Maps a PT_LOAD segment from the file at |base| + p_vaddr so its pages
+// are backed by the page cache. Only the .bss part is anonymous memory.
+static int map_segment(obj_handle* obj, Elf_Phdr* phdr, int fd) {
+  size_t pagesz = page_size();
+  int prot = segment_prot(phdr);
+  if ((phdr->p_vaddr - phdr->p_offset) % pagesz) {
+    sprintf(obj_error, "misaligned PT_LOAD at %lx", (long)phdr->p_vaddr);
+    return 0;
+  }
+
+  char* start = (char*)align_down((uintptr_t)obj->base + phdr->p_vaddr,
+                                  pagesz);
+  char* file_end = obj->base + phdr->p_vaddr + phdr->p_filesz;
+  char* mem_end = obj->base + phdr->p_vaddr + phdr->p_memsz;
+  char* zero_end = (char*)align_up((uintptr_t)file_end, pagesz);
+  if (phdr->p_filesz) {
+    // The partial page after p_filesz is cleared below, so make it
+    // writable for now.
+    int file_prot = prot;
+    if (mem_end > file_end) file_prot |= PROT_WRITE;
+    void* p = mmap(start, zero_end - start, file_prot,
+                   MAP_PRIVATE | MAP_FIXED, fd,
+                   align_down(phdr->p_offset, pagesz));
+    if (p == MAP_FAILED) {
+      sprintf(obj_error, "mmap failed: %s", strerror(errno));
+      return 0;
+    }
+  } else {
+    zero_end = start;
+  }
+
+  if (mem_end > file_end) {
+    if (zero_end > file_end) {
+      memset(file_end, 0, (mem_end < zero_end ? mem_end : zero_end) - file_end);
+      mprotect(start, zero_end - start, prot);
+    }
+    char* bss_end = (char*)align_up((uintptr_t)mem_end, pagesz);
+    if (bss_end > zero_end) {
+      void* p = mmap(zero_end, bss_end - zero_end, prot,
+                     MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        sprintf(obj_error, "mmap failed: %s", strerror(errno));
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Makes every PT_LOAD segment writable for relocation, or gives it the
+// protection from its p_flags when |writable| is 0. Under OBJFCN_WX
+// writable segments are never executable at the same time.
+static void protect_segments(obj_handle* obj, Elf_Phdr* phdrs, int phnum,
+                             int writable) {
+  size_t pagesz = page_size();
+  for (int i = 0; i < phnum; i++) {
+    Elf_Phdr* phdr = &phdrs[i];
+    if (phdr->p_type != PT_LOAD) continue;
+    char* start = (char*)align_down((uintptr_t)obj->base + phdr->p_vaddr,
+                                    pagesz);
+    char* end = (char*)align_up((uintptr_t)obj->base + phdr->p_vaddr +
+                                phdr->p_memsz, pagesz);
+    int prot = segment_prot(phdr);
+    if (writable) {
+      prot |= PROT_WRITE;
+      if (obj->flags & OBJFCN_WX) prot &= ~PROT_EXEC;
+    }
+    mprotect(start, end - start, prot);
+  }
+}
+
+// Makes PT_GNU_RELRO (which covers .got and .data.rel.ro) read-only
+// once relocation is done. Like ld.so, partial pages stay writable.
+static void protect_relro(obj_handle* obj, Elf_Phdr* phdrs, int phnum) {
+  size_t pagesz = page_size();
+  for (int i = 0; i < phnum; i++) {
+    Elf_Phdr* phdr = &phdrs[i];
+    if (phdr->p_type != PT_GNU_RELRO) continue;
+    char* start = (char*)align_down((uintptr_t)obj->base + phdr->p_vaddr,
+                                    pagesz);
+    char* end = (char*)align_down((uintptr_t)obj->base + phdr->p_vaddr +
+                                  phdr->p_memsz, pagesz);
+    if (end > start) {
+      mprotect(start, end - start, PROT_READ);
+    }
+  }
+}
+
+// DT_NEEDED of shared objects loaded with OBJFCN_LOAD_NEEDED. Libraries
+// the host already has, like libc, stay with the dynamic linker. Others
+// are searched in lib_path and then the object's DT_RUNPATH or
+// DT_RPATH, loaded with objopen and shared through needed_libs, keyed
+// by their real path. Misses fall back to dlopen.
+typedef struct needed_lib {
+  char* path;
+  obj_handle* obj;  // NULL while it is being loaded
+  int refs;
+  struct needed_lib* next;
+} needed_lib;
+
+static char* lib_path;
+static needed_lib* needed_libs;
+// Recursive, as loading a library loads its own DT_NEEDED.
+static pthread_mutex_t needed_lock;
+
+void objlib_set_path(const char* path) {
+  free(lib_path);
+  lib_path = path ? strdup(path) : NULL;
+}
+
+static void init_needed(void) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&needed_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+// Looks for |name| in the colon separated |dirs|, with $ORIGIN replaced
+// by |origin|. Returns a malloc'ed real path or NULL.
+static char* search_lib(const char* name, const char* dirs,
+                        const char* origin) {
+  char dir[PATH_MAX];
+  char path[PATH_MAX];
+  while (dirs && *dirs) {
+    size_t len = strcspn(dirs, ":");
+    if (len >= 7 && !strncmp(dirs, "$ORIGIN", 7)) {
+      snprintf(dir, sizeof(dir), "%s%.*s", origin, (int)(len - 7),
+               dirs + 7);
+    } else {
+      snprintf(dir, sizeof(dir), "%.*s", (int)len, dirs);
+    }
+    int n = snprintf(path, sizeof(path), "%s/%s", len ? dir : ".", name);
+    if (n < (int)sizeof(path) && access(path, R_OK) == 0) {
+      return realpath(path, NULL);
+    }
+    dirs += len;
+    if (*dirs == ':') dirs++;
+  }
+  return NULL;
+}
+
+static void release_needed(needed_lib* lib) {
+  pthread_mutex_lock(&needed_lock);
+  if (--lib->refs == 0) {
+    needed_lib** p = &needed_libs;
+    while (*p != lib) p = &(*p)->next;
+    *p = lib->next;
+    objclose(lib->obj);
+    free(lib->path);
+    free(lib);
+  }
+  pthread_mutex_unlock(&needed_lock);
+}
+
+// Loads the library at |path| or takes another reference to it.
+// Returns NULL with obj_error set on failure, or for a dependency cycle
+// with obj_error empty.
+static needed_lib* acquire_needed(char* path, int flags) {
+  pthread_mutex_lock(&needed_lock);
+  needed_lib* lib = needed_libs;
+  for (; lib; lib = lib->next) {
+    if (!strcmp(lib->path, path)) break;
+  }
+  if (lib) {
+    free(path);
+    if (!lib->obj) {
+      obj_error[0] = 0;
+      lib = NULL;
+    } else {
+      lib->refs++;
+    }
+    pthread_mutex_unlock(&needed_lock);
+    return lib;
+  }
+
+  lib = (needed_lib*)calloc(1, sizeof(needed_lib));
+  if (!lib) {
+    pthread_mutex_unlock(&needed_lock);
+    free(path);
+    sprintf(obj_error, "malloc failed");
+    return NULL;
+  }
+  lib->path = path;
+  lib->next = needed_libs;
+  needed_libs = lib;
+  lib->obj = (obj_handle*)objopen(path, flags);
+  if (!lib->obj || !lib->obj->is_dyn) {
+    if (lib->obj) {
+      objclose(lib->obj);
+      snprintf(obj_error, sizeof(obj_error), "%s is not a shared object",
+               path);
+    }
+    needed_libs = lib->next;
+    free(lib->path);
+    free(lib);
+    lib = NULL;
+  } else {
+    lib->refs = 1;
+  }
+  pthread_mutex_unlock(&needed_lock);
+  return lib;
+}
+
+static void* dlopen_needed(const char* name) {
+  void* handle = dlopen(name, RTLD_LAZY | RTLD_GLOBAL | RTLD_NOLOAD);
+  if (handle == NULL) {
+    handle = dlopen(name, RTLD_LAZY | RTLD_GLOBAL);
+    if (handle) {
+      // The new library may interpose symbols we cached.
+      pthread_mutex_lock(&shared_sym_cache_lock);
+      sym_cache_clear(&shared_sym_cache);
+      pthread_mutex_unlock(&shared_sym_cache_lock);
+    }
+  }
+  LOGF(OBJFCN_LOG_INFO, "DT_NEEDED %s %p\n", name, handle);
+  return handle;
+}
+
+static int add_dep(obj_handle* obj, obj_handle* dep) {
+  for (int i = 0; i < obj->num_deps; i++) {
+    if (obj->deps[i] == dep) return 1;
+  }
+  obj_handle** deps = (obj_handle**)realloc(
+      obj->deps, sizeof(obj_handle*) * (obj->num_deps + 1));
+  if (!deps) return 0;
+  obj->deps = deps;
+  obj->deps[obj->num_deps++] = dep;
+  return 1;
+}
+
+// Handles DT_NEEDED of |dyns|. With OBJFCN_LOAD_NEEDED, obj->deps gets
+// the libraries loaded here in breadth-first order, which is the order
+// resolve_external searches them in.
+static int load_needed(obj_handle* obj, Elf_Dyn* dyns) {
+  const char* runpath = NULL;
+  const char* rpath = NULL;
+  int num_needed = 0;
+  for (Elf_Dyn* dyn = dyns; dyn->d_tag; dyn++) {
+    if (dyn->d_tag == DT_RUNPATH) runpath = obj->strtab + dyn->d_un.d_val;
+    if (dyn->d_tag == DT_RPATH) rpath = obj->strtab + dyn->d_un.d_val;
+    if (dyn->d_tag == DT_NEEDED) num_needed++;
+  }
+  int own = (obj->flags & OBJFCN_LOAD_NEEDED) && num_needed;
+  if (own) {
+    obj->needed = (needed_lib**)calloc(num_needed, sizeof(needed_lib*));
+    if (!obj->needed) {
+      sprintf(obj_error, "malloc failed");
+      return 0;
+    }
+  }
+
+  char origin[PATH_MAX];
+  snprintf(origin, sizeof(origin), "%s", obj->filename);
+  char* slash = strrchr(origin, '/');
+  if (slash) {
+    *slash = 0;
+  } else {
+    strcpy(origin, ".");
+  }
+
+  for (Elf_Dyn* dyn = dyns; dyn->d_tag; dyn++) {
+    if (dyn->d_tag != DT_NEEDED) continue;
+    const char* name = obj->strtab + dyn->d_un.d_val;
+    char* path = NULL;
+    if (own && !dlopen(name, RTLD_LAZY | RTLD_NOLOAD)) {
+      if (strchr(name, '/')) {
+        path = realpath(name, NULL);
+      } else {
+        path = search_lib(name, lib_path, origin);
+        if (!path) {
+          path = search_lib(name, runpath ? runpath : rpath, origin);
+        }
+      }
+    }
+    if (!path) {
+      dlopen_needed(name);
+      continue;
+    }
+
+    LOGF(OBJFCN_LOG_INFO, "DT_NEEDED %s from %s\n", name, path);
+    needed_lib* lib = acquire_needed(path, obj->flags & ~OBJFCN_RELOADABLE);
+    if (!lib) {
+      if (!obj_error[0]) continue;  // a cycle; it is loaded already
+      char error[sizeof(obj_error)];
+      memcpy(error, obj_error, sizeof(error));
+      snprintf(obj_error, sizeof(obj_error), "%.64s: %.180s", name, error);
+      return 0;
+    }
+    obj->needed[obj->num_needed++] = lib;
+    if (!add_dep(obj, lib->obj)) {
+      sprintf(obj_error, "malloc failed");
+      return 0;
+    }
+  }
+
+  // Then what the dependencies search, in their order.
+  for (int i = 0; i < obj->num_needed; i++) {
+    obj_handle* dep = obj->needed[i]->obj;
+    for (int j = 0; j < dep->num_deps; j++) {
+      if (!add_dep(obj, dep->deps[j])) {
+        sprintf(obj_error, "malloc failed");
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// Appends the |n| functions at |entries| to |*funcs|. 0 and -1 are
+// placeholders, as in .ctors.
+static int add_funcs(void*** funcs, int* num, void** entries, size_t n) {
+  void** grown = (void**)realloc(*funcs, sizeof(void*) * (*num + n + 1));
+  if (!grown) {
+    sprintf(obj_error, "malloc failed");
+    return 0;
+  }
+  *funcs = grown;
+  for (size_t i = 0; i < n; i++) {
+    if (entries[i] && entries[i] != (void*)-1) {
+      grown[(*num)++] = entries[i];
+    }
+  }
+  return 1;
+}
+
+static int load_object_dyn(obj_handle* obj, obj_input* in,
+                           const char* filename) {
+  const char* bin = in->bin;
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)bin;
+  Elf_Phdr* phdrs = (Elf_Phdr*)(bin + ehdr->e_phoff);
+
+  size_t max_addr = 0;
+  size_t base_align = page_size();
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    Elf_Phdr* phdr = &phdrs[i];
+    if (phdr->p_type != PT_LOAD) continue;
+    size_t end_addr = align_up(phdr->p_vaddr + phdr->p_memsz, page_size());
+    if (max_addr < end_addr) {
+      max_addr = end_addr;
+    }
+    if (base_align < phdr->p_align) {
+      base_align = phdr->p_align;
+    }
+  }
+  if (obj->flags & OBJFCN_HUGE_TEXT) {
+    base_align = OBJFCN_HUGE_PAGE_SIZE;
+  }
+
+  char* code = alloc_region(max_addr, base_align,
+                            obj->flags & OBJFCN_WX ? PROT_READ | PROT_WRITE :
+                            PROT_READ | PROT_WRITE | PROT_EXEC);
+  if (code == NULL) {
+    return 0;
+  }
+
+  obj->code = code;
+  obj->base = code;
+  obj->code_size = max_addr;
+  obj->is_dyn = 1;
+
+  int textrel = 0;
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    Elf_Phdr* phdr = &phdrs[i];
+    if (phdr->p_type != PT_LOAD) continue;
+    if (in->fd >= 0) {
+      obj->segments_mapped = 1;
+      if (!map_segment(obj, phdr, in->fd)) {
+        return 0;
+      }
+    } else {
+      memcpy(code + phdr->p_vaddr, bin + phdr->p_offset, phdr->p_filesz);
+    }
+#ifdef MADV_HUGEPAGE
+    if ((obj->flags & OBJFCN_HUGE_TEXT) && (phdr->p_flags & PF_X)) {
+      char* start = (char*)align_down((uintptr_t)code + phdr->p_vaddr,
+                                      page_size());
+      char* end = (char*)align_up((uintptr_t)code + phdr->p_vaddr +
+                                  phdr->p_memsz, page_size());
+      madvise(start, end - start, MADV_HUGEPAGE);
+    }
+#endif
+  }
+
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    Elf_Phdr* phdr = &phdrs[i];
+    if (phdr->p_type != PT_TLS) continue;
+    if (!tls_register(obj, bin + phdr->p_offset, phdr->p_filesz,
+                      phdr->p_memsz, phdr->p_align)) {
+      return 0;
+    }
+  }
+
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    Elf_Phdr* phdr = &phdrs[i];
+    if (phdr->p_type != PT_DYNAMIC) continue;
+
+    Elf_Dyn* dyns = (Elf_Dyn*)(code + phdr->p_vaddr);
+    for (Elf_Dyn* dyn = dyns; dyn->d_tag; dyn++) {
+      if (dyn->d_tag == DT_STRTAB) {
+        obj->strtab = code + dyn->d_un.d_ptr;
+      }
+    }
+    if (!load_needed(obj, dyns)) return 0;
+
+    Elf_Rel* rel = NULL;
+    Elf_Rel* jmprel = NULL;
+    int relsz = 0, pltrelsz = 0;
+    // Only lazy binding needs these.
+    void** pltgot __attribute__((unused)) = NULL;
+    int bind_now __attribute__((unused)) = 0;
+    void* init = NULL;
+    void* fini = NULL;
+    void** init_array = NULL;
+    void** fini_array = NULL;
+    int init_arraysz = 0, fini_arraysz = 0;
+    int verneed_num = 0;
+    for (Elf_Dyn* dyn = dyns; dyn->d_tag; dyn++) {
+      switch (dyn->d_tag) {
+      case DT_SYMTAB:
+        obj->symtab = (Elf_Sym*)(code + dyn->d_un.d_ptr);
+        break;
+
+      case DT_HASH:
+        obj->elf_hash = (Elf_Hash*)(code + dyn->d_un.d_ptr);
+        break;
+
+      case DT_GNU_HASH:
+        obj->gnu_hash = (Elf_GnuHash*)(code + dyn->d_un.d_ptr);
+        break;
+
+      case DT_PLTREL: {
+        int pltrel = dyn->d_un.d_val;
+        assert(pltrel == DT_RELOC);
+        break;
+      }
+
+      case DT_RELOC: {
+        rel = (Elf_Rel*)(code + dyn->d_un.d_ptr);
+        LOGF(OBJFCN_LOG_DEBUG, "rel: %p\n", rel);
+        break;
+      }
+      case DT_RELOCSZ: {
+        relsz = dyn->d_un.d_val;
+        LOGF(OBJFCN_LOG_DEBUG, "relsz: %d\n", relsz);
+        break;
+      }
+      case DT_PLTRELSZ: {
+        pltrelsz = dyn->d_un.d_val;
+        LOGF(OBJFCN_LOG_DEBUG, "pltrelsz: %d\n", pltrelsz);
+        break;
+      }
+      case DT_JMPREL: {
+        jmprel = (Elf_Rel*)(code + dyn->d_un.d_ptr);
+        break;
+      }
+      case DT_PLTGOT: {
+        pltgot = (void**)(code + dyn->d_un.d_ptr);
+        break;
+      }
+
+      case DT_BIND_NOW:
+        bind_now = 1;
+        break;
+
+      case DT_FLAGS_1:
+        if (dyn->d_un.d_val & DF_1_NOW) {
+          bind_now = 1;
+        }
+        break;
+
+      case DT_INIT_ARRAY: {
+        init_array = (void**)(code + dyn->d_un.d_ptr);
+        break;
+      }
+      case DT_INIT_ARRAYSZ: {
+        init_arraysz = dyn->d_un.d_val;
+        break;
+      }
+      case DT_FINI_ARRAY: {
+        fini_array = (void**)(code + dyn->d_un.d_ptr);
+        break;
+      }
+      case DT_FINI_ARRAYSZ: {
+        fini_arraysz = dyn->d_un.d_val;
+        break;
+      }
+      case DT_INIT:
+        init = code + dyn->d_un.d_ptr;
+        break;
+      case DT_FINI:
+        fini = code + dyn->d_un.d_ptr;
+        break;
+
+      case DT_VERSYM: {
+        obj->versym = (Elf_Versym*)(code + dyn->d_un.d_ptr);
+        break;
+      }
+
+      case DT_VERNEED: {
+        obj->verneed = (Elf_Verneed*)(code + dyn->d_un.d_ptr);
+        break;
+      }
+
+      case DT_VERNEEDNUM: {
+        verneed_num = dyn->d_un.d_val;
+        break;
+      }
+
+      case DT_TEXTREL:
+        textrel = 1;
+        break;
+
+      case DT_FLAGS:
+        if (dyn->d_un.d_val & DF_TEXTREL) {
+          textrel = 1;
+        }
+        if (dyn->d_un.d_val & DF_BIND_NOW) {
+          bind_now = 1;
+        }
+        break;
+
+      }
+    }
+
+    parse_version(obj, verneed_num);
+
+    assert(rel);
+    if (obj->segments_mapped && textrel) {
+      protect_segments(obj, phdrs, ehdr->e_phnum, 1);
+    }
+    if (!jmprel) {
+      jmprel = rel + relsz / sizeof(*rel);
+    }
+    // Objects linked with -z now may keep the GOT in PT_GNU_RELRO.
+    int lazy = 0;
+#if OBJFCN_LAZY_SUPPORTED
+    lazy = (obj->flags & OBJFCN_LAZY) && pltgot && !bind_now;
+    obj->jmprel = jmprel;
+#endif
+    uint64_t start = obj->stats ? stat_now() : 0;
+    int relocated = relocate_dyn(obj, rel, relsz, jmprel, pltrelsz, lazy);
+    if (obj->stats) obj->stats->relocate_ns += stat_now() - start;
+    if (!relocated) {
+      return 0;
+    }
+#if OBJFCN_LAZY_SUPPORTED
+    if (lazy) {
+      pltgot[1] = obj;
+      pltgot[2] = (void*)lazy_trampoline;
+    }
+#endif
+
+#if defined(__arm__) || defined(__aarch64__)
+    // Only text we copied or relocated needs it; the kernel keeps fresh
+    // mappings coherent.
+    for (int j = 0; j < ehdr->e_phnum; j++) {
+      Elf_Phdr* p = &phdrs[j];
+      if (p->p_type == PT_LOAD && (p->p_flags & PF_X) &&
+          (!obj->segments_mapped || textrel)) {
+        __builtin___clear_cache(code + p->p_vaddr,
+                                code + p->p_vaddr + p->p_memsz);
+      }
+    }
+#endif
+
+    // Copied segments are still RW under OBJFCN_WX.
+    if ((obj->segments_mapped && textrel) || (obj->flags & OBJFCN_WX)) {
+      protect_segments(obj, phdrs, ehdr->e_phnum, 0);
+    }
+    if (obj->flags & OBJFCN_WX) {
+      protect_relro(obj, phdrs, ehdr->e_phnum);
+    }
+
+    // Run by run_init once the handle is complete.
+    if (!add_funcs(&obj->init_funcs, &obj->num_init, &init, init != NULL) ||
+        !add_funcs(&obj->init_funcs, &obj->num_init, init_array,
+                   init_arraysz / sizeof(void*)) ||
+        !add_funcs(&obj->fini_funcs, &obj->num_fini, &fini, fini != NULL) ||
+        !add_funcs(&obj->fini_funcs, &obj->num_fini, fini_array,
+                   fini_arraysz / sizeof(void*))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int section_class(Elf_Shdr* shdr) {
+  if (shdr->sh_flags & SHF_EXECINSTR) return SEG_TEXT;
+  if (shdr->sh_flags & SHF_WRITE) return SEG_DATA;
+  return SEG_RODATA;
+}
+
+// Plans the object's code region: text, rodata and data in that order.
+// Under OBJFCN_WX each starts on its own page so it can get its own
+// protection once relocation is done. With OBJFCN_HUGE_TEXT the text
+// run comes from the huge page zone instead. Returns the size of the
+// region.
+static size_t plan_segs(obj_handle* obj, const size_t* seg_size,
+                        const size_t* seg_align, size_t* offsets,
+                        size_t* region_align) {
+  int huge = (obj->flags & OBJFCN_HUGE_TEXT) && seg_size[SEG_TEXT];
+  size_t run_align = obj->flags & OBJFCN_WX ? page_size() : 16;
+  size_t size = 0;
+  *region_align = 16;
+  for (int c = huge ? SEG_TEXT + 1 : 0; c < NUM_SEGS; c++) {
+    size_t align = seg_align[c] > run_align ? seg_align[c] : run_align;
+    if (*region_align < align) *region_align = align;
+    offsets[c] = size = align_up(size, align);
+    size += seg_size[c];
+  }
+  return size;
+}
+
+// Points obj->segs into |code| as planned by plan_segs.
+static int place_segs(obj_handle* obj, char* code, size_t code_size,
+                      const size_t* seg_size, const size_t* seg_align,
+                      const size_t* offsets) {
+  int prot = (obj->flags & OBJFCN_WX ? PROT_READ | PROT_WRITE :
+              PROT_READ | PROT_WRITE | PROT_EXEC);
+  int huge = (obj->flags & OBJFCN_HUGE_TEXT) && seg_size[SEG_TEXT];
+  if (huge) {
+    if (seg_align[SEG_TEXT] > OBJFCN_HUGE_PAGE_SIZE) {
+      sprintf(obj_error, "text alignment %zu too large for huge pages",
+              seg_align[SEG_TEXT]);
+      return 0;
+    }
+    obj->segs[SEG_TEXT].start = alloc_huge_text(seg_size[SEG_TEXT],
+                                                seg_align[SEG_TEXT], prot,
+                                                !(obj->flags & OBJFCN_WX),
+                                                &obj->huge_text);
+    if (obj->segs[SEG_TEXT].start == NULL) {
+      return 0;
+    }
+    obj->segs[SEG_TEXT].size = seg_size[SEG_TEXT];
+  }
+
+  obj->code = code;
+  obj->code_size = code_size;
+  for (int c = huge ? SEG_TEXT + 1 : 0; c < NUM_SEGS; c++) {
+    obj->segs[c].start = obj->code + offsets[c];
+    obj->segs[c].size = seg_size[c];
+  }
+  return 1;
+}
+
+// Allocates the object's code region and places its segments.
+static int layout_segs(obj_handle* obj, size_t* seg_size, size_t* seg_align) {
+  int prot = (obj->flags & OBJFCN_WX ? PROT_READ | PROT_WRITE :
+              PROT_READ | PROT_WRITE | PROT_EXEC);
+  size_t offsets[NUM_SEGS];
+  size_t region_align;
+  size_t size = align_up(plan_segs(obj, seg_size, seg_align, offsets,
+                                   &region_align),
+                         page_size());
+  char* code = alloc_region(size, region_align, prot);
+  if (code == NULL) {
+    return 0;
+  }
+  if (!place_segs(obj, code, size, seg_size, seg_align, offsets)) {
+    free_region(code, size);
+    return 0;
+  }
+  obj->code_align = region_align;
+  return 1;
+}
+
+// Applies the final protection to the page runs made by layout_segs.
+static int protect_segs(obj_handle* obj) {
+  static const int prots[NUM_SEGS] = {
+    PROT_READ | PROT_EXEC,
+    PROT_READ,
+    PROT_READ | PROT_WRITE,
+  };
+  for (int c = 0; c < NUM_SEGS; c++) {
+    char* start = obj->segs[c].start;
+    size_t size = align_up(obj->segs[c].size, page_size());
+    if (c == SEG_TEXT && obj->huge_text) {
+      // The block is the object's own, and mprotect on part of a
+      // MAP_HUGETLB mapping fails.
+      start = obj->huge_text->start;
+      size = obj->huge_text->size;
+    }
+    if (size && mprotect(start, size, prots[c]) != 0) {
+      sprintf(obj_error, "mprotect failed: %s", strerror(errno));
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Symbols which live in a section we copied. Undefined, absolute and
+// common symbols have no entry in |addrs|.
+static int is_loaded_symbol(Elf_Sym* sym, Elf_Ehdr* ehdr) {
+  int type = ELFW_ST_TYPE(sym->st_info);
+  return ((type == STT_OBJECT || type == STT_FUNC) &&
+          sym->st_shndx != SHN_UNDEF && sym->st_shndx < ehdr->e_shnum);
+}
+
+static int is_exported(Elf_Sym* sym) {
+  int bind = ELFW_ST_BIND(sym->st_info);
+  return bind == STB_GLOBAL || bind == STB_WEAK;
+}
+
+// Orders the exported symbols in obj->symbols by bucket and builds the
+// bloom filter and chains over them. Locals stay behind them, out of
+// the lookup path.
+static int build_sym_index(obj_handle* obj, uint32_t* hashes) {
+  sym_index* index = &obj->index;
+  int n = obj->num_exported;
+  index->nbuckets = n / 2 + 1;
+  index->shift2 = BLOOM_BITS == 64 ? 6 : 5;
+  index->maskwords = 1;
+  // Roughly 8 bloom bits per symbol.
+  while (index->maskwords * BLOOM_BITS < (uint32_t)n * 8) {
+    index->maskwords *= 2;
+  }
+  index->bloom = (Elf_Addr*)calloc(index->maskwords, sizeof(Elf_Addr));
+  index->buckets = (uint32_t*)calloc(index->nbuckets + 1, sizeof(uint32_t));
+  index->hashvals = (uint32_t*)malloc(sizeof(uint32_t) * (n + 1));
+  symbol* sorted = (symbol*)malloc(sizeof(symbol) * (n + 1));
+  if (!index->bloom || !index->buckets || !index->hashvals || !sorted) {
+    sprintf(obj_error, "malloc failed");
+    free(sorted);
+    return 0;
+  }
+
+  // Counting sort by bucket; buckets[b + 1] first holds the count.
+  uint32_t* starts = index->buckets;
+  for (int i = 0; i < n; i++) {
+    starts[hashes[i] % index->nbuckets + 1]++;
+  }
+  for (uint32_t b = 0; b < index->nbuckets; b++) {
+    starts[b + 1] += starts[b];
+  }
+  for (int i = 0; i < n; i++) {
+    uint32_t pos = starts[hashes[i] % index->nbuckets]++;
+    sorted[pos] = obj->symbols[i];
+    index->hashvals[pos] = hashes[i] & ~1;
+    gnu_hash_bloom_add(index->bloom, index->maskwords, index->shift2,
+                       hashes[i]);
+  }
+  memcpy(obj->symbols, sorted, sizeof(symbol) * n);
+  free(sorted);
+
+  // starts[b] is now the end of bucket b. Turn it into start + 1.
+  uint32_t start = 0;
+  for (uint32_t b = 0; b < index->nbuckets; b++) {
+    uint32_t end = starts[b];
+    starts[b] = end > start ? start + 1 : 0;
+    if (end > start) {
+      index->hashvals[end - 1] |= 1;
+    }
+    start = end;
+  }
+  return 1;
+}
+
+static void* objsym_rel(obj_handle* obj, const char* symbol) {
+  sym_index* index = &obj->index;
+  if (!obj->num_exported) return NULL;
+  uint32_t h = gnu_hash_calc(symbol);
+  if (!gnu_hash_bloom_test(index->bloom, index->maskwords, index->shift2, h)) {
+    return NULL;
+  }
+  uint32_t n = index->buckets[h % index->nbuckets];
+  if (n == 0) return NULL;
+  for (n--;; n++) {
+    uint32_t h2 = index->hashvals[n];
+    if ((h & ~1) == (h2 & ~1) && !strcmp(symbol, obj->symbols[n].name)) {
+      return obj->symbols[n].addr;
+    }
+    if (h2 & 1) break;
+  }
+  return NULL;
+}
+
+// A relocatable object between the phases of loading. objopen_many
+// runs each phase over all objects before starting the next one, so
+// they can share one allocation and link against each other.
+typedef struct {
+  obj_handle* obj;
+  const char* bin;
+  Elf_Sym* symtab;
+  int symnum;
+  const char* strtab;
+  char** addrs;
+  size_t seg_size[NUM_SEGS];
+  size_t seg_align[NUM_SEGS];
+  size_t* tls_offsets;  // of the SHF_TLS sections in the TLS block
+  size_t tls_size;
+  size_t tls_align;
+  stub_table stubs;
+  reloc_ctx rctx;
+} rel_loader;
+
+// Finds the symbol table and sizes the segments, stubs included.
+static int rel_prepare(rel_loader* l, obj_handle* obj, const char* bin) {
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)bin;
+  Elf_Shdr* shdrs = (Elf_Shdr*)(bin + ehdr->e_shoff);
+  //Elf_Shdr* shstrtab = &shdrs[ehdr->e_shstrndx];
+  int strtab_index = -1;
+
+  memset(l, 0, sizeof(*l));
+  l->obj = obj;
+  l->bin = bin;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    if ((shdrs[i].sh_flags & SHF_COMPRESSED) &&
+        section_needed(shdrs, ehdr->e_shnum, ehdr->e_shstrndx, i)) {
+      snprintf(obj_error, sizeof(obj_error),
+               "%.200s: section %d is compressed, see OBJFCN_STREAM",
+               obj->filename, i);
+      return 0;
+    }
+  }
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    Elf_Shdr* shdr = &shdrs[i];
+    if (shdr->sh_type == SHT_SYMTAB) {
+      l->symtab = (Elf_Sym*)(bin + shdr->sh_offset);
+      l->symnum = shdr->sh_size / sizeof(Elf_Sym);
+      strtab_index = shdr->sh_link;
+    }
+  }
+
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    Elf_Shdr* shdr = &shdrs[i];
+    if (shdr->sh_type == SHT_STRTAB && i == strtab_index) {
+      l->strtab = bin + shdr->sh_offset;
+    }
+  }
+
+  for (int c = 0; c < NUM_SEGS; c++) {
+    l->seg_align[c] = 16;
+  }
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    Elf_Shdr* shdr = &shdrs[i];
+    if (should_load(shdr)) {
+      int c = section_class(shdr);
+      size_t align = section_align(shdr);
+      if (l->seg_align[c] < align) l->seg_align[c] = align;
+      l->seg_size[c] = align_up(l->seg_size[c], align) + shdr->sh_size;
+    }
+  }
+
+  // The TLS sections are relocated in place like any others, then make
+  // up the template of the object's TLS block.
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    Elf_Shdr* shdr = &shdrs[i];
+    if (!should_load(shdr) || !(shdr->sh_flags & SHF_TLS)) continue;
+    if (!l->tls_offsets) {
+      l->tls_offsets = (size_t*)calloc(ehdr->e_shnum, sizeof(size_t));
+      l->tls_align = 1;
+      if (!l->tls_offsets) {
+        sprintf(obj_error, "malloc failed");
+        return 0;
+      }
+    }
+    size_t align = section_align(shdr);
+    if (l->tls_align < align) l->tls_align = align;
+    l->tls_offsets[i] = align_up(l->tls_size, align);
+    l->tls_size = l->tls_offsets[i] + shdr->sh_size;
+  }
+
+  int symnum = l->symnum;
+  l->addrs = (char**)calloc(ehdr->e_shnum + 1, sizeof(char*));
+  l->stubs.plt = (char**)calloc(symnum, sizeof(char*));
+  l->stubs.got = (char**)calloc(symnum, sizeof(char*));
+  l->stubs.sized = (uint8_t*)calloc(symnum, 1);
+  l->rctx.sym_addrs = (char**)calloc(symnum, sizeof(char*));
+  l->rctx.resolved = (uint8_t*)calloc(symnum, 1);
+  if (!l->addrs ||
+      (symnum && (!l->stubs.plt || !l->stubs.got || !l->stubs.sized ||
+                  !l->rctx.sym_addrs || !l->rctx.resolved))) {
+    sprintf(obj_error, "malloc failed");
+    return 0;
+  }
+  l->rctx.obj = obj;
+  l->rctx.bin = bin;
+  l->rctx.symtab = l->symtab;
+  l->rctx.strtab = l->strtab;
+  l->rctx.addrs = l->addrs;
+  l->rctx.tls_offsets = l->tls_offsets;
+  l->rctx.stubs = &l->stubs;
+  l->rctx.text_size = l->seg_size[SEG_TEXT];
+  l->stubs.num_syms = symnum;
+
+  if (relocate(&l->rctx, RELOC_SIZE) == (size_t)-1) {
+    return 0;
+  }
+  l->seg_size[SEG_TEXT] =
+      align_up(l->seg_size[SEG_TEXT], 16) + l->stubs.plt_size;
+  // The first word of the GOT is the object's __dso_handle.
+  l->stubs.got_size += sizeof(void*);
+  l->seg_size[SEG_RODATA] =
+      align_up(l->seg_size[SEG_RODATA], 16) + l->stubs.got_size;
+  return 1;
+}
+
+// Copies the sections into the segments placed by place_segs and builds
+// the symbol table.
+static int rel_place(rel_loader* l) {
+  obj_handle* obj = l->obj;
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)l->bin;
+  Elf_Shdr* shdrs = (Elf_Shdr*)(l->bin + ehdr->e_shoff);
+  char** addrs = l->addrs;
+  int ok = 0;
+
+  {
+    char* next[NUM_SEGS];
+    for (int c = 0; c < NUM_SEGS; c++) {
+      next[c] = obj->segs[c].start;
+    }
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+      Elf_Shdr* shdr = &shdrs[i];
+      if (should_load(shdr)) {
+        int c = section_class(shdr);
+        addrs[i] = (char*)align_up((uintptr_t)next[c], section_align(shdr));
+        next[c] = addrs[i] + shdr->sh_size;
+        if (shdr->sh_type != SHT_NOBITS) {
+          memcpy(addrs[i], l->bin + shdr->sh_offset, shdr->sh_size);
+        }
+      }
+    }
+    l->stubs.plt_next = (char*)align_up((uintptr_t)next[SEG_TEXT], 16);
+    l->stubs.got_next = (char*)align_up((uintptr_t)next[SEG_RODATA], 16);
+    obj->stub_segs[0].start = l->stubs.plt_next;
+    obj->stub_segs[0].size = l->stubs.plt_size;
+    obj->stub_segs[1].start = l->stubs.got_next;
+    obj->stub_segs[1].size = l->stubs.got_size;
+    l->stubs.plt_end = l->stubs.plt_next + l->stubs.plt_size;
+    l->stubs.got_end = l->stubs.got_next + l->stubs.got_size;
+    obj->dso_handle = l->stubs.got_next;
+    l->stubs.got_next += sizeof(void*);
+  }
+
+  for (int i = 0; i < l->symnum; i++) {
+    if (is_loaded_symbol(&l->symtab[i], ehdr)) {
+      obj->num_symbols++;
+      if (is_exported(&l->symtab[i])) {
+        obj->num_exported++;
+      }
+    }
+  }
+  obj->symbols = (symbol*)calloc(obj->num_symbols + 1, sizeof(symbol));
+  uint32_t* hashes =
+      (uint32_t*)malloc(sizeof(uint32_t) * (obj->num_exported + 1));
+  if (!obj->symbols || !hashes) {
+    sprintf(obj_error, "malloc failed");
+    goto error;
+  }
+  // Exported symbols first, then locals.
+  for (int i = 0, ns = 0, nl = obj->num_exported; i < l->symnum; i++) {
+    Elf_Sym* sym = &l->symtab[i];
+    if (is_loaded_symbol(sym, ehdr)) {
+      const char* name = l->strtab + sym->st_name;
+      char* addr = addrs[sym->st_shndx] + sym->st_value;
+      int idx = is_exported(sym) ? ns++ : nl++;
+      //fprintf(stderr, "%s => %p\n", name, addr);
+      obj->symbols[idx].name = strdup(name);
+      obj->symbols[idx].addr = addr;
+      obj->symbols[idx].size = sym->st_size;
+      obj->symbols[idx].type = ELFW_ST_TYPE(sym->st_info);
+      if (idx < obj->num_exported) {
+        hashes[idx] = gnu_hash_calc(name);
+      }
+    }
+  }
+  ok = build_sym_index(obj, hashes);
+error:
+  free(hashes);
+  return ok;
+}
+
+// Priority of an .init_array or .fini_array section. The linker sorts
+// them by the number after the name and puts the plain ones last.
+static unsigned long init_priority(const char* name) {
+  const char* dot = strchr(name + 1, '.');
+  return dot ? strtoul(dot + 1, NULL, 10) : 65536;
+}
+
+// Collects the init and fini arrays of a relocated object in link order.
+static int rel_init_fini(rel_loader* l) {
+  obj_handle* obj = l->obj;
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)l->bin;
+  Elf_Shdr* shdrs = (Elf_Shdr*)(l->bin + ehdr->e_shoff);
+  const char* shstrtab = l->bin + shdrs[ehdr->e_shstrndx].sh_offset;
+  int* secs = (int*)malloc(sizeof(int) * (ehdr->e_shnum + 1));
+  int ok = secs != NULL;
+  if (!ok) sprintf(obj_error, "malloc failed");
+
+  for (int fini = 0; fini < 2 && ok; fini++) {
+    int n = 0;
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+      if (shdrs[i].sh_type != (fini ? SHT_FINI_ARRAY : SHT_INIT_ARRAY) ||
+          !l->addrs[i]) {
+        continue;
+      }
+      unsigned long prio = init_priority(shstrtab + shdrs[i].sh_name);
+      int j = n++;
+      for (; j > 0 &&
+               init_priority(shstrtab + shdrs[secs[j - 1]].sh_name) > prio;
+           j--) {
+        secs[j] = secs[j - 1];
+      }
+      secs[j] = i;
+    }
+    for (int j = 0; j < n && ok; j++) {
+      Elf_Shdr* shdr = &shdrs[secs[j]];
+      ok = add_funcs(fini ? &obj->fini_funcs : &obj->init_funcs,
+                     fini ? &obj->num_fini : &obj->num_init,
+                     (void**)l->addrs[secs[j]],
+                     shdr->sh_size / sizeof(void*));
+    }
+  }
+  free(secs);
+  return ok;
+}
+
+// Fills the template of the object's TLS block from its relocated TLS
+// sections.
+static void rel_tls_image(rel_loader* l) {
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)l->bin;
+  Elf_Shdr* shdrs = (Elf_Shdr*)(l->bin + ehdr->e_shoff);
+  char* image = tls_modules[l->obj->tls_module].image;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    Elf_Shdr* shdr = &shdrs[i];
+    if (should_load(shdr) && (shdr->sh_flags & SHF_TLS) &&
+        shdr->sh_type != SHT_NOBITS) {
+      memcpy(image + l->tls_offsets[i], l->addrs[i], shdr->sh_size);
+    }
+  }
+}
+
+// Resolves symbols, applies relocations and protects the segments.
+static int rel_link(rel_loader* l) {
+  obj_handle* obj = l->obj;
+  uint64_t start = obj->stats ? stat_now() : 0;
+  // The module ID goes into GOT entries, so it is taken before the
+  // template is complete. Nothing can use it before objopen returns.
+  if (l->tls_size &&
+      !tls_register(obj, NULL, l->tls_size, l->tls_size, l->tls_align)) {
+    return 0;
+  }
+  if (relocate(&l->rctx, RELOC_RESOLVE) == (size_t)-1 ||
+      relocate(&l->rctx, RELOC_APPLY) == (size_t)-1) {
+    return 0;
+  }
+  if (l->tls_size) rel_tls_image(l);
+  if (obj->stats) {
+    obj->stats->relocate_ns += stat_now() - start;
+    obj->stats->plt_stubs += l->stubs.num_plt;
+    obj->stats->got_slots += l->stubs.num_got;
+  }
+
+#if defined(__arm__) || defined(__aarch64__)
+  // Only the text is executed, PLT stubs included.
+  region* text = &obj->segs[SEG_TEXT];
+  __builtin___clear_cache(text->start, text->start + text->size);
+#endif
+
+  if ((obj->flags & OBJFCN_WX) && !protect_segs(obj)) {
+    return 0;
+  }
+  return rel_init_fini(l);
+}
+
+static void rel_free(rel_loader* l) {
+  free(l->addrs);
+  free(l->tls_offsets);
+  free(l->stubs.plt);
+  free(l->stubs.got);
+  for (int k = 0; k < NUM_TLS_KINDS; k++) {
+    free(l->stubs.tls[k]);
+  }
+  free(l->stubs.sized);
+  free(l->rctx.sym_addrs);
+  free(l->rctx.resolved);
+}
+
+// Loads a relocatable object, recording the address dependent slots in
+// |log| unless it is NULL.
+static int load_object(obj_handle* obj, const char* bin, fixup_log* log) {
+  rel_loader l;
+  int ok = (rel_prepare(&l, obj, bin) &&
+            layout_segs(obj, l.seg_size, l.seg_align) &&
+            rel_place(&l));
+  if (ok && log) {
+    log->ext_of_sym = (uint32_t*)calloc(l.symnum + 1, sizeof(uint32_t));
+    log->failed = !log->ext_of_sym;
+    l.rctx.log = log;
+  }
+  ok = ok && rel_link(&l);
+  rel_free(&l);
+  return ok;
+}
+
+#if OBJFCN_CACHE_SUPPORTED
+
+// Image cache. A relocatable object loaded with the same flags from an
+// unchanged file into an unchanged host is laid out the same way, so
+// the relocated image is saved along with the slots which depend on
+// addresses. The next objopen maps the saved image and only redoes
+// those slots, looking up each imported symbol once.
+
+static char* cache_dir;
+
+void objcache_set_dir(const char* dir) {
+  free(cache_dir);
+  cache_dir = dir ? strdup(dir) : NULL;
+}
+
+typedef struct {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t host_id;  // hash of the build IDs of the loaded modules
+  uint64_t flags;
+  uint64_t page_size;
+} cache_key;
+
+#define CACHE_MAGIC "OBJFCNC4"
+
+typedef struct {
+  char magic[8];
+  cache_key key;
+  uint64_t code_size;
+  uint64_t region_align;
+  uint64_t seg_offset[NUM_SEGS];
+  uint64_t seg_size[NUM_SEGS];
+  uint64_t base;
+  uint64_t dso_handle;  // offset in the image
+  uint64_t num_exts;
+  uint64_t num_fixups;
+  uint64_t num_symbols;
+  uint64_t num_exported;
+  uint64_t num_init;
+  uint64_t num_fini;
+  uint64_t strings_size;
+  uint64_t image_offset;
+} cache_header;
+
+// Followed by cache_ext[num_exts], obj_fixup[num_fixups],
+// cache_sym[num_symbols], the image offsets of the init and fini
+// functions, the strings and, page aligned, the image.
+typedef struct {
+  uint64_t name;  // offset in the strings
+  uint64_t addr;
+} cache_ext;
+
+typedef struct {
+  uint64_t name;
+  uint64_t offset;  // in the image
+  uint64_t size;
+  uint64_t type;
+} cache_sym;
+
+static uint64_t fnv1a(uint64_t h, const void* p, size_t size) {
+  const uint8_t* s = (const uint8_t*)p;
+  for (size_t i = 0; i < size; i++) {
+    h = (h ^ s[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static int hash_build_id(struct dl_phdr_info* info, size_t size, void* arg) {
+  uint64_t* h = (uint64_t*)arg;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_NOTE) continue;
+    const char* p = (const char*)(info->dlpi_addr + phdr->p_vaddr);
+    const char* end = p + phdr->p_memsz;
+    while (p + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr)* note = (const ElfW(Nhdr)*)p;
+      const char* desc = p + sizeof(*note) + align_up(note->n_namesz, 4);
+      if (note->n_type == NT_GNU_BUILD_ID) {
+        *h = fnv1a(*h, desc, note->n_descsz);
+      }
+      p = desc + align_up(note->n_descsz, 4);
+    }
+  }
+  return 0;
+}
+
+// Fills |key| for |filename| and returns the path of its cache file, or
+// NULL if the object cannot be cached.
+static char* cache_path(const char* filename, int flags, cache_key* key) {
+  struct stat st;
+  if (!cache_dir || (flags & OBJFCN_HUGE_TEXT) ||
+      stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return NULL;
+  }
+  memset(key, 0, sizeof(*key));
+  key->dev = st.st_dev;
+  key->ino = st.st_ino;
+  key->size = st.st_size;
+  key->mtime_sec = st.st_mtim.tv_sec;
+  key->mtime_nsec = st.st_mtim.tv_nsec;
+  key->host_id = 0xcbf29ce484222325ULL;
+  dl_iterate_phdr(hash_build_id, &key->host_id);
+  key->flags = flags;
+  key->page_size = page_size();
+
+  size_t len = strlen(cache_dir) + 64;
+  char* path = (char*)malloc(len);
+  if (path) {
+    snprintf(path, len, "%s/%llx-%llx-%x.objc", cache_dir,
+             (unsigned long long)key->dev, (unsigned long long)key->ino,
+             flags);
+  }
+  return path;
+}
+
+// Advances |end| past a table of |count| |size|-byte entries if it
+// fits before |limit|.
+static int cache_table_fits(uint64_t* end, uint64_t count, size_t size,
+                            uint64_t limit) {
+  if (*end > limit || count > (limit - *end) / size) return 0;
+  *end += count * size;
+  return 1;
+}
 
-    switch (type) {
-#if 0
-    case R_386_32: {
-      *addr += (int)val;
+static int cache_string_ok(const char* strings, uint64_t size,
+                           uint64_t offset) {
+  return offset < size && memchr(strings + offset, 0, size - offset);
+}
+
+// Rebuilds |obj| from the cache file at |path|. A stale, corrupt or
+// unusable cache file just makes it return 0; every count and offset in
+// it is checked before it is used.
+static int cache_load(obj_handle* obj, const char* path,
+                      const cache_key* key) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  char* file = (char*)MAP_FAILED;
+  uint32_t* hashes = NULL;
+  char** ext_delta = NULL;
+  int prot = (obj->flags & OBJFCN_WX ? PROT_READ | PROT_WRITE :
+              PROT_READ | PROT_WRITE | PROT_EXEC);
+  int ok = 0;
+
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(cache_header)) {
+    goto out;
+  }
+  file = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file == MAP_FAILED) goto out;
+
+  {
+    cache_header* h = (cache_header*)file;
+    uint64_t end = sizeof(*h);
+    uint64_t limit = h->image_offset;
+    if (memcmp(h->magic, CACHE_MAGIC, 8) ||
+        memcmp(&h->key, key, sizeof(*key)) ||
+        h->image_offset % page_size() ||
+        h->image_offset > (uint64_t)st.st_size ||
+        h->code_size > (uint64_t)st.st_size - h->image_offset ||
+        !h->region_align || (h->region_align & (h->region_align - 1)) ||
+        h->code_size < sizeof(void*) ||
+        h->dso_handle > h->code_size - sizeof(void*) ||
+        h->num_symbols > INT_MAX || h->num_exported > h->num_symbols ||
+        h->num_init > INT_MAX || h->num_fini > INT_MAX ||
+        !cache_table_fits(&end, h->num_exts, sizeof(cache_ext), limit) ||
+        !cache_table_fits(&end, h->num_fixups, sizeof(obj_fixup), limit) ||
+        !cache_table_fits(&end, h->num_symbols, sizeof(cache_sym), limit) ||
+        !cache_table_fits(&end, h->num_init, sizeof(uint64_t), limit) ||
+        !cache_table_fits(&end, h->num_fini, sizeof(uint64_t), limit) ||
+        !cache_table_fits(&end, h->strings_size, 1, limit)) {
+      goto out;
     }
-    case R_386_COPY: {
-      if (val) {
-        *addr = *(int*)val;
-      } else {
-        fprintf(stderr, "undefined: %s\n", sname);
-        abort();
+    for (int c = 0; c < NUM_SEGS; c++) {
+      if (h->seg_offset[c] > h->code_size ||
+          h->seg_size[c] > h->code_size - h->seg_offset[c]) {
+        goto out;
       }
     }
-    case R_386_GLOB_DAT: {
-      break;
+    cache_ext* exts = (cache_ext*)(h + 1);
+    obj_fixup* fixups = (obj_fixup*)(exts + h->num_exts);
+    cache_sym* syms = (cache_sym*)(fixups + h->num_fixups);
+    uint64_t* funcs = (uint64_t*)(syms + h->num_symbols);
+    const char* strings = (const char*)(funcs + h->num_init + h->num_fini);
+    for (uint64_t i = 0; i < h->num_exts; i++) {
+      if (!cache_string_ok(strings, h->strings_size, exts[i].name)) goto out;
     }
-    case R_386_JMP_SLOT: {
-      if (val) {
-        *addr = (int)val;
-      } else {
-        *addr = (int)&undefined;
+    for (uint64_t i = 0; i < h->num_fixups; i++) {
+      obj_fixup* f = &fixups[i];
+      size_t width = f->kind & FIXUP_64 ? 8 : 4;
+      if (h->code_size < width || f->offset > h->code_size - width ||
+          (f->source >= FIXUP_EXT && f->source - FIXUP_EXT >= h->num_exts)) {
+        goto out;
       }
-      break;
     }
-#endif
-
-#if DYN_SUPPORTED
-    case R_GLOB_DAT:
-    case R_JUMP_SLOT: {
-      if (val) {
-        *addr = val;
-      } else {
-        *addr = (void*)&undefined;
+    for (uint64_t i = 0; i < h->num_symbols; i++) {
+      if (!cache_string_ok(strings, h->strings_size, syms[i].name) ||
+          syms[i].offset > h->code_size) {
+        goto out;
       }
-      break;
     }
-
-    case R_RELATIVE: {
-      *addr = (void*)(*(char**)addr + (intptr_t)obj->base);
-      break;
+    for (uint64_t i = 0; i < h->num_init + h->num_fini; i++) {
+      if (funcs[i] >= h->code_size) goto out;
     }
 
-    case R_64: {
-#if __SIZEOF_POINTER__ == 8
-      *addr = (void*)((char*)val + rel->r_addend);
-#else
-      *addr = val;
-#endif
-      break;
+    obj->code = alloc_region(h->code_size, h->region_align, prot);
+    if (!obj->code) goto out;
+    obj->code_size = h->code_size;
+    obj->code_align = h->region_align;
+    if (mmap(obj->code, h->code_size, prot, MAP_PRIVATE | MAP_FIXED, fd,
+             h->image_offset) == MAP_FAILED) {
+      goto out;
+    }
+    for (int c = 0; c < NUM_SEGS; c++) {
+      obj->segs[c].start = obj->code + h->seg_offset[c];
+      obj->segs[c].size = h->seg_size[c];
+    }
+    // Set before the lookups, which may ask for __dso_handle.
+    obj->dso_handle = obj->code + h->dso_handle;
+
+    ext_delta = (char**)calloc(h->num_exts + 1, sizeof(char*));
+    if (!ext_delta) goto out;
+    for (uint64_t i = 0; i < h->num_exts; i++) {
+      const char* name = strings + exts[i].name;
+      char* addr = (char*)resolve_external(obj, name, NULL,
+                                           gnu_hash_calc(name));
+      if (!addr) goto out;
+      ext_delta[i] = (char*)(addr - (char*)exts[i].addr);
     }
-#endif
 
-    case R_X86_64_DTPMOD64: {
-      // TODO(hamaji): Retrive the right module ID.
-      *addr = (void*)1;
-      break;
+    intptr_t base_delta = obj->code - (char*)h->base;
+    for (uint64_t i = 0; i < h->num_fixups; i++) {
+      obj_fixup* f = &fixups[i];
+      char* where = obj->code + f->offset;
+      intptr_t delta = 0;
+      if (f->source == FIXUP_BASE) {
+        delta = base_delta;
+      } else if (f->source >= FIXUP_EXT) {
+        delta = (intptr_t)ext_delta[f->source - FIXUP_EXT];
+      }
+      if (f->kind & FIXUP_PCREL) {
+        delta -= base_delta;
+      }
+      if (f->kind & FIXUP_64) {
+        *(uint64_t*)where += delta;
+      } else {
+        int64_t v = (int64_t)*(int32_t*)where + delta;
+        // A call into the host which is too far now needed a stub.
+        if ((f->kind & FIXUP_PCREL) && (v < INT32_MIN || v > INT32_MAX)) {
+          goto out;
+        }
+        *(uint32_t*)where = (uint32_t)v;
+      }
     }
 
-    case R_X86_64_DTPOFF64: {
-      break;
+    obj->num_symbols = h->num_symbols;
+    obj->num_exported = h->num_exported;
+    obj->symbols = (symbol*)calloc(obj->num_symbols + 1, sizeof(symbol));
+    hashes = (uint32_t*)malloc(sizeof(uint32_t) * (obj->num_exported + 1));
+    if (!obj->symbols || !hashes) goto out;
+    for (int i = 0; i < obj->num_symbols; i++) {
+      obj->symbols[i].name = strdup(strings + syms[i].name);
+      obj->symbols[i].addr = obj->code + syms[i].offset;
+      obj->symbols[i].size = syms[i].size;
+      obj->symbols[i].type = syms[i].type;
+      if (i < obj->num_exported) {
+        hashes[i] = gnu_hash_calc(obj->symbols[i].name);
+      }
+    }
+    if (!build_sym_index(obj, hashes)) goto out;
+    for (uint64_t i = 0; i < h->num_init + h->num_fini; i++) {
+      void* f = obj->code + funcs[i];
+      if (!(i < h->num_init ?
+            add_funcs(&obj->init_funcs, &obj->num_init, &f, 1) :
+            add_funcs(&obj->fini_funcs, &obj->num_fini, &f, 1))) {
+        goto out;
+      }
     }
+    if ((obj->flags & OBJFCN_WX) && !protect_segs(obj)) goto out;
+    ok = 1;
+  }
 
-#if defined(__aarch64__)
-    case R_AARCH64_TLSDESC: {
-      TlsDesc* desc = (TlsDesc*)addr;
-      desc->entry = &return_tls;
-      desc->arg = (void*)(g_objfcn_tls + sym->st_value + rel->r_addend - (intptr_t)__builtin_thread_pointer());
-      break;
+out:
+  if (file != MAP_FAILED) munmap(file, st.st_size);
+  close(fd);
+  free(ext_delta);
+  free(hashes);
+  if (!ok) {
+    // Start over from the file.
+    if (obj->code) free_region(obj->code, obj->code_size);
+    for (int i = 0; i < obj->num_symbols && obj->symbols; i++) {
+      free(obj->symbols[i].name);
     }
-#endif
+    free(obj->symbols);
+    free(obj->index.bloom);
+    free(obj->index.buckets);
+    free(obj->index.hashvals);
+    free(obj->init_funcs);
+    free(obj->fini_funcs);
+    obj->code = NULL;
+    obj->code_size = 0;
+    obj->dso_handle = NULL;
+    obj->symbols = NULL;
+    obj->init_funcs = obj->fini_funcs = NULL;
+    obj->num_init = obj->num_fini = 0;
+    obj->num_symbols = obj->num_exported = 0;
+    memset(&obj->index, 0, sizeof(obj->index));
+    memset(obj->segs, 0, sizeof(obj->segs));
+  }
+  return ok;
+}
 
-    default:
-      LOGF("Unsupported reloc: %d\n", type);
-      abort();
-      break;
+static int write_all(FILE* fp, const void* p, size_t size) {
+  return fwrite(p, 1, size, fp) == size;
+}
+
+// Writes the cache file for |obj|, just loaded with |log|. The file is
+// renamed into place so readers never see it half written.
+static void cache_save(obj_handle* obj, const char* path,
+                       const cache_key* key, fixup_log* log) {
+  cache_header h;
+  size_t len = strlen(path) + 8;
+  char* tmp = (char*)malloc(len);
+  FILE* fp = NULL;
+  int ok = 0;
+
+  // The image only tells where functions inside it are.
+  for (int i = 0; i < obj->num_init + obj->num_fini; i++) {
+    char* f = (char*)(i < obj->num_init ? obj->init_funcs[i] :
+                      obj->fini_funcs[i - obj->num_init]);
+    if (f < obj->code || f >= obj->code + obj->code_size) {
+      free(tmp);
+      return;
+    }
+  }
+  if (!tmp) return;
+  snprintf(tmp, len, "%s.XXXXXX", path);
+  mkdir(cache_dir, 0777);
+  int fd = mkstemp(tmp);
+  if (fd < 0 || !(fp = fdopen(fd, "wb"))) {
+    if (fd >= 0) close(fd);
+    free(tmp);
+    return;
+  }
 
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, CACHE_MAGIC, 8);
+  h.key = *key;
+  h.code_size = obj->code_size;
+  h.region_align = obj->code_align;
+  for (int c = 0; c < NUM_SEGS; c++) {
+    h.seg_offset[c] = obj->segs[c].start - obj->code;
+    h.seg_size[c] = obj->segs[c].size;
+  }
+  h.base = (uint64_t)obj->code;
+  h.dso_handle = obj->dso_handle - obj->code;
+  h.num_exts = log->num_exts;
+  h.num_fixups = log->num_fixups;
+  h.num_symbols = obj->num_symbols;
+  h.num_exported = obj->num_exported;
+  h.num_init = obj->num_init;
+  h.num_fini = obj->num_fini;
+  for (size_t i = 0; i < log->num_exts; i++) {
+    h.strings_size += strlen(log->exts[i].name) + 1;
+  }
+  for (int i = 0; i < obj->num_symbols; i++) {
+    h.strings_size += strlen(obj->symbols[i].name) + 1;
+  }
+  h.image_offset = align_up(sizeof(h) + sizeof(cache_ext) * h.num_exts +
+                            sizeof(obj_fixup) * h.num_fixups +
+                            sizeof(cache_sym) * h.num_symbols +
+                            sizeof(uint64_t) * (h.num_init + h.num_fini) +
+                            h.strings_size,
+                            page_size());
+
+  if (!write_all(fp, &h, sizeof(h))) goto out;
+  {
+    uint64_t name = 0;
+    for (size_t i = 0; i < log->num_exts; i++) {
+      cache_ext e = {name, (uint64_t)log->exts[i].addr};
+      if (!write_all(fp, &e, sizeof(e))) goto out;
+      name += strlen(log->exts[i].name) + 1;
+    }
+    if (!write_all(fp, log->fixups, sizeof(obj_fixup) * log->num_fixups)) {
+      goto out;
+    }
+    for (int i = 0; i < obj->num_symbols; i++) {
+      cache_sym s = {name, (uint64_t)(obj->symbols[i].addr - obj->code),
+                     obj->symbols[i].size, (uint64_t)obj->symbols[i].type};
+      if (!write_all(fp, &s, sizeof(s))) goto out;
+      name += strlen(obj->symbols[i].name) + 1;
+    }
+    for (int i = 0; i < obj->num_init + obj->num_fini; i++) {
+      char* f = (char*)(i < obj->num_init ? obj->init_funcs[i] :
+                        obj->fini_funcs[i - obj->num_init]);
+      uint64_t offset = f - obj->code;
+      if (!write_all(fp, &offset, sizeof(offset))) goto out;
     }
+    for (size_t i = 0; i < log->num_exts; i++) {
+      const char* n = log->exts[i].name;
+      if (!write_all(fp, n, strlen(n) + 1)) goto out;
+    }
+    for (int i = 0; i < obj->num_symbols; i++) {
+      const char* n = obj->symbols[i].name;
+      if (!write_all(fp, n, strlen(n) + 1)) goto out;
+    }
+  }
+  if (fseek(fp, h.image_offset, SEEK_SET) != 0 ||
+      !write_all(fp, obj->code, obj->code_size)) {
+    goto out;
+  }
+  ok = 1;
 
+out:
+  if (fclose(fp) != 0) ok = 0;
+  if (ok && rename(tmp, path) == 0) {
+    LOGF(OBJFCN_LOG_INFO, "saved %s to %s\n", obj->filename, path);
+  } else {
+    unlink(tmp);
   }
+  free(tmp);
 }
 
-static void parse_version(obj_handle* obj, int verneed_num) {
-  int num_verstrs = 2;
-  obj->verstrs = (const char**)calloc(num_verstrs, sizeof(char*));
+#else
 
-  Elf_Verneed* vn = obj->verneed;
-  for (int i = 0; i < verneed_num; ++i) {
-    LOGF("VERNEED: ver=%d cnt=%d file=%s aux=%d next=%d\n",
-         vn->vn_version, vn->vn_cnt, obj->strtab + vn->vn_file,
-         vn->vn_aux, vn->vn_next);
-    Elf_Vernaux* vna = (Elf_Vernaux*)((char*)vn + vn->vn_aux);
-    for (int j = 0; j < vn->vn_cnt; ++j) {
-      LOGF(" VERNAUX: hash=%d flags=%d other=%d name=%s next=%d\n",
-           vna->vna_hash, vna->vna_flags, vna->vna_other,
-           obj->strtab + vna->vna_name, vna->vna_next);
+void objcache_set_dir(const char* dir) {
+}
 
-      int ver = vna->vna_other;
-      if (num_verstrs <= ver) {
-        num_verstrs = ver + 1;
-        obj->verstrs = (const char**)realloc(obj->verstrs,
-                                             sizeof(char*) * num_verstrs);
-      }
-      obj->verstrs[ver] = obj->strtab + vna->vna_name;
+#endif
 
-      vna = (Elf_Vernaux*)((char*)vna + vna->vna_next);
-    }
-    vn = (Elf_Verneed*)((char*)vn + vn->vn_next);
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init(void) {
+  init_log();
+  init_tls();
+  init_relocs();
+  init_needed();
+  const char* path = getenv("OBJFCN_LIBRARY_PATH");
+  if (path && !lib_path) {
+    objlib_set_path(path);
   }
+#if OBJFCN_LAZY_SUPPORTED
+  init_lazy();
+#endif
+  const char* threads = getenv("OBJFCN_RELOC_THREADS");
+  if (threads) {
+    objreloc_set_threads(atoi(threads));
+  }
+#if OBJFCN_CACHE_SUPPORTED
+  const char* dir = getenv("OBJFCN_CACHE_DIR");
+  if (dir && !cache_dir) {
+    objcache_set_dir(dir);
+  }
+#endif
+#if !OBJFCN_SPLIT_ALLOC
+  init_arena();
+#endif
 }
 
-static int load_object_dyn(obj_handle* obj, const char* bin,
-                           const char* filename) {
-  Elf_Ehdr* ehdr = (Elf_Ehdr*)bin;
-  Elf_Phdr* phdrs = (Elf_Phdr*)(bin + ehdr->e_phoff);
+static int compare_symbol_info(const void* a, const void* b) {
+  return strcmp(((const obj_symbol_info*)a)->name,
+                ((const obj_symbol_info*)b)->name);
+}
 
-  size_t max_addr = 0;
-  for (int i = 0; i < ehdr->e_phnum; i++) {
-    Elf_Phdr* phdr = &phdrs[i];
-    if (phdr->p_type != PT_LOAD) continue;
-    size_t end_addr = align_up(phdr->p_vaddr + phdr->p_memsz, 4096);
-    if (max_addr < end_addr) {
-      max_addr = end_addr;
+// Number of entries of the dynamic symbol table. Only the hash tables
+// tell it.
+static uint32_t dyn_symbol_count(obj_handle* obj) {
+  if (!obj->gnu_hash) {
+    return obj->elf_hash->nchain;
+  }
+  Elf_GnuHash* gnu_hash = obj->gnu_hash;
+  uint32_t last = 0;
+  for (uint32_t b = 0; b < gnu_hash->nbuckets; b++) {
+    if (last < gnu_hash_buckets(gnu_hash)[b]) {
+      last = gnu_hash_buckets(gnu_hash)[b];
+    }
+  }
+  if (last < gnu_hash->symndx) return gnu_hash->symndx;
+  const uint32_t* hashvals = gnu_hash_hashvals(gnu_hash) - gnu_hash->symndx;
+  while (!(hashvals[last] & 1)) last++;
+  return last + 1;
+}
+
+static sym_table* get_sym_table(obj_handle* obj) {
+  sym_table* table = __atomic_load_n(&obj->sorted_syms, __ATOMIC_ACQUIRE);
+  if (table) return table;
+
+  int max = obj->is_dyn ? (int)dyn_symbol_count(obj) : obj->num_exported;
+  table = (sym_table*)malloc(sizeof(sym_table));
+  obj_symbol_info* syms =
+      (obj_symbol_info*)malloc(sizeof(obj_symbol_info) * (max + 1));
+  if (!table || !syms) {
+    free(table);
+    free(syms);
+    sprintf(obj_error, "malloc failed");
+    return NULL;
+  }
+  int n = 0;
+  if (obj->is_dyn) {
+    for (int i = 1; i < max; i++) {
+      Elf_Sym* sym = &obj->symtab[i];
+      if (!is_defined(sym)) continue;
+      syms[n].name = obj->strtab + sym->st_name;
+      syms[n].addr = obj->base + sym->st_value;
+      syms[n].size = sym->st_size;
+      syms[n].type = ELFW_ST_TYPE(sym->st_info);
+      n++;
+    }
+  } else {
+    for (int i = 0; i < max; i++) {
+      syms[n].name = obj->symbols[i].name;
+      syms[n].addr = obj->symbols[i].addr;
+      syms[n].size = obj->symbols[i].size;
+      syms[n].type = obj->symbols[i].type;
+      n++;
     }
   }
+  qsort(syms, n, sizeof(*syms), compare_symbol_info);
+  table->syms = syms;
+  table->count = n;
+
+  sym_table* expected = NULL;
+  if (!__atomic_compare_exchange_n(&obj->sorted_syms, &expected, table, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(syms);
+    free(table);
+    return expected;
+  }
+  return table;
+}
 
-  char* code = alloc_code(obj, max_addr);
-  align_code(obj, 4096);
+// Profiler integration. With OBJFCN_PROF_PERF_MAP, symbols of each
+// object go to /tmp/perf-<pid>.map, which perf reads for anonymous
+// memory. With OBJFCN_PROF_GDB_JIT, each object is described by a small
+// in-memory ELF holding its symbols and registered through the GDB JIT
+// interface, so debuggers can symbolize it.
 
-  obj->base = code;
-  obj->code_size = max_addr;
-  obj->is_dyn = 1;
+#if defined(__x86_64__)
+# define OBJFCN_EM EM_X86_64
+#elif defined(__i386__)
+# define OBJFCN_EM EM_386
+#elif defined(__arm__)
+# define OBJFCN_EM EM_ARM
+#elif defined(__aarch64__)
+# define OBJFCN_EM EM_AARCH64
+#endif
 
-  for (int i = 0; i < ehdr->e_phnum; i++) {
-    Elf_Phdr* phdr = &phdrs[i];
-    if (phdr->p_type != PT_LOAD) continue;
-    memcpy(code + phdr->p_vaddr, bin + phdr->p_offset, phdr->p_filesz);
-  }
+typedef enum {
+  JIT_NOACTION = 0,
+  JIT_REGISTER_FN,
+  JIT_UNREGISTER_FN
+} jit_actions_t;
+
+struct jit_code_entry {
+  struct jit_code_entry* next_entry;
+  struct jit_code_entry* prev_entry;
+  const char* symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t version;
+  uint32_t action_flag;
+  struct jit_code_entry* relevant_entry;
+  struct jit_code_entry* first_entry;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Weak, so a host with a JIT of its own shares its descriptor with us.
+__attribute__((weak, noinline)) void __jit_debug_register_code(void) {
+  __asm__ volatile("");
+}
+__attribute__((weak)) struct jit_descriptor __jit_debug_descriptor = {
+    1, JIT_NOACTION, NULL, NULL};
+#ifdef __cplusplus
+}
+#endif
 
-  for (int i = 0; i < ehdr->e_phnum; i++) {
-    Elf_Phdr* phdr = &phdrs[i];
-    if (phdr->p_type != PT_TLS) continue;
-    assert(phdr->p_memsz <= OBJFCN_TLS_SIZE);
-    memcpy(g_objfcn_tls, bin + phdr->p_offset, phdr->p_filesz);
-  }
+static int prof_mode;
+static FILE* perf_map;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
 
-  for (int i = 0; i < ehdr->e_phnum; i++) {
-    Elf_Phdr* phdr = &phdrs[i];
-    if (phdr->p_type != PT_DYNAMIC) continue;
+void objprof_set(int prof) {
+  pthread_mutex_lock(&prof_lock);
+  prof_mode = prof;
+  pthread_mutex_unlock(&prof_lock);
+}
 
-    Elf_Dyn* dyns = (Elf_Dyn*)(code + phdr->p_vaddr);
-    for (Elf_Dyn* dyn = dyns; dyn->d_tag; dyn++) {
-      if (dyn->d_tag == DT_STRTAB) {
-        obj->strtab = code + dyn->d_un.d_ptr;
-      }
-    }
+typedef void (*prof_symbol_fn)(void* arg, const char* name, char* addr,
+                               size_t size, int type);
 
-    Elf_Rel* rel = NULL;
-    int relsz = 0, pltrelsz = 0;
-    void** init_array = NULL;
-    int init_arraysz = 0;
-    int verneed_num = 0;
-    for (Elf_Dyn* dyn = dyns; dyn->d_tag; dyn++) {
-      switch (dyn->d_tag) {
-      case DT_NEEDED: {
-        const char* name = obj->strtab + dyn->d_un.d_ptr;
-        void* handle = dlopen(name, RTLD_GLOBAL);
-        LOGF("DT_NEEDED %s %p\n", name, handle);
-        (void)handle;
-        break;
+// Calls |fn| for the symbols of |obj| and its stubs, functions first.
+static void prof_symbols(obj_handle* obj, prof_symbol_fn fn, void* arg) {
+  if (obj->is_dyn) {
+    uint32_t n = dyn_symbol_count(obj);
+    for (uint32_t i = 1; i < n; i++) {
+      Elf_Sym* sym = &obj->symtab[i];
+      int type = ELFW_ST_TYPE(sym->st_info);
+      if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= SHN_LORESERVE ||
+          (type != STT_FUNC && type != STT_OBJECT)) {
+        continue;
       }
+      fn(arg, obj->strtab + sym->st_name, obj->base + sym->st_value,
+         sym->st_size, type);
+    }
+  } else {
+    for (int i = 0; i < obj->num_symbols; i++) {
+      symbol* sym = &obj->symbols[i];
+      fn(arg, sym->name, sym->addr, sym->size, sym->type);
+    }
+  }
+  if (obj->stub_segs[0].size) {
+    fn(arg, "[objfcn plt]", obj->stub_segs[0].start, obj->stub_segs[0].size,
+       STT_FUNC);
+  }
+  if (obj->stub_segs[1].size) {
+    fn(arg, "[objfcn got]", obj->stub_segs[1].start, obj->stub_segs[1].size,
+       STT_OBJECT);
+  }
+}
 
-      case DT_SYMTAB:
-        obj->symtab = (Elf_Sym*)(code + dyn->d_un.d_ptr);
-        break;
+static void perf_map_symbol(void* arg, const char* name, char* addr,
+                            size_t size, int type) {
+  obj_handle* obj = (obj_handle*)arg;
+  if (type != STT_FUNC) return;
+  const char* base = strrchr(obj->filename, '/');
+  fprintf(perf_map, "%lx %zx %s [%s]\n", (unsigned long)(uintptr_t)addr,
+          size ? size : 1, name, base ? base + 1 : obj->filename);
+}
 
-      case DT_HASH:
-        obj->elf_hash = (Elf_Hash*)(code + dyn->d_un.d_ptr);
-        break;
+typedef struct {
+  obj_handle* obj;
+  Elf_Sym* syms;
+  char* strtab;
+  size_t num_syms;
+  size_t strtab_size;
+} jit_symfile;
+
+static void count_jit_symbol(void* arg, const char* name, char* addr,
+                             size_t size, int type) {
+  jit_symfile* f = (jit_symfile*)arg;
+  f->num_syms++;
+  f->strtab_size += strlen(name) + 1;
+}
 
-      case DT_GNU_HASH:
-        obj->gnu_hash = (Elf_GnuHash*)(code + dyn->d_un.d_ptr);
-        break;
+static void add_jit_symbol(void* arg, const char* name, char* addr,
+                           size_t size, int type) {
+  jit_symfile* f = (jit_symfile*)arg;
+  Elf_Sym* sym = &f->syms[f->num_syms++];
+  memset(sym, 0, sizeof(*sym));
+  sym->st_name = f->strtab_size;
+  sym->st_value = addr - f->obj->code;
+  sym->st_size = size;
+  sym->st_info = ELFW_ST_INFO(STB_GLOBAL, type);
+  sym->st_shndx = 1;
+  strcpy(f->strtab + f->strtab_size, name);
+  f->strtab_size += strlen(name) + 1;
+}
 
-      case DT_RELENT:
-      case DT_PLTREL: {
-        int pltrel = dyn->d_un.d_val;
-        assert(pltrel == DT_RELA);
-        break;
-      }
+// Builds the ELF GDB reads for |obj|: a relocatable object whose only
+// allocated section is a NOBITS .text at the address of the code, and
+// its symbols.
+static struct jit_code_entry* make_jit_entry(obj_handle* obj) {
+  static const char shstrtab[] = "\0.text\0.symtab\0.strtab\0.shstrtab";
+  jit_symfile f;
+  memset(&f, 0, sizeof(f));
+  f.obj = obj;
+  f.num_syms = 1;
+  f.strtab_size = 1;
+  prof_symbols(obj, count_jit_symbol, &f);
+
+  size_t syms_off = align_up(sizeof(Elf_Ehdr), 16);
+  size_t strtab_off = syms_off + sizeof(Elf_Sym) * f.num_syms;
+  size_t shstrtab_off = strtab_off + f.strtab_size;
+  size_t shdrs_off = align_up(shstrtab_off + sizeof(shstrtab), 16);
+  size_t size = shdrs_off + sizeof(Elf_Shdr) * 5;
+  struct jit_code_entry* entry =
+      (struct jit_code_entry*)calloc(1, sizeof(*entry) + size);
+  if (!entry) return NULL;
+  char* file = (char*)(entry + 1);
+
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)file;
+  memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+  ehdr->e_ident[EI_CLASS] = __SIZEOF_POINTER__ == 8 ? ELFCLASS64 : ELFCLASS32;
+  ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr->e_type = ET_REL;
+  ehdr->e_machine = OBJFCN_EM;
+  ehdr->e_version = EV_CURRENT;
+  ehdr->e_shoff = shdrs_off;
+  ehdr->e_ehsize = sizeof(Elf_Ehdr);
+  ehdr->e_shentsize = sizeof(Elf_Shdr);
+  ehdr->e_shnum = 5;
+  ehdr->e_shstrndx = 4;
+
+  f.syms = (Elf_Sym*)(file + syms_off);
+  f.strtab = file + strtab_off;
+  f.num_syms = 1;
+  f.strtab_size = 1;
+  prof_symbols(obj, add_jit_symbol, &f);
+  memcpy(file + shstrtab_off, shstrtab, sizeof(shstrtab));
+
+  Elf_Shdr* shdrs = (Elf_Shdr*)(file + shdrs_off);
+  shdrs[1].sh_name = 1;
+  shdrs[1].sh_type = SHT_NOBITS;
+  shdrs[1].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  shdrs[1].sh_addr = (uintptr_t)obj->code;
+  shdrs[1].sh_size = obj->code_size;
+  shdrs[1].sh_addralign = 16;
+  shdrs[2].sh_name = 7;
+  shdrs[2].sh_type = SHT_SYMTAB;
+  shdrs[2].sh_offset = syms_off;
+  shdrs[2].sh_size = sizeof(Elf_Sym) * f.num_syms;
+  shdrs[2].sh_link = 3;
+  shdrs[2].sh_info = 1;  // all but the null symbol are global
+  shdrs[2].sh_addralign = 8;
+  shdrs[2].sh_entsize = sizeof(Elf_Sym);
+  shdrs[3].sh_name = 15;
+  shdrs[3].sh_type = SHT_STRTAB;
+  shdrs[3].sh_offset = strtab_off;
+  shdrs[3].sh_size = f.strtab_size;
+  shdrs[3].sh_addralign = 1;
+  shdrs[4].sh_name = 23;
+  shdrs[4].sh_type = SHT_STRTAB;
+  shdrs[4].sh_offset = shstrtab_off;
+  shdrs[4].sh_size = sizeof(shstrtab);
+  shdrs[4].sh_addralign = 1;
+
+  entry->symfile_addr = file;
+  entry->symfile_size = size;
+  return entry;
+}
 
-      case DT_RELA: {
-        rel = (Elf_Rel*)(code + dyn->d_un.d_ptr);
-        LOGF("rel: %p\n", rel);
-        break;
-      }
-      case DT_RELASZ: {
-        relsz = dyn->d_un.d_val;
-        LOGF("relsz: %d\n", relsz);
-        break;
+static void prof_notify(const char* event, obj_handle* obj) {
+  if (!__atomic_load_n(&prof_mode, __ATOMIC_RELAXED) && !obj->jit_entry) {
+    return;
+  }
+  pthread_mutex_lock(&prof_lock);
+  if (!strcmp(event, "objopen")) {
+    if (prof_mode & OBJFCN_PROF_PERF_MAP) {
+      if (!perf_map) {
+        char path[64];
+        snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+        perf_map = fopen(path, "a");
       }
-      case DT_PLTRELSZ: {
-        pltrelsz = dyn->d_un.d_val;
-        LOGF("pltrelsz: %d\n", pltrelsz);
-        break;
+      if (perf_map) {
+        prof_symbols(obj, perf_map_symbol, obj);
+        fflush(perf_map);
       }
+    }
+    struct jit_code_entry* entry = NULL;
+    if ((prof_mode & OBJFCN_PROF_GDB_JIT) && (entry = make_jit_entry(obj))) {
+      struct jit_descriptor* d = &__jit_debug_descriptor;
+      entry->next_entry = d->first_entry;
+      if (d->first_entry) d->first_entry->prev_entry = entry;
+      d->first_entry = entry;
+      d->relevant_entry = entry;
+      d->action_flag = JIT_REGISTER_FN;
+      __jit_debug_register_code();
+      obj->jit_entry = entry;
+    }
+  } else if (obj->jit_entry) {
+    struct jit_code_entry* entry = obj->jit_entry;
+    struct jit_descriptor* d = &__jit_debug_descriptor;
+    if (entry->prev_entry) {
+      entry->prev_entry->next_entry = entry->next_entry;
+    } else {
+      d->first_entry = entry->next_entry;
+    }
+    if (entry->next_entry) entry->next_entry->prev_entry = entry->prev_entry;
+    d->relevant_entry = entry;
+    d->action_flag = JIT_UNREGISTER_FN;
+    __jit_debug_register_code();
+    free(entry);
+    obj->jit_entry = NULL;
+  }
+  pthread_mutex_unlock(&prof_lock);
+}
 
-      case DT_INIT_ARRAY: {
-        init_array = (void**)(code + dyn->d_un.d_ptr);
-        break;
-      }
-      case DT_INIT_ARRAYSZ: {
-        init_arraysz = dyn->d_un.d_val;
-        break;
-      }
+// Stubs of OBJFCN_RELOADABLE handles. Each exported function name gets
+// a stub, jmp *slot, which objsym returns in place of the function. A
+// name keeps its stub across versions, and objreload just points the
+// slots at the new code. Stubs come in chunks of a page of stubs followed
+// by a page of slots, and go when the last version is closed.
 
-      case DT_VERSYM: {
-        obj->versym = (Elf_Versym*)(code + dyn->d_un.d_ptr);
-        break;
-      }
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+# define OBJFCN_RELOAD_SUPPORTED 1
+#endif
 
-      case DT_VERNEED: {
-        obj->verneed = (Elf_Verneed*)(code + dyn->d_un.d_ptr);
-        break;
-      }
+#define RELOAD_STUB_SIZE 8
 
-      case DT_VERNEEDNUM: {
-        verneed_num = dyn->d_un.d_val;
-        break;
-      }
+typedef struct reload_chunk {
+  char* start;
+  struct reload_chunk* next;
+} reload_chunk;
+
+typedef struct {
+  char* name;
+  uint32_t hash;
+  char* stub;
+  void** slot;
+} reload_entry;
+
+typedef struct reload_table {
+  reload_entry* entries;  // open addressing
+  size_t capacity;  // power of two
+  size_t count;
+  reload_chunk* chunks;
+  int refs;  // versions
+  pthread_mutex_t lock;
+} reload_table;
+
+// Read by objsym without locks; never changed after objopen.
+typedef struct reload_redirect {
+  char* addr;
+  char* stub;
+  void** slot;
+} reload_redirect;
+
+static void reload_missing(void) {
+  LOGF(OBJFCN_LOG_ERROR, "function of a closed version called\n");
+  abort();
+}
+
+static size_t addr_hash(const void* addr) {
+  return (size_t)(((uintptr_t)addr >> 2) * 0x9e3779b97f4a7c15ULL >> 16);
+}
+
+static void* reload_redirect_addr(obj_handle* obj, void* addr) {
+  size_t mask = obj->redirect_mask;
+  for (size_t i = addr_hash(addr) & mask; obj->redirects[i].addr;
+       i = (i + 1) & mask) {
+    if (obj->redirects[i].addr == addr) return obj->redirects[i].stub;
+  }
+  return addr;
+}
+
+static int new_reload_chunk(reload_table* table) {
+#if OBJFCN_RELOAD_SUPPORTED
+  size_t ps = page_size();
+  reload_chunk* c = (reload_chunk*)malloc(sizeof(reload_chunk));
+  char* p = alloc_region(2 * ps, ps, PROT_READ | PROT_WRITE);
+  if (!c || !p) {
+    if (p) free_region(p, 2 * ps);
+    free(c);
+    if (!c) sprintf(obj_error, "malloc failed");
+    return 0;
+  }
+  for (size_t i = 0; i < ps / RELOAD_STUB_SIZE; i++) {
+    char* stub = p + i * RELOAD_STUB_SIZE;
+    void** slot = (void**)(p + ps) + i;
+    *slot = (void*)&reload_missing;
+#if defined(__x86_64__)
+    // jmp *slot(%rip)
+    stub[0] = 0xff;
+    stub[1] = 0x25;
+    *(int32_t*)(stub + 2) = (int32_t)((char*)slot - (stub + 6));
+    stub[6] = stub[7] = 0xcc;
+#elif defined(__i386__)
+    // jmp *slot
+    stub[0] = 0xff;
+    stub[1] = 0x25;
+    *(uint32_t*)(stub + 2) = (uint32_t)slot;
+    stub[6] = stub[7] = 0xcc;
+#elif defined(__aarch64__)
+    // ldr x16, slot; br x16
+    uint32_t off = (uint32_t)(((char*)slot - stub) >> 2);
+    ((uint32_t*)stub)[0] = 0x58000010 | ((off & 0x7ffff) << 5);
+    ((uint32_t*)stub)[1] = 0xd61f0200;
+#endif
+  }
+#if defined(__aarch64__)
+  __builtin___clear_cache(p, p + ps);
+#endif
+  if (mprotect(p, ps, PROT_READ | PROT_EXEC) != 0) {
+    sprintf(obj_error, "mprotect failed: %s", strerror(errno));
+    free_region(p, 2 * ps);
+    free(c);
+    return 0;
+  }
+  c->start = p;
+  c->next = table->chunks;
+  table->chunks = c;
+  return 1;
+#else
+  sprintf(obj_error, "OBJFCN_RELOADABLE is not supported on this target");
+  return 0;
+#endif
+}
 
-      }
+// The entry for |name|, with a stub of its own. Called with the table
+// locked.
+static reload_entry* reload_entry_get(reload_table* table, const char* name,
+                                      uint32_t hash) {
+  if (table->count * 2 >= table->capacity) {
+    size_t capacity = table->capacity ? table->capacity * 2 : 256;
+    reload_entry* entries =
+        (reload_entry*)calloc(capacity, sizeof(reload_entry));
+    if (!entries) {
+      sprintf(obj_error, "malloc failed");
+      return NULL;
     }
+    for (size_t i = 0; i < table->capacity; i++) {
+      reload_entry* e = &table->entries[i];
+      if (!e->name) continue;
+      size_t j = e->hash & (capacity - 1);
+      while (entries[j].name) j = (j + 1) & (capacity - 1);
+      entries[j] = *e;
+    }
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+  }
 
-    parse_version(obj, verneed_num);
-
-    assert(rel);
-    relocate_dyn("rel", obj, rel, relsz);
-    relocate_dyn("pltrel", obj, rel + relsz / sizeof(*rel), pltrelsz);
-
-#if defined(__arm__) || defined(__aarch64__)
-    __builtin___clear_cache(obj->base, obj->base + obj->code_size);
-#endif
+  size_t mask = table->capacity - 1;
+  size_t i = hash & mask;
+  for (; table->entries[i].name; i = (i + 1) & mask) {
+    reload_entry* e = &table->entries[i];
+    if (e->hash == hash && !strcmp(e->name, name)) return e;
+  }
 
-    if (init_array) {
-      for (size_t i = 0; i < init_arraysz / sizeof(void*); i++) {
-        LOGF("calling init_array: %p\n", init_array[i]);
-        ((void(*)())(init_array[i]))();
-      }
-    }
+  size_t per_chunk = page_size() / RELOAD_STUB_SIZE;
+  size_t k = table->count % per_chunk;
+  if (k == 0 && !new_reload_chunk(table)) return NULL;
+  reload_entry* e = &table->entries[i];
+  e->name = strdup(name);
+  if (!e->name) {
+    sprintf(obj_error, "malloc failed");
+    return NULL;
   }
-  return 1;
+  e->hash = hash;
+  e->stub = table->chunks->start + k * RELOAD_STUB_SIZE;
+  e->slot = (void**)(table->chunks->start + page_size()) + k;
+  table->count++;
+  return e;
 }
 
-static int load_object(obj_handle* obj, const char* bin, const char* filename) {
-  Elf_Ehdr* ehdr = (Elf_Ehdr*)bin;
-  Elf_Shdr* shdrs = (Elf_Shdr*)(bin + ehdr->e_shoff);
-  //Elf_Shdr* shstrtab = &shdrs[ehdr->e_shstrndx];
-  Elf_Sym* symtab = NULL;
-  int symnum = 0;
-  int strtab_index = -1;
-  const char* strtab = NULL;
-  char* addrs[ehdr->e_shnum];
-
-  for (int i = 0; i < ehdr->e_shnum; i++) {
-    Elf_Shdr* shdr = &shdrs[i];
-    if (shdr->sh_type == SHT_SYMTAB) {
-      symtab = (Elf_Sym*)(bin + shdr->sh_offset);
-      symnum = shdr->sh_size / sizeof(Elf_Sym);
-      strtab_index = shdr->sh_link;
-    }
+static void free_reload_table(reload_table* table) {
+  for (size_t i = 0; i < table->capacity; i++) {
+    free(table->entries[i].name);
   }
+  free(table->entries);
+  for (reload_chunk* c = table->chunks; c;) {
+    reload_chunk* next = c->next;
+    free_region(c->start, 2 * page_size());
+    free(c);
+    c = next;
+  }
+  pthread_mutex_destroy(&table->lock);
+  free(table);
+}
 
-  for (int i = 0; i < ehdr->e_shnum; i++) {
-    Elf_Shdr* shdr = &shdrs[i];
-    if (shdr->sh_type == SHT_STRTAB && i == strtab_index) {
-      strtab = bin + shdr->sh_offset;
-    }
+// Makes |obj| the newest version in |table|, or the first one of a new
+// table if it is NULL. Nothing is redirected unless it succeeds.
+static int reload_attach(obj_handle* obj, reload_table* table) {
+  sym_table* syms = get_sym_table(obj);
+  if (!syms) return 0;
+  size_t n = 0;
+  for (int i = 0; i < syms->count; i++) {
+    n += syms->syms[i].type == STT_FUNC;
+  }
+  size_t capacity = 16;
+  while (capacity < n * 2) capacity *= 2;
+  reload_redirect* redirects =
+      (reload_redirect*)calloc(capacity, sizeof(reload_redirect));
+  int created = !table;
+  if (created) {
+    table = (reload_table*)calloc(1, sizeof(reload_table));
+    if (table) pthread_mutex_init(&table->lock, NULL);
+  }
+  if (!redirects || !table) {
+    free(redirects);
+    if (created) free(table);
+    sprintf(obj_error, "malloc failed");
+    return 0;
   }
 
-#if OBJFCN_SPLIT_ALLOC
-  {
-    size_t expected_code_size = 0;
-    for (int i = 0; i < ehdr->e_shnum; i++) {
-      Elf_Shdr* shdr = &shdrs[i];
-      if (should_load(shdr)) {
-        expected_code_size += shdr->sh_size;
-        expected_code_size = align_up(expected_code_size, 16);
-      }
+  size_t mask = capacity - 1;
+  pthread_mutex_lock(&table->lock);
+  for (int i = 0; i < syms->count; i++) {
+    obj_symbol_info* sym = &syms->syms[i];
+    if (sym->type != STT_FUNC) continue;
+    size_t j = addr_hash(sym->addr) & mask;
+    while (redirects[j].addr && redirects[j].addr != sym->addr) {
+      j = (j + 1) & mask;
     }
-    size_t reloc_code_size = relocate(obj, bin, symtab, strtab, addrs,
-                                      1 /* code_size_only */);
-    if (reloc_code_size == (size_t)-1) {
+    if (redirects[j].addr) continue;  // an alias
+    reload_entry* e = reload_entry_get(table, sym->name,
+                                       gnu_hash_calc(sym->name));
+    if (!e) {
+      pthread_mutex_unlock(&table->lock);
+      free(redirects);
+      if (created) free_reload_table(table);
       return 0;
     }
-    expected_code_size += reloc_code_size;
-
-    obj->code_size = align_up(expected_code_size, 4096);
-    obj->code = (char*)mmap(NULL, obj->code_size,
-                            PROT_READ | PROT_WRITE | PROT_EXEC,
-                            MAP_PRIVATE | MAP_ANONYMOUS,
-                            -1, 0);
-    if (obj->code == MAP_FAILED) {
-      sprintf(obj_error, "mmap failed: %s", strerror(errno));
-      return 0;
+    redirects[j].addr = (char*)sym->addr;
+    redirects[j].stub = e->stub;
+    redirects[j].slot = e->slot;
+  }
+  for (size_t j = 0; j < capacity; j++) {
+    if (redirects[j].addr) {
+      __atomic_store_n(redirects[j].slot, redirects[j].addr,
+                       __ATOMIC_RELEASE);
     }
+  }
+  table->refs++;
+  pthread_mutex_unlock(&table->lock);
+  obj->reload = table;
+  obj->redirects = redirects;
+  obj->redirect_mask = mask;
+  return 1;
+}
 
-#if 0
-    fprintf(stderr, "%p-%p (+%zx) %s\n",
-            obj->code, obj->code + obj->code_size,
-            expected_code_size, filename);
-#endif
-#if OBJFCN_LOG
-    {
-      char buf[256];
-      FILE* log_fp;
-      sprintf(buf, "/tmp/objfcn.%d.log", getpid());
-      log_fp = fopen(buf, "ab");
-      fprintf(log_fp, "objopen %p-%p (+%zx) %s\n",
-              obj->code, obj->code + obj->code_size,
-              expected_code_size, filename);
-      fclose(log_fp);
+// Points the stubs still calling into |obj| at reload_missing.
+static void reload_detach(obj_handle* obj) {
+  reload_table* table = obj->reload;
+  if (!table) return;
+  pthread_mutex_lock(&table->lock);
+  for (size_t j = 0; j <= obj->redirect_mask; j++) {
+    reload_redirect* r = &obj->redirects[j];
+    void* expected = r->addr;
+    if (r->addr) {
+      __atomic_compare_exchange_n(r->slot, &expected,
+                                  (void*)&reload_missing, 0,
+                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED);
     }
-#endif
   }
+  int last = --table->refs == 0;
+  pthread_mutex_unlock(&table->lock);
+  if (last) free_reload_table(table);
+  free(obj->redirects);
+  obj->reload = NULL;
+  obj->redirects = NULL;
+}
 
-#endif
+// Publishes the symbols of |obj| into the global namespace.
+static int global_publish(obj_handle* obj) {
+  sym_table* table = get_sym_table(obj);
+  if (!table) return 0;
+  global_sym* syms = (global_sym*)calloc(table->count + 1, sizeof(global_sym));
+  if (!syms) {
+    sprintf(obj_error, "malloc failed");
+    return 0;
+  }
+  int n = 0;
+  for (int i = 0; i < table->count; i++) {
+    if (table->syms[i].type == STT_TLS) continue;
+    syms[n].name = table->syms[i].name;
+    syms[n].hash = gnu_hash_calc(syms[n].name);
+    syms[n].addr = table->syms[i].addr;
+    if (obj->redirects) {
+      syms[n].addr = reload_redirect_addr(obj, syms[n].addr);
+    }
+    n++;
+  }
 
-  memset(addrs, 0, sizeof(addrs));
-  for (int i = 0; i < ehdr->e_shnum; i++) {
-    Elf_Shdr* shdr = &shdrs[i];
-    if (should_load(shdr)) {
-      addrs[i] = alloc_code(obj, shdr->sh_size);
-      align_code(obj, 16);
-      if (shdr->sh_type != SHT_NOBITS) {
-        memcpy(addrs[i], bin + shdr->sh_offset, shdr->sh_size);
+  pthread_rwlock_wrlock(&global_lock);
+  if (global_count + n > global_nbuckets) {
+    size_t nbuckets = global_nbuckets ? global_nbuckets : 256;
+    while (nbuckets < global_count + n) nbuckets *= 2;
+    global_sym** buckets = (global_sym**)calloc(nbuckets, sizeof(global_sym*));
+    if (!buckets) {
+      pthread_rwlock_unlock(&global_lock);
+      free(syms);
+      sprintf(obj_error, "malloc failed");
+      return 0;
+    }
+    global_sym** old = global_buckets;
+    size_t old_nbuckets = global_nbuckets;
+    global_buckets = buckets;
+    global_nbuckets = nbuckets;
+    for (size_t b = 0; b < old_nbuckets; b++) {
+      for (global_sym* g = old[b]; g;) {
+        global_sym* next = g->next;
+        global_append(g);
+        g = next;
       }
     }
+    free(old);
+  }
+  for (int i = 0; i < n; i++) {
+    global_append(&syms[i]);
   }
+  __atomic_store_n(&global_count, global_count + n, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&global_lock);
 
-  for (int i = 0; i < symnum; i++) {
-    Elf_Sym* sym = &symtab[i];
-    if (ELFW_ST_TYPE(sym->st_info) == STT_OBJECT ||
-        ELFW_ST_TYPE(sym->st_info) == STT_FUNC) {
-      obj->num_symbols++;
-    }
+  obj->global_syms = syms;
+  obj->num_global_syms = n;
+  return 1;
+}
+
+static void global_unpublish(obj_handle* obj) {
+  if (!obj->global_syms) return;
+  pthread_rwlock_wrlock(&global_lock);
+  for (int i = 0; i < obj->num_global_syms; i++) {
+    global_sym* g = &obj->global_syms[i];
+    global_sym** p = &global_buckets[g->hash & (global_nbuckets - 1)];
+    while (*p != g) p = &(*p)->next;
+    *p = g->next;
   }
-  obj->symbols = (symbol*)malloc(sizeof(symbol) * obj->num_symbols);
-  for (int i = 0, ns = 0; i < symnum; i++) {
-    Elf_Sym* sym = &symtab[i];
-    if (ELFW_ST_TYPE(sym->st_info) == STT_OBJECT ||
-        ELFW_ST_TYPE(sym->st_info) == STT_FUNC) {
-      const char* name = strtab + sym->st_name;
-      char* addr = addrs[sym->st_shndx] + sym->st_value;
-      // Write back so we can use the address later.
-      sym->st_value = (Elf_Addr)addr;
-      //fprintf(stderr, "%s => %p\n", name, addr);
-      obj->symbols[ns].name = strdup(name);
-      obj->symbols[ns].addr = addr;
-      ns++;
-    }
+  __atomic_store_n(&global_count, global_count - obj->num_global_syms,
+                   __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&global_lock);
+  free(obj->global_syms);
+  obj->global_syms = NULL;
+}
+
+// Runs the constructors of a fully loaded handle. Relocatable objects
+// are saved to the image cache before this, so no constructor's effect
+// ends up in a cached image.
+static void run_init(obj_handle* obj) {
+  live_insert(obj);
+  obj->initialized = 1;
+  uint64_t start = obj->stats ? stat_now() : 0;
+  for (int i = 0; i < obj->num_init; i++) {
+    LOGF(OBJFCN_LOG_INFO, "calling init: %p\n", obj->init_funcs[i]);
+    ((void(*)())(obj->init_funcs[i]))();
   }
+  if (obj->stats) obj->stats->init_ns += stat_now() - start;
+}
 
-  if (relocate(obj, bin, symtab, strtab, addrs, 0 /* code_size_only */) ==
-      (size_t)-1) {
-    return 0;
+// Runs the destructors of |obj|: thread_local ones of this thread, the
+// fini functions, then those registered with __cxa_atexit. The
+// __cxa_atexit ones of a shared object are run by its own fini array,
+// which calls __cxa_finalize with its __dso_handle.
+static void run_fini(obj_handle* obj) {
+  if (!obj->initialized) return;
+  live_remove(obj);
+  run_thread_dtors(obj);
+  for (int i = obj->num_fini - 1; i >= 0; i--) {
+    LOGF(OBJFCN_LOG_INFO, "calling fini: %p\n", obj->fini_funcs[i]);
+    ((void(*)())(obj->fini_funcs[i]))();
   }
+  if (obj->dso_handle && __cxa_finalize) {
+    __cxa_finalize(obj->dso_handle);
+  }
+  obj->initialized = 0;
+}
 
-#if defined(__arm__) || defined(__aarch64__)
-  __builtin___clear_cache(obj->code, obj->code + obj->code_size);
-#endif
+// objopen, adding the handle to |reload| with OBJFCN_RELOADABLE. The
+// object is read from |given| instead of |filename| unless it is NULL;
+// only objects read by name go through the image cache.
+static int within(size_t size, uint64_t offset, uint64_t len) {
+  return offset <= size && len <= size - offset;
+}
 
+// Checks that the header tables, and the sections and segments they
+// describe, lie within the |size| bytes of |bin|, so a truncated or
+// corrupt image fails to load rather than being read past its end.
+static int check_extents(const char* bin, size_t size, const char* name) {
+  Elf_Ehdr* ehdr = (Elf_Ehdr*)bin;
+  if (ehdr->e_ident[EI_CLASS] !=
+          (__SIZEOF_POINTER__ == 8 ? ELFCLASS64 : ELFCLASS32) ||
+      !within(size, ehdr->e_shoff,
+              (uint64_t)ehdr->e_shnum * sizeof(Elf_Shdr)) ||
+      !within(size, ehdr->e_phoff,
+              (uint64_t)ehdr->e_phnum * sizeof(Elf_Phdr)) ||
+      (ehdr->e_shnum && ehdr->e_shstrndx >= ehdr->e_shnum)) {
+    snprintf(obj_error, sizeof(obj_error), "%.200s: bad ELF header", name);
+    return 0;
+  }
+  Elf_Shdr* shdrs = (Elf_Shdr*)(bin + ehdr->e_shoff);
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    Elf_Shdr* shdr = &shdrs[i];
+    int is_rel = shdr->sh_type == SHT_REL || shdr->sh_type == SHT_RELA;
+    if ((shdr->sh_type != SHT_NOBITS &&
+         !within(size, shdr->sh_offset, shdr->sh_size)) ||
+        shdr->sh_link >= ehdr->e_shnum ||
+        (is_rel && shdr->sh_info >= ehdr->e_shnum)) {
+      snprintf(obj_error, sizeof(obj_error),
+               "%.200s: section %d is truncated", name, i);
+      return 0;
+    }
+  }
+  Elf_Phdr* phdrs = (Elf_Phdr*)(bin + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    Elf_Phdr* phdr = &phdrs[i];
+    if (!within(size, phdr->p_offset, phdr->p_filesz)) {
+      snprintf(obj_error, sizeof(obj_error),
+               "%.200s: segment %d is truncated", name, i);
+      return 0;
+    }
+  }
   return 1;
 }
 
-void* objopen(const char* filename, int flags) {
-  char* bin = NULL;
+static void* open_object(const char* filename, int flags,
+                         reload_table* reload, obj_input* given) {
+  obj_input in;
   obj_handle* obj = NULL;
   Elf_Ehdr* ehdr = NULL;
 
+  pthread_once(&init_once, init);
 #if !OBJFCN_SPLIT_ALLOC
-  if (!code) {
-    init();
-  }
-  if (code == MAP_FAILED) {
+  if (arena == MAP_FAILED) {
+    sprintf(obj_error, "mmap failed");
+    if (given) free_input(given);
     return NULL;
   }
 #endif
 
-  bin = read_file(filename);
-  if (bin == NULL) {
+  uint64_t start = flags & OBJFCN_STATS ? stat_now() : 0;
+  if (given) {
+    in = *given;
+  } else if (!read_file(filename, flags, &in)) {
     return NULL;
   }
 
   obj = (obj_handle*)malloc(sizeof(obj_handle));
   if (obj == NULL) {
     sprintf(obj_error, "malloc failed");
-    free(bin);
+    free_input(&in);
     return NULL;
   }
   memset(obj, 0, sizeof(*obj));
+  obj->flags = flags;
+  obj->filename = strdup(filename);
 
-  ehdr = (Elf_Ehdr*)bin;
+  ehdr = (Elf_Ehdr*)in.bin;
   if (memcmp(ehdr->e_ident, ELFMAG, 4)) {
     sprintf(obj_error, "%s is not ELF", filename);
-    free(bin);
+    free_input(&in);
+    free(obj->filename);
+    free(obj);
+    return NULL;
+  }
+
+  if (!check_extents(in.bin, in.size, filename)) {
+    free_input(&in);
+    free(obj->filename);
     free(obj);
     return NULL;
   }
 
-  // TODO: more validation.
+  if (!stat_begin(obj, start ? stat_now() - start : 0)) {
+    free_input(&in);
+    objclose(obj);
+    return NULL;
+  }
 
-  if (ehdr->e_type == ET_DYN) {
-    if (load_object_dyn(obj, bin, filename)) {
-      free(bin);
-      return obj;
-    }
+  sym_cache cache;
+  memset(&cache, 0, sizeof(cache));
+  obj->resolve_cache = &cache;
+
+  int ok = 0;
+  int cached = 0;
+  fixup_log log;
+  memset(&log, 0, sizeof(log));
+#if OBJFCN_CACHE_SUPPORTED
+  cache_key key;
+  char* cache_file = NULL;
+  if (ehdr->e_type != ET_DYN && !given) {
+    cache_file = cache_path(filename, flags, &key);
+  }
+  if (cache_file && cache_load(obj, cache_file, &key)) {
+    LOGF(OBJFCN_LOG_INFO, "loaded %s from %s\n", filename, cache_file);
+    ok = cached = 1;
+    if (obj->stats) obj->stats->cached = 1;
+  }
+#endif
+  if (cached) {
+  } else if (ehdr->e_type == ET_DYN) {
+    ok = load_object_dyn(obj, &in, filename);
   } else {
-    if (load_object(obj, bin, filename)) {
-      free(bin);
-      return obj;
+#if OBJFCN_CACHE_SUPPORTED
+    ok = load_object(obj, in.bin, cache_file ? &log : NULL);
+    if (ok && cache_file && !log.failed) {
+      cache_save(obj, cache_file, &key, &log);
     }
+#else
+    ok = load_object(obj, in.bin, NULL);
+#endif
   }
 
-  free(bin);
+  obj->resolve_cache = NULL;
+  sym_cache_clear(&cache);
+  free_input(&in);
+  free_fixup_log(&log);
+#if OBJFCN_CACHE_SUPPORTED
+  free(cache_file);
+#endif
+  if (ok) {
+    run_init(obj);
+  }
+  if (ok && (flags & OBJFCN_RELOADABLE)) {
+    ok = reload_attach(obj, reload);
+  }
+  if (ok && (flags & OBJFCN_GLOBAL)) {
+    ok = global_publish(obj);
+  }
+  if (ok) {
+    stat_finish(obj, start);
+    log_map("objopen", obj);
+    return obj;
+  }
   objclose(obj);
   return NULL;
 }
 
+void* objopen(const char* filename, int flags) {
+  return open_object(filename, flags, NULL, NULL);
+}
+
+void* objopen_mem(const void* buf, size_t size, const char* name,
+                  int flags) {
+  obj_input in;
+  if (!name) name = "<memory>";
+  memset(&in, 0, sizeof(in));
+  in.fd = -1;
+  in.size = size;
+  if (size < sizeof(Elf_Ehdr)) {
+    snprintf(obj_error, sizeof(obj_error), "%.200s is too small to be ELF",
+             name);
+    return NULL;
+  }
+  if ((uintptr_t)buf % sizeof(void*)) {
+    // The headers are read in place.
+    in.bin = (char*)malloc(size);
+    if (!in.bin) {
+      sprintf(obj_error, "malloc failed");
+      return NULL;
+    }
+    memcpy(in.bin, buf, size);
+  } else {
+    in.bin = (char*)buf;
+    in.borrowed = 1;
+  }
+  return open_object(name, flags, NULL, &in);
+}
+
+void* objopen_fd(int fd, const char* name, int flags) {
+  obj_input in;
+  if (!name) name = "<fd>";
+  pthread_once(&init_once, init);
+  if (!read_fd(fd, name, flags, &in)) {
+    return NULL;
+  }
+  return open_object(name, flags, NULL, &in);
+}
+
+void* objreload(void* handle, const char* filename) {
+  obj_handle* obj = (obj_handle*)handle;
+  if (!obj->reload) {
+    snprintf(obj_error, sizeof(obj_error),
+             "%.200s: not opened with OBJFCN_RELOADABLE", obj->filename);
+    return NULL;
+  }
+  void* next = open_object(filename, obj->flags, obj->reload, NULL);
+  if (next) {
+    LOGF(OBJFCN_LOG_INFO, "reloaded %s from %s\n", obj->filename,
+         filename);
+  }
+  return next;
+}
+
+#define OBJFCN_READ_THREADS 8
+
+typedef struct {
+  const char* filename;
+  int flags;
+  obj_input in;
+  int read_ok;
+  int failed;
+  uint64_t read_ns;  // with OBJFCN_STATS
+  char error[sizeof(obj_error)];
+} batch_input;
+
+static int read_batch_input(void* arg, size_t i) {
+  batch_input* b = &((batch_input*)arg)[i];
+  uint64_t start = b->flags & OBJFCN_STATS ? stat_now() : 0;
+  b->read_ok = read_file(b->filename, b->flags, &b->in);
+  if (start) b->read_ns = stat_now() - start;
+  if (b->read_ok && memcmp(((Elf_Ehdr*)b->in.bin)->e_ident, ELFMAG, 4)) {
+    sprintf(obj_error, "%s is not ELF", b->filename);
+    free_input(&b->in);
+    b->read_ok = 0;
+  }
+  if (!b->read_ok) {
+    memcpy(b->error, obj_error, sizeof(b->error));
+    b->failed = 1;
+  }
+  return 1;
+}
+
+static void batch_fail(batch_input* inputs, obj_batch* batch, int i) {
+  memcpy(inputs[i].error, obj_error, sizeof(inputs[i].error));
+  inputs[i].failed = 1;
+  batch->objs[i] = NULL;
+}
+
+// Runs the constructors of member |i| after those of the members it
+// binds to. A cycle is broken where it closes.
+static void batch_init(obj_batch* batch, uint8_t* visited, int i) {
+  if (visited[i]) return;
+  visited[i] = 1;
+  for (int j = 0; j < batch->count; j++) {
+    if (batch->deps[i * batch->count + j]) batch_init(batch, visited, j);
+  }
+  if (batch->objs[i]) run_init(batch->objs[i]);
+}
+
+void** objopen_many(const char* const* filenames, int count, int flags,
+                    char** errors) {
+  int prot = (flags & OBJFCN_WX ? PROT_READ | PROT_WRITE :
+              PROT_READ | PROT_WRITE | PROT_EXEC);
+  void** handles = (void**)calloc(count + 1, sizeof(void*));
+  batch_input* inputs = (batch_input*)calloc(count + 1, sizeof(batch_input));
+  obj_handle** objs = (obj_handle**)calloc(count + 1, sizeof(obj_handle*));
+  rel_loader* loaders = (rel_loader*)calloc(count + 1, sizeof(rel_loader));
+  size_t* plans = (size_t*)calloc(count * (NUM_SEGS + 2) + 1,
+                                  sizeof(size_t));
+  obj_batch batch;
+  sym_cache cache;
+  obj_chunk* chunk = NULL;
+  size_t total = 0;
+  size_t chunk_align = 16;
+
+  pthread_once(&init_once, init);
+  uint64_t start = flags & OBJFCN_STATS ? stat_now() : 0;
+  memset(&batch, 0, sizeof(batch));
+  memset(&cache, 0, sizeof(cache));
+  batch.objs = (obj_handle**)calloc(count + 1, sizeof(obj_handle*));
+  batch.count = count;
+  batch.deps = (uint8_t*)calloc((size_t)count * count + 1, 1);
+  uint8_t* visited = (uint8_t*)calloc(count + 1, 1);
+  if (!handles || !inputs || !objs || !loaders || !plans || !batch.objs ||
+      !batch.deps || !visited) {
+    sprintf(obj_error, "malloc failed");
+    free(handles);
+    handles = NULL;
+    goto out;
+  }
+
+  for (int i = 0; i < count; i++) {
+    inputs[i].filename = filenames[i];
+    inputs[i].flags = flags;
+  }
+  run_parallel(read_batch_input, inputs, count, OBJFCN_READ_THREADS);
+
+  // Shared objects are loaded right away; the relocatable ones can bind
+  // to them but not the other way around.
+  for (int i = 0; i < count; i++) {
+    if (inputs[i].failed) continue;
+#if !OBJFCN_SPLIT_ALLOC
+    if (arena == MAP_FAILED) {
+      sprintf(obj_error, "mmap failed");
+      batch_fail(inputs, &batch, i);
+      continue;
+    }
+#endif
+    obj_handle* obj = (obj_handle*)calloc(1, sizeof(obj_handle));
+    if (obj == NULL) {
+      sprintf(obj_error, "malloc failed");
+      batch_fail(inputs, &batch, i);
+      continue;
+    }
+    obj->flags = flags;
+    obj->filename = strdup(filenames[i]);
+    obj->resolve_cache = &cache;
+    obj->batch_index = i;
+    objs[i] = obj;
+    if (!stat_begin(obj, inputs[i].read_ns)) {
+      batch_fail(inputs, &batch, i);
+      continue;
+    }
+
+    if (((Elf_Ehdr*)inputs[i].in.bin)->e_type == ET_DYN) {
+      if (load_object_dyn(obj, &inputs[i].in, filenames[i])) {
+        batch.objs[i] = obj;
+      } else {
+        batch_fail(inputs, &batch, i);
+      }
+    } else if (!rel_prepare(&loaders[i], obj, inputs[i].in.bin)) {
+      batch_fail(inputs, &batch, i);
+    }
+  }
+
+  // Lay out all relocatable objects in one region. plans holds the
+  // segment offsets, the offset in the region and the size of each.
+  for (int i = 0; i < count; i++) {
+    if (inputs[i].failed || objs[i]->is_dyn) continue;
+    size_t* plan = &plans[i * (NUM_SEGS + 2)];
+    size_t region_align;
+    size_t size = plan_segs(objs[i], loaders[i].seg_size,
+                            loaders[i].seg_align, plan, &region_align);
+    if (chunk_align < region_align) chunk_align = region_align;
+    total = align_up(total, region_align);
+    plan[NUM_SEGS] = total;
+    plan[NUM_SEGS + 1] =
+        align_up(size, flags & OBJFCN_WX ? page_size() : 16);
+    total += plan[NUM_SEGS + 1];
+  }
+  if (total) {
+    total = align_up(total, page_size());
+    chunk = (obj_chunk*)malloc(sizeof(obj_chunk));
+    if (chunk) {
+      chunk->size = total;
+      chunk->refs = 0;
+      chunk->start = alloc_region(total, chunk_align, prot);
+      if (!chunk->start) {
+        free(chunk);
+        chunk = NULL;
+      }
+    } else {
+      sprintf(obj_error, "malloc failed");
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    if (inputs[i].failed || objs[i]->is_dyn) continue;
+    size_t* plan = &plans[i * (NUM_SEGS + 2)];
+    if (!chunk ||
+        !place_segs(objs[i], chunk->start + plan[NUM_SEGS],
+                    plan[NUM_SEGS + 1], loaders[i].seg_size,
+                    loaders[i].seg_align, plan)) {
+      batch_fail(inputs, &batch, i);
+      continue;
+    }
+    objs[i]->chunk = chunk;
+    chunk->refs++;
+    if (rel_place(&loaders[i])) {
+      batch.objs[i] = objs[i];
+    } else {
+      batch_fail(inputs, &batch, i);
+    }
+  }
+  if (chunk && chunk->refs == 0) {
+    free_region(chunk->start, chunk->size);
+    free(chunk);
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (inputs[i].failed || objs[i]->is_dyn) continue;
+    objs[i]->batch = &batch;
+    if (!rel_link(&loaders[i])) {
+      batch_fail(inputs, &batch, i);
+    }
+    objs[i]->batch = NULL;
+  }
+
+  // Objects bound to a member which failed later fail as well.
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (int i = 0; i < count; i++) {
+      if (inputs[i].failed) continue;
+      for (int j = 0; j < count; j++) {
+        if (batch.deps[i * count + j] && inputs[j].failed) {
+          snprintf(obj_error, sizeof(obj_error),
+                   "%s: depends on %s which failed to load",
+                   filenames[i], filenames[j]);
+          batch_fail(inputs, &batch, i);
+          changed = 1;
+          break;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    rel_free(&loaders[i]);
+    if (inputs[i].read_ok) {
+      free_input(&inputs[i].in);
+    }
+    if (objs[i]) {
+      objs[i]->resolve_cache = NULL;
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    batch_init(&batch, visited, i);
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (objs[i]) {
+      if (!inputs[i].failed && (flags & OBJFCN_RELOADABLE) &&
+          !reload_attach(objs[i], NULL)) {
+        memcpy(inputs[i].error, obj_error, sizeof(inputs[i].error));
+        inputs[i].failed = 1;
+      }
+      if (!inputs[i].failed && (flags & OBJFCN_GLOBAL) &&
+          !global_publish(objs[i])) {
+        memcpy(inputs[i].error, obj_error, sizeof(inputs[i].error));
+        inputs[i].failed = 1;
+      }
+      if (inputs[i].failed) {
+        objclose(objs[i]);
+      } else {
+        stat_finish(objs[i], start);
+        log_map("objopen", objs[i]);
+        handles[i] = objs[i];
+      }
+    }
+    if (errors) {
+      errors[i] = inputs[i].failed ? strdup(inputs[i].error) : NULL;
+    }
+  }
+
+out:
+  sym_cache_clear(&cache);
+  free(inputs);
+  free(objs);
+  free(loaders);
+  free(plans);
+  free(batch.objs);
+  free(batch.deps);
+  free(visited);
+  return handles;
+}
+
 int objclose(void* handle) {
   obj_handle* obj = (obj_handle*)handle;
+  global_unpublish(obj);
+  reload_detach(obj);
+  run_fini(obj);
   if (obj->code) {
-#if OBJFCN_LOG
-    char buf[256];
-    FILE* log_fp;
-    sprintf(buf, "/tmp/objfcn.%d.log", getpid());
-    log_fp = fopen(buf, "ab");
-    fprintf(log_fp, "objclose %p-%p\n",
-            obj->code, obj->code + obj->code_size);
-    fclose(log_fp);
-#endif
-    munmap(obj->code, obj->code_size);
+    log_map("objclose", obj);
+    if (obj->chunk) {
+      release_chunk(obj->chunk);
+    } else {
+      free_region(obj->code, obj->code_size);
+    }
+  }
+  if (obj->huge_text) {
+    free_huge_text(obj->huge_text);
   }
+  tls_unregister(obj);
   for (int i = 0; i < obj->num_symbols; i++) {
     free(obj->symbols[i].name);
   }
+  free(obj->symbols);
+  free(obj->index.bloom);
+  free(obj->index.buckets);
+  free(obj->index.hashvals);
+  if (obj->sorted_syms) {
+    free(obj->sorted_syms->syms);
+    free(obj->sorted_syms);
+  }
   free(obj->verstrs);
+  free(obj->filename);
+  for (int i = 0; i < obj->num_needed; i++) {
+    release_needed(obj->needed[i]);
+  }
+  free(obj->needed);
+  free(obj->deps);
+  free(obj->stats);
+  free(obj->init_funcs);
+  free(obj->fini_funcs);
   free(obj);
   return 0;
 }
 
+int objstat(void* handle, obj_stats* stats) {
+  if (!handle) {
+    pthread_mutex_lock(&stats_lock);
+    *stats = total_stats;
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+  }
+  obj_handle* obj = (obj_handle*)handle;
+  if (!obj->stats) {
+    memset(stats, 0, sizeof(*stats));
+    sprintf(obj_error, "loaded without OBJFCN_STATS");
+    return -1;
+  }
+  *stats = *obj->stats;
+  return 0;
+}
+
 void* objsym(void* handle, const char* symbol) {
   obj_handle* obj = (obj_handle*)handle;
+  void* addr;
   if (obj->is_dyn) {
-    return objsym_dyn(obj, symbol);
+    addr = objsym_dyn(obj, symbol);
+  } else {
+    addr = objsym_rel(obj, symbol);
   }
+  if (obj->redirects && addr) {
+    return reload_redirect_addr(obj, addr);
+  }
+  return addr;
+}
 
-  for (int i = 0; i < obj->num_symbols; i++) {
-    if (!strcmp(obj->symbols[i].name, symbol)) {
-      return obj->symbols[i].addr;
+int objsym_foreach(void* handle, obj_symbol_callback cb, void* arg) {
+  return objsym_prefix(handle, "", cb, arg);
+}
+
+int objsym_prefix(void* handle, const char* prefix, obj_symbol_callback cb,
+                  void* arg) {
+  sym_table* table = get_sym_table((obj_handle*)handle);
+  if (!table) return -1;
+  size_t len = strlen(prefix);
+  int lo = 0, hi = table->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (strcmp(table->syms[mid].name, prefix) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
   }
-  return NULL;
+  for (int i = lo; i < table->count; i++) {
+    if (strncmp(table->syms[i].name, prefix, len)) break;
+    int r = cb(&table->syms[i], arg);
+    if (r) return r;
+  }
+  return 0;
+}
+
+uint32_t objsym_hash(const char* symbol) {
+  return gnu_hash_calc(symbol);
+}
+
+// Names are looked up OBJFCN_SYM_BATCH at a time. Each step of the hash
+// lookup is done for the whole group, prefetching what the next step of
+// every name reads, so the cache misses of different names overlap.
+#define OBJFCN_SYM_BATCH 32
+
+int objsym_batch(void* handle, const char* const* symbols,
+                 const uint32_t* hashes, int count, void** addrs) {
+  obj_handle* obj = (obj_handle*)handle;
+  const Elf_Addr* bloom;
+  uint32_t maskwords, shift2, nbuckets, bias;
+  const uint32_t* buckets;
+  const uint32_t* hashvals;
+  int found = 0;
+
+  if (obj->is_dyn && !obj->gnu_hash) {
+    for (int i = 0; i < count; i++) {
+      addrs[i] = objsym_dyn_elf_hash(obj, symbols[i]);
+      found += addrs[i] != NULL;
+    }
+    return found;
+  }
+  if (obj->is_dyn) {
+    Elf_GnuHash* gnu_hash = obj->gnu_hash;
+    bloom = gnu_hash_bloom_filter(gnu_hash);
+    maskwords = gnu_hash->maskwords;
+    shift2 = gnu_hash->shift2;
+    nbuckets = gnu_hash->nbuckets;
+    buckets = gnu_hash_buckets(gnu_hash);
+    hashvals = gnu_hash_hashvals(gnu_hash);
+    bias = gnu_hash->symndx;
+  } else {
+    if (!obj->num_exported) {
+      memset(addrs, 0, sizeof(void*) * count);
+      return 0;
+    }
+    bloom = obj->index.bloom;
+    maskwords = obj->index.maskwords;
+    shift2 = obj->index.shift2;
+    nbuckets = obj->index.nbuckets;
+    buckets = obj->index.buckets;
+    hashvals = obj->index.hashvals;
+    bias = 1;  // buckets hold the symbol + 1
+  }
+
+  for (int start = 0; start < count; start += OBJFCN_SYM_BATCH) {
+    int n = count - start;
+    if (n > OBJFCN_SYM_BATCH) n = OBJFCN_SYM_BATCH;
+    const char* const* names = symbols + start;
+    void** out = addrs + start;
+    uint32_t h[OBJFCN_SYM_BATCH];
+    uint32_t first[OBJFCN_SYM_BATCH];
+
+    for (int i = 0; i < n; i++) {
+      h[i] = hashes ? hashes[start + i] : gnu_hash_calc(names[i]);
+      __builtin_prefetch(&bloom[(h[i] / BLOOM_BITS) & (maskwords - 1)]);
+    }
+    for (int i = 0; i < n; i++) {
+      first[i] = 0;
+      if (gnu_hash_bloom_test(bloom, maskwords, shift2, h[i])) {
+        // Not 0, which would look like an empty bucket.
+        first[i] = h[i] % nbuckets + 1;
+        __builtin_prefetch(&buckets[first[i] - 1]);
+      }
+    }
+    for (int i = 0; i < n; i++) {
+      if (!first[i]) continue;
+      first[i] = buckets[first[i] - 1];
+      if (!first[i]) continue;
+      __builtin_prefetch(&hashvals[first[i] - bias]);
+      if (obj->is_dyn) {
+        __builtin_prefetch(&obj->symtab[first[i]]);
+      } else {
+        __builtin_prefetch(&obj->symbols[first[i] - 1]);
+      }
+    }
+    for (int i = 0; i < n; i++) {
+      out[i] = NULL;
+      if (!first[i]) continue;
+      for (uint32_t k = first[i];; k++) {
+        uint32_t h2 = hashvals[k - bias];
+        if ((h[i] & ~1) == (h2 & ~1)) {
+          if (obj->is_dyn) {
+            Elf_Sym* sym = &obj->symtab[k];
+            if (!strcmp(names[i], obj->strtab + sym->st_name) &&
+                is_defined(sym)) {
+              out[i] = obj->base + sym->st_value;
+              break;
+            }
+          } else if (!strcmp(names[i], obj->symbols[k - 1].name)) {
+            out[i] = obj->symbols[k - 1].addr;
+            break;
+          }
+        }
+        if (h2 & 1) break;
+      }
+      if (out[i] && obj->redirects) {
+        out[i] = reload_redirect_addr(obj, out[i]);
+      }
+      found += out[i] != NULL;
+    }
+  }
+  return found;
 }
 
 char* objerror(void) {
@@ -1,12 +1,231 @@
 #ifndef RUBY_OBJFCN_H
 #define RUBY_OBJFCN_H 1
 
+#include <stddef.h>
+#include <stdint.h>
+
+/* Flags for objopen. */
+
+/* Map PT_LOAD segments of shared objects from the file instead of
+ * copying them, so read-only pages are shared with the page cache. */
+#define OBJFCN_MAP_SEGMENTS 0x1
+
+/* Keep symbols resolved from the host in a cache shared by all objopen
+ * calls with this flag. Each objopen caches its own lookups regardless. */
+#define OBJFCN_SHARED_SYMBOL_CACHE 0x2
+
+/* Never map code writable and executable at once. Text, rodata and data
+ * are relocated while RW and then mprotected to RX, R and RW; GOT slots
+ * and PT_GNU_RELRO become read-only. */
+#define OBJFCN_WX 0x4
+
+/* Back text with 2MB pages. Text of relocatable objects loaded with this
+ * flag is packed together into huge page blocks; shared objects are
+ * aligned to 2MB and their executable segments madvised. The text of a
+ * closed object is not reused until the rest of its block is closed
+ * too. With OBJFCN_WX each object gets a block of its own. */
+#define OBJFCN_HUGE_TEXT 0x8
+
+/* Loads |count| objects at once. The files are read concurrently and
+ * the relocatable objects share one allocation, which goes back to the
+ * arena once all of them are closed. Undefined symbols of relocatable
+ * objects are looked up in the other objects of the batch before the
+ * host; shared objects are loaded first and do not see the others.
+ * Returns a malloc'ed array of |count| handles, NULL for files which
+ * failed, or NULL if the array itself could not be allocated. Unless
+ * |errors| is NULL, errors[i] gets a malloc'ed message for each failed
+ * file and NULL for the others. An object bound to a failed one fails
+ * too. Close each handle with objclose. */
+void** objopen_many(const char* const* filenames, int count, int flags,
+                    char** errors);
+
+/* Directory to keep relocated images of relocatable objects in, or
+ * NULL, the default, for no cache. An object found there is mapped and
+ * only the slots depending on load addresses are patched. Entries are
+ * keyed by the file's inode, size and mtime, the objopen flags and the
+ * build IDs of the loaded modules. Not used with OBJFCN_HUGE_TEXT, for
+ * shared objects or outside x86-64. The OBJFCN_CACHE_DIR environment
+ * variable sets it too. */
+void objcache_set_dir(const char* dir);
+
+/* Number of threads applying relocations of large objects; 1, the
+ * default, relocates on the calling thread only. The result does not
+ * depend on it. OBJFCN_RELOC_THREADS in the environment sets it too. */
+void objreloc_set_threads(int threads);
+
+/* Bind PLT slots of shared objects on their first call, like
+ * RTLD_LAZY, instead of at objopen. Only on x86-64, and not for objects
+ * linked with -z now. */
+#define OBJFCN_LAZY 0x10
+
+/* Make the global symbols of the object visible to objects loaded
+ * after it, like RTLD_GLOBAL. Undefined symbols without a version are
+ * looked up among such objects, in load order, before the host. Close
+ * the objects bound to one before closing it. */
+#define OBJFCN_GLOBAL 0x20
+
+/* Load DT_NEEDED of shared objects with objopen instead of dlopen, so
+ * their symbols are searched in the dependencies, breadth first, before
+ * the host. A library is loaded once and shared by all objects needing
+ * it. Libraries the host has loaded already, like libc, and those not
+ * found in the objlib_set_path directories or the object's DT_RUNPATH
+ * or DT_RPATH are still dlopen'ed. */
+#define OBJFCN_LOAD_NEEDED 0x40
+
+/* Colon separated directories searched first for OBJFCN_LOAD_NEEDED, or
+ * NULL. OBJFCN_LIBRARY_PATH in the environment sets it too. */
+void objlib_set_path(const char* path);
+
+/* Record where objopen spends its time, see objstat. */
+#define OBJFCN_STATS 0x80
+
+/* objsym returns a stub for each function, which jumps to the newest
+ * version loaded by objreload. x86 and aarch64 only. */
+#define OBJFCN_RELOADABLE 0x100
+
+/* Read only the parts of a regular file the loader uses, with pread,
+ * instead of mapping all of it: the headers, the loaded sections and
+ * their symbols and relocations, or the segments of a shared object.
+ * SHF_COMPRESSED sections among them are inflated when objfcn.c is
+ * built with OBJFCN_ZLIB or OBJFCN_ZSTD. */
+#define OBJFCN_STREAM 0x200
+
+/* objopen, objsym and objclose may be called from any thread. objsym
+ * takes no locks. objerror returns the error of the calling thread. */
 void* objopen(const char* filename, int flags);
 
+/* Runs the object's destructors, including the thread_local ones of
+ * the calling thread, then frees it. thread_local destructors of other
+ * threads are skipped once the handle is closed. */
 int objclose(void* handle);
 
+/* objopen for an image already in memory. |buf| is parsed in place and
+ * need not outlive the call; copy-free only if it is pointer aligned.
+ * |name| is what logs and profilers show, or NULL. */
+void* objopen_mem(const void* buf, size_t size, const char* name, int flags);
+
+/* objopen reading |fd|, which is left open. Regular files and memfds are
+ * mapped, anything else is read from the current offset. The image
+ * cache is not used for either. */
+void* objopen_fd(int fd, const char* name, int flags);
+
+/* Loads |filename| with the flags of |handle|, which must have
+ * OBJFCN_RELOADABLE, as its new version and returns the new handle, or
+ * NULL leaving |handle| as it was. Function pointers objsym returned for
+ * any version then call the new code; each function switches over with
+ * one atomic store. Functions only the old version defines keep calling
+ * it. |handle| stays loaded, since threads may still be running its
+ * code: objclose it once none can be. */
+void* objreload(void* handle, const char* filename);
+
 void* objsym(void* handle, const char* symbol);
 
 char* objerror(void);
 
+/* Looks up |count| symbols at once, setting addrs[i] to the address of
+ * symbols[i] or NULL. Unless |hashes| is NULL, hashes[i] must be
+ * objsym_hash(symbols[i]), so tables of names can be hashed once for
+ * all handles. Returns the number of symbols found. */
+int objsym_batch(void* handle, const char* const* symbols,
+                 const uint32_t* hashes, int count, void** addrs);
+
+uint32_t objsym_hash(const char* symbol);
+
+/* A defined global or weak symbol. |type| is the ELF STT_* value. */
+typedef struct {
+  const char* name;
+  void* addr;
+  size_t size;
+  int type;
+} obj_symbol_info;
+
+/* Returning nonzero stops the iteration. |sym| is valid until objclose. */
+typedef int (*obj_symbol_callback)(const obj_symbol_info* sym, void* arg);
+
+/* Calls |cb| for each defined global symbol of |handle| in strcmp order.
+ * objsym_prefix visits only the names starting with |prefix|. Both go
+ * over a sorted table built from memory on the first call, without
+ * reading the file again. Return the value which stopped the iteration,
+ * 0 after visiting all symbols, or -1 if the table could not be built.
+ * Addresses are those of the code, not the OBJFCN_RELOADABLE stubs. */
+int objsym_foreach(void* handle, obj_symbol_callback cb, void* arg);
+
+int objsym_prefix(void* handle, const char* prefix, obj_symbol_callback cb,
+                  void* arg);
+
+/* Usage of the code arena all objects are loaded into. The arena is
+ * reclaimed by objclose, so free space may be split into several
+ * extents; largest_free tells how large an object still fits. */
+typedef struct {
+  size_t arena_size;
+  size_t used;
+  size_t free;
+  size_t largest_free;
+  int free_extents;
+  int chunks;
+} obj_arena_stats;
+
+int objarena_stats(obj_arena_stats* stats);
+
+#define OBJFCN_STAT_RELOC_TYPES 32
+
+typedef struct {
+  unsigned type;  /* R_* of the target */
+  uint64_t count;
+} obj_reloc_count;
+
+/* Times are in nanoseconds. Under objopen_many, total_ns is the time of
+ * the whole call. Lazy binding adds to the lookups of a handle after
+ * objopen but not to the totals. */
+typedef struct {
+  int num_objects;
+  int cached;            /* loaded from the image cache */
+  uint64_t read_ns;
+  uint64_t load_ns;      /* layout, copying and everything else */
+  uint64_t relocate_ns;
+  uint64_t resolve_ns;   /* external lookups, part of relocate_ns */
+  uint64_t init_ns;      /* constructors */
+  uint64_t total_ns;
+  uint64_t relocs;
+  obj_reloc_count reloc_types[OBJFCN_STAT_RELOC_TYPES];
+  uint64_t reloc_types_other;  /* beyond OBJFCN_STAT_RELOC_TYPES types */
+  uint64_t lookups;
+  uint64_t lookup_cache_hits;
+  uint64_t host_lookups;  /* dlsym calls */
+  uint64_t plt_stubs;     /* emitted for relocatable objects */
+  uint64_t got_slots;
+  uint64_t code_bytes;
+} obj_stats;
+
+/* Copies the stats of a handle loaded with OBJFCN_STATS, or with NULL,
+ * the sum over all such handles loaded so far. Returns 0, or -1 for a
+ * handle loaded without the flag. */
+int objstat(void* handle, obj_stats* stats);
+
+/* Log levels. Messages go to stderr; the default is OBJFCN_LOG_ERROR
+ * unless the OBJFCN_LOG_LEVEL environment variable says otherwise. */
+#define OBJFCN_LOG_NONE 0
+#define OBJFCN_LOG_ERROR 1
+#define OBJFCN_LOG_INFO 2
+#define OBJFCN_LOG_DEBUG 3  /* per relocation */
+
+void objlog_set_level(int level);
+
+/* Called with event "objopen" or "objclose" and the address range of
+ * the object's code. */
+typedef void (*obj_map_callback)(const char* event, void* start, void* end,
+                                 const char* filename, void* arg);
+
+void objlog_set_map_callback(obj_map_callback cb, void* arg);
+
+/* Profiler integration, off unless set here or by OBJFCN_PROF=<mask> in
+ * the environment. OBJFCN_PROF_PERF_MAP appends the functions of each
+ * object loaded afterwards to /tmp/perf-<pid>.map for perf.
+ * OBJFCN_PROF_GDB_JIT registers each object's symbols with the GDB JIT
+ * interface until it is closed. */
+#define OBJFCN_PROF_PERF_MAP 0x1
+#define OBJFCN_PROF_GDB_JIT 0x2
+
+void objprof_set(int prof);
+
 #endif /* RUBY_OBJFCN_H */
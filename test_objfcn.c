@@ -1,7 +1,14 @@
 #include "objfcn.h"
 
 #include <assert.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "func.c"
 
@@ -20,12 +27,141 @@ int func_in_main(void) {
   return 99;
 }
 
+__thread int host_tls = 7;
+
+extern char** environ;
+
+// Loads of batch.c seen by check_extra and runs of its destructor.
+static int batch_opens;
+static int batch_finis;
+
+void batch_fini_called(void) {
+  batch_finis++;
+}
+
+static int count_symbol(const obj_symbol_info* sym, void* arg) {
+  int* n = (int*)arg;
+  (*n)++;
+  return 0;
+}
+
+// Stops at func and checks it is seen as a function.
+static int find_func(const obj_symbol_info* sym, void* arg) {
+  if (strcmp(sym->name, "func")) return 0;
+  check(STT_FUNC, sym->type);
+  check(1, sym->size > 0);
+  *(void**)arg = sym->addr;
+  return 1;
+}
+
+static void* call_tls_func(void* arg) {
+  return (void*)(intptr_t)((func_t)arg)(1);
+}
+
+// Checks an extra object calling into a fresh copy of func. Returns 0
+// unless it has one of the functions we know.
+static int check_extra(void* handle) {
+  func_t bp = (func_t)objsym(handle, "batch_func");
+  func_t tp = (func_t)objsym(handle, "batch_tls_func");
+  func_t np = (func_t)objsym(handle, "needed_func");
+  if (bp) {
+    check(2 * (-1 + 1 + -1 + 42 + 99), bp(-1));
+    batch_opens++;
+  }
+  if (tp) {
+    check(6 * 100 + 1 + 7, tp(1));
+    check(8 * 100 + 3 + 7, tp(2));
+    // Another thread starts from the initial values.
+    pthread_t thread;
+    void* result = NULL;
+    pthread_create(&thread, NULL, call_tls_func, (void*)tp);
+    pthread_join(thread, &result);
+    check(6 * 100 + 1 + 7, (int)(intptr_t)result);
+  }
+  if (np) {
+    check(-1 + 1 + -1 + 42 + 99 + 1, np(-1));
+  }
+  return bp || np;
+}
+
+// The GDB JIT interface objfcn registers objects with.
+struct jit_code_entry {
+  struct jit_code_entry* next_entry;
+  struct jit_code_entry* prev_entry;
+  const char* symfile_addr;
+  uint64_t symfile_size;
+};
+
+struct jit_descriptor {
+  uint32_t version;
+  uint32_t action_flag;
+  struct jit_code_entry* relevant_entry;
+  struct jit_code_entry* first_entry;
+};
+
+extern struct jit_descriptor __jit_debug_descriptor;
+
+// Whether |size| bytes at |p| contain |s|.
+static int contains(const char* p, size_t size, const char* s) {
+  size_t len = strlen(s);
+  for (size_t i = 0; i + len <= size; i++) {
+    if (!memcmp(p + i, s, len)) return 1;
+  }
+  return 0;
+}
+
+// Checks what OBJFCN_PROF=3 left for a loaded object with func.
+static void check_prof(void) {
+  struct jit_code_entry* e = __jit_debug_descriptor.first_entry;
+  check(1, e != NULL);
+  if (e) {
+    check(0, memcmp(e->symfile_addr, "\177ELF", 4));
+    check(1, contains(e->symfile_addr, e->symfile_size, "func"));
+  }
+
+  char path[64];
+  char buf[4096];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  FILE* fp = fopen(path, "r");
+  size_t n = fp ? fread(buf, 1, sizeof(buf), fp) : 0;
+  if (fp) fclose(fp);
+  check(1, contains(buf, n, "func ["));
+  unlink(path);
+}
+
+#define NUM_THREADS 4
+
+static const char* g_filename;
+static int g_flags;
+
+// Loads, calls and closes a private copy of the object repeatedly.
+static void* load_loop(void* arg) {
+  long errors = 0;
+  for (int i = 0; i < 50; i++) {
+    void* handle = objopen(g_filename, g_flags);
+    if (handle == NULL) {
+      fprintf(stderr, "objopen failed in thread: %s\n", objerror());
+      errors++;
+      continue;
+    }
+    func_t fp = (func_t)objsym(handle, "func");
+    // A fresh copy has g_counter == 0.
+    if (fp == NULL || fp(-1) != -1 + 1 + -1 + 42 + 99) {
+      errors++;
+    }
+    objclose(handle);
+  }
+  return (void*)errors;
+}
+
 int main(int argc, char* argv[]) {
   if (argc <= 1) {
     fprintf(stderr, "object file not specified\n");
     return 1;
   }
-  void* handle = objopen(argv[1], 0);
+  // The optional second argument is passed as objopen flags.
+  int flags = argc > 2 ? strtol(argv[2], NULL, 0) : 0;
+  void* handle = objopen(argv[1], flags);
   if (handle == NULL) {
     fprintf(stderr, "objopen failed: %s\n", objerror());
     return 1;
@@ -37,6 +173,225 @@ int main(int argc, char* argv[]) {
   }
   check(func(-1), fp(-1));
   check(func(-1), fp(-1));
+  if (getenv("OBJFCN_PROF")) {
+    check_prof();
+  }
+
+  const int* cp = (const int*)objsym(handle, "g_const");
+  check(42, cp ? *cp : -1);
+  check(1, objsym(handle, "no_such_symbol") == NULL);
+
+  const char* names[] = {"func", "no_such_symbol", "g_const", "dummy"};
+  uint32_t hashes[4];
+  void* addrs[4];
+  check(3, objsym_batch(handle, names, NULL, 4, addrs));
+  check(1, addrs[0] == (void*)fp && addrs[1] == NULL && addrs[2] == cp &&
+           addrs[3] == objsym(handle, "dummy"));
+  for (int i = 0; i < 4; i++) {
+    hashes[i] = objsym_hash(names[i]);
+  }
+  check(3, objsym_batch(handle, names, hashes, 4, addrs));
+  check(1, addrs[0] == (void*)fp && addrs[2] == cp);
+
+  int num_g = 0, num_all = 0;
+  check(0, objsym_prefix(handle, "g_", count_symbol, &num_g));
+  check(3, num_g);
+  check(0, objsym_foreach(handle, count_symbol, &num_all));
+  check(1, num_all >= 5);
+  void* found = NULL;
+  check(1, objsym_foreach(handle, find_func, &found));
+  check(1, found == (void*)fp);
+
+  obj_stats load_stats;
+  check(-1, objstat(handle, &load_stats));
   objclose(handle);
+
+  // Pipes such as /dev/stdin can be read only once; everything else has
+  // to load again.
+  struct stat st;
+  int rereadable = !stat(argv[1], &st) && S_ISREG(st.st_mode);
+  handle = rereadable ? objopen(argv[1], flags | OBJFCN_STATS) : NULL;
+  if (handle) {
+    check(0, objstat(handle, &load_stats));
+    check(1, load_stats.num_objects);
+    check(1, load_stats.relocs > 0 || load_stats.cached);
+    check(1, load_stats.lookups >= 1 || load_stats.cached);
+    // Set by the Makefile once the image cache has this object.
+    if (getenv("EXPECT_CACHED")) check(1, load_stats.cached);
+    check(1, load_stats.total_ns >= load_stats.relocate_ns + load_stats.init_ns);
+    check(1, load_stats.code_bytes > 0);
+    // When the arena is near the executable, func_in_main is called
+    // directly and loads of addresses from GOT slots become lea. It may
+    // have had to go elsewhere.
+    intptr_t dist = (intptr_t)((uintptr_t)objsym(handle, "func") -
+                               (uintptr_t)&func_in_main);
+    if (dist < INT32_MAX / 2 && dist > INT32_MIN / 2) {
+      check(0, (int)load_stats.plt_stubs);
+      check(0, (int)load_stats.got_slots);
+    }
+    objclose(handle);
+    check(0, objstat(NULL, &load_stats));
+    check(1, load_stats.num_objects >= 1);
+
+    g_filename = argv[1];
+    g_flags = flags;
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+      pthread_create(&threads[i], NULL, load_loop, NULL);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+      void* errors;
+      pthread_join(threads[i], &errors);
+      check(0, (int)(long)errors);
+    }
+  } else if (rereadable) {
+    fprintf(stderr, "objopen failed: %s\n", objerror());
+    failed++;
+  }
+
+#if defined(__x86_64__)
+  // A far PC32 reference fails the load instead of being truncated.
+  void* far = objopen("far_64_pie.o", flags);
+  if (far) {
+    char** (*fe)(void) = (char** (*)(void))objsym(far, "far_environ");
+    check(1, fe && fe() == environ);
+    objclose(far);
+  } else {
+    check(1, strstr(objerror(), "PC32 relocation against environ out of "
+                                "range") != NULL);
+  }
+#endif
+
+  // The same image from memory and through a descriptor.
+  FILE* file = fopen(argv[1], "rb");
+  char* image = NULL;
+  size_t image_size = 0;
+  if (file && !fseek(file, 0, SEEK_END) && ftell(file) > 0) {
+    image_size = ftell(file);
+    image = (char*)malloc(image_size);
+    rewind(file);
+    if (fread(image, 1, image_size, file) != image_size) image_size = 0;
+  }
+  if (file) fclose(file);
+  check(rereadable, image_size > 0);
+  if (image_size) {
+    handle = objopen_mem(image, image_size, argv[1], flags);
+    func_t mp = handle ? (func_t)objsym(handle, "func") : NULL;
+    check(-1 + 1 + -1 + 42 + 99, mp ? mp(-1) : 0);
+    if (handle) objclose(handle);
+
+    int fd = open(argv[1], O_RDONLY);
+    handle = objopen_fd(fd, argv[1], flags);
+    mp = handle ? (func_t)objsym(handle, "func") : NULL;
+    check(-1 + 1 + -1 + 42 + 99, mp ? mp(-1) : 0);
+    if (handle) objclose(handle);
+    close(fd);
+
+    // Truncated copies fail instead of being read past their end.
+    for (size_t n = image_size / 8; n < image_size; n += image_size / 8) {
+      char* part = (char*)malloc(n);
+      memcpy(part, image, n);
+      handle = objopen_mem(part, n, argv[1], flags);
+      check(1, handle == NULL);
+      if (handle) objclose(handle);
+      free(part);
+    }
+  }
+  free(image);
+
+  // A reloaded copy starts with g_counter == 0 again, and the stub the
+  // first version gave out calls it.
+  void* v1 = rereadable ? objopen(argv[1], flags | OBJFCN_RELOADABLE) : NULL;
+  if (v1) {
+    func_t f1 = (func_t)objsym(v1, "func");
+    check(-1 + 1 + -1 + 42 + 99, f1(-1));
+    check(-1 + 2 + -1 + 42 + 99, f1(-1));
+    void* v2 = objreload(v1, argv[1]);
+    if (v2) {
+      check(1, f1 == (func_t)objsym(v2, "func"));
+      check(-1 + 1 + -1 + 42 + 99, f1(-1));
+      objclose(v1);
+      check(-1 + 2 + -1 + 42 + 99, f1(-1));
+      objclose(v2);
+    } else {
+      fprintf(stderr, "objreload failed: %s\n", objerror());
+      failed++;
+      objclose(v1);
+    }
+  } else if (rereadable) {
+    fprintf(stderr, "objopen failed: %s\n", objerror());
+    failed++;
+  }
+
+  // Further arguments are loaded together with the first one and may
+  // call into it.
+  if (argc > 3) {
+    int count = argc - 3 + 2;
+    const char* files[count];
+    char* errors[count];
+    files[0] = argv[1];
+    for (int i = 3; i < argc; i++) {
+      files[i - 2] = argv[i];
+    }
+    files[count - 1] = "no_such_file.o";
+    void** handles = objopen_many(files, count, flags, errors);
+    check(1, handles != NULL);
+    for (int i = 0; i < count - 1; i++) {
+      if (handles[i] == NULL) {
+        fprintf(stderr, "objopen_many failed: %s\n", errors[i]);
+        failed++;
+      }
+    }
+    check(1, handles[count - 1] == NULL && errors[count - 1] != NULL);
+    free(errors[count - 1]);
+
+    if (handles[0] && handles[1]) {
+      check(1, check_extra(handles[1]));
+    }
+    for (int i = 0; i < count; i++) {
+      if (handles[i]) {
+        objclose(handles[i]);
+      }
+    }
+    free(handles);
+
+    // Constructors run after those of the members they bind to, in
+    // whatever order the members are given.
+    const char* reversed[2] = {argv[3], argv[1]};
+    handles = objopen_many(reversed, 2, flags, NULL);
+    check(1, handles != NULL);
+    if (handles && handles[0] && handles[1]) {
+      check(1, check_extra(handles[0]));
+      objclose(handles[0]);
+      objclose(handles[1]);
+    } else {
+      fprintf(stderr, "objopen_many failed: %s\n", objerror());
+      failed++;
+    }
+    free(handles);
+
+    // The same, through the global namespace instead of a batch.
+    void* provider = objopen(argv[1], flags | OBJFCN_GLOBAL);
+    void* user = provider ? objopen(argv[3], flags) : NULL;
+    if (user) {
+      check(1, check_extra(user));
+      objclose(user);
+    } else {
+      fprintf(stderr, "objopen failed: %s\n", objerror());
+      failed++;
+    }
+    if (provider) {
+      objclose(provider);
+    }
+  }
+
+  check(batch_opens, batch_finis);
+
+  // Everything must go back to the arena as a single free extent.
+  check(1, __jit_debug_descriptor.first_entry == NULL);
+  obj_arena_stats stats;
+  objarena_stats(&stats);
+  check(0, (int)stats.used);
+  check(1, stats.free_extents);
   return failed;
 }
@@ -1,7 +1,9 @@
 #include "objfcn.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <string>
 
@@ -22,12 +24,41 @@ int func_in_main(void) {
   return 99;
 }
 
+// Destructor runs of objects in cpp.cc: 1 for the static one, 2 for the
+// thread_local one.
+static int dtor_counts[3];
+
+extern "C" void note_dtor(int which) {
+  dtor_counts[which]++;
+}
+
+static void* call_in_thread(void* fp) {
+  return (void*)(long)((func_t)fp)(-1);
+}
+
+static int g_flags;
+
+// Loads, calls and closes a copy of the object at |filename|.
+static void* open_in_thread(void* filename) {
+  void* handle = objopen((const char*)filename, g_flags);
+  if (handle == NULL) {
+    fprintf(stderr, "objopen failed in thread: %s\n", objerror());
+    return NULL;
+  }
+  func_t fp = (func_t)objsym(handle, "func");
+  long r = fp(-1);
+  objclose(handle);
+  return (void*)r;
+}
+
 int main(int argc, char* argv[]) {
   if (argc <= 1) {
     fprintf(stderr, "object file not specified\n");
     return 1;
   }
-  void* handle = objopen(argv[1], 0);
+  // The optional second argument is passed as objopen flags.
+  int flags = argc > 2 ? strtol(argv[2], NULL, 0) : 0;
+  void* handle = objopen(argv[1], flags);
   if (handle == NULL) {
     fprintf(stderr, "objopen failed: %s\n", objerror());
     return 1;
@@ -44,7 +75,48 @@ int main(int argc, char* argv[]) {
   Base* b = make_base();
   b->vf();
 
+  // A second copy gets TLS of its own.
+  void* handle2 = objopen(argv[1], flags);
+  if (handle2 == NULL) {
+    fprintf(stderr, "objopen failed: %s\n", objerror());
+    return 1;
+  }
+  func_t fp2 = (func_t)objsym(handle2, "func");
+  check(140, fp2(-1));
+  check(142, fp(-1));
+
+  // A new thread starts from the initial image, without the constructor.
+  pthread_t th;
+  void* ret;
+  pthread_create(&th, NULL, call_in_thread, (void*)fp);
+  pthread_join(th, &ret);
+  check(139, (int)(long)ret);
+  check(141, fp2(-1));
+  check(0, dtor_counts[1]);
+  check(1, dtor_counts[2]);
+
+  // Each objclose runs the static destructor and the thread_local one of
+  // this thread.
+  objclose(handle2);
+  check(1, dtor_counts[1]);
+  check(2, dtor_counts[2]);
   objclose(handle);
+  check(2, dtor_counts[1]);
+  check(3, dtor_counts[2]);
+
+  // The same from another thread, whose malloc arena may be far away.
+  g_flags = flags;
+  pthread_create(&th, NULL, open_in_thread, argv[1]);
+  pthread_join(th, &ret);
+  check(140, (int)(long)ret);
+  check(3, dtor_counts[1]);
+  check(4, dtor_counts[2]);
+
+  // Everything must go back to the arena as a single free extent.
+  obj_arena_stats stats;
+  objarena_stats(&stats);
+  check(0, (int)stats.used);
+  check(1, stats.free_extents);
 
   std::string s("done");
   fprintf(stderr, "%s failed=%d\n", s.c_str(), failed);